@@ -0,0 +1,447 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "atlas.h"
+#include "gralloctexture.h"
+#include "halformats.h"
+#include "pixelconversion.h"
+
+#include <QDebug>
+#include <QMutexLocker>
+
+#include <QtQuick/private/qsgtexture_p.h>
+
+#include <cstring>
+
+// Same defaults as Qt's own atlas: images up to 256 pixels wide and tall go into the atlas,
+// pages start out at 512x512 and grow for every page added.
+static const int atlasSizeLimit = 256;
+static const int initialPageSize = 512;
+static const int maxPageSize = 2048;
+
+// Every rect is padded by a pixel on each side
+static const int padding = 1;
+
+AtlasPage::AtlasPage(std::shared_ptr<GrallocBuffer> buffer, const QSize& size) :
+    m_buffer(buffer), m_size(size), m_liveRects(0), m_dirty(false), m_texture(0), m_filter(0)
+{
+}
+
+AtlasPage::~AtlasPage()
+{
+    if (m_texture != 0)
+        qWarning() << "Atlas page destroyed without releasing its texture";
+}
+
+QSize AtlasPage::size() const
+{
+    return m_size;
+}
+
+std::shared_ptr<GrallocBuffer> AtlasPage::buffer() const
+{
+    return m_buffer;
+}
+
+QRect AtlasPage::allocate(const QSize& size)
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (size.width() > m_size.width() || size.height() > m_size.height())
+        return QRect();
+
+    // Prefer the shelf wasting the least height, but don't put small images on much taller shelves
+    // as long as there's room for a new shelf.
+    Shelf* best = nullptr;
+    Shelf* fallback = nullptr;
+    for (auto& shelf : m_shelves) {
+        if (shelf.height < size.height() || shelf.x + size.width() > m_size.width())
+            continue;
+
+        if (shelf.height * 2 <= size.height() * 3) {
+            if (!best || shelf.height < best->height)
+                best = &shelf;
+        } else if (!fallback || shelf.height < fallback->height) {
+            fallback = &shelf;
+        }
+    }
+
+    if (!best) {
+        const int top = m_shelves.empty() ? 0 : m_shelves.back().y + m_shelves.back().height;
+        if (top + size.height() <= m_size.height()) {
+            m_shelves.push_back({ top, size.height(), 0, 0 });
+            best = &m_shelves.back();
+        } else {
+            best = fallback;
+        }
+    }
+
+    if (!best)
+        return QRect();
+
+    const QRect rect(best->x, best->y, size.width(), size.height());
+    best->x += size.width();
+    best->liveRects++;
+    m_liveRects++;
+    return rect;
+}
+
+void AtlasPage::free(const QRect& rect)
+{
+    QMutexLocker locker(&m_mutex);
+
+    for (auto& shelf : m_shelves) {
+        if (shelf.y != rect.y())
+            continue;
+
+        shelf.liveRects--;
+        m_liveRects--;
+
+        // An emptied shelf can be filled from the left again
+        if (shelf.liveRects == 0)
+            shelf.x = 0;
+        break;
+    }
+
+    // Compact: merge neighbouring empty shelves into taller ones and hand empty space at the bottom back
+    for (size_t i = 0; i + 1 < m_shelves.size();) {
+        if (m_shelves[i].liveRects == 0 && m_shelves[i + 1].liveRects == 0) {
+            m_shelves[i].height += m_shelves[i + 1].height;
+            m_shelves.erase(m_shelves.begin() + i + 1);
+        } else {
+            i++;
+        }
+    }
+    while (!m_shelves.empty() && m_shelves.back().liveRects == 0) {
+        m_shelves.pop_back();
+    }
+}
+
+bool AtlasPage::isEmpty() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_liveRects == 0;
+}
+
+QMutex* AtlasPage::writeMutex()
+{
+    return &m_writeMutex;
+}
+
+void AtlasPage::markDirty()
+{
+    m_dirty = true;
+}
+
+GLuint AtlasPage::textureId(QOpenGLFunctions* gl)
+{
+    // Just the name, parameters and contents are set up by the first bind()
+    if (m_texture == 0) {
+        gl->glGenTextures(1, &m_texture);
+        m_dirty = true;
+    }
+    return m_texture;
+}
+
+void AtlasPage::bind(QOpenGLFunctions* gl, const EglImageFunctions& eglImageFunctions, const bool linearFiltering)
+{
+    const int filter = linearFiltering ? GL_LINEAR : GL_NEAREST;
+
+    gl->glBindTexture(GL_TEXTURE_2D, textureId(gl));
+    if (m_filter == 0) {
+        gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+
+    // Re-target the EGLImage after CPU writes so that drivers drop stale texture caches
+    if (m_dirty.exchange(false))
+        eglImageFunctions.glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, m_buffer->image);
+
+    if (m_filter != filter) {
+        gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+        gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+        m_filter = filter;
+    }
+}
+
+void AtlasPage::releaseTexture(QOpenGLFunctions* gl)
+{
+    if (m_texture != 0 && gl)
+        gl->glDeleteTextures(1, &m_texture);
+    m_texture = 0;
+    m_filter = 0;
+}
+
+AtlasTexture::AtlasTexture(AtlasManager* manager, std::shared_ptr<AtlasPage> page, std::shared_ptr<QRect> rect,
+                           const QImage& image, const bool hasAlphaChannel, QOpenGLContext* gl) :
+    QSGTexture(), m_manager(manager), m_page(page), m_rect(rect), m_completion(std::make_shared<UploadCompletion>()),
+    m_image(image), m_hasAlphaChannel(hasAlphaChannel), m_gl(gl), m_nonAtlasTexture(nullptr)
+{
+    const QSize pageSize = page->size();
+    m_subRect = QRectF((rect->x() + padding) / (qreal)pageSize.width(),
+                       (rect->y() + padding) / (qreal)pageSize.height(),
+                       image.width() / (qreal)pageSize.width(),
+                       image.height() / (qreal)pageSize.height());
+}
+
+AtlasTexture::~AtlasTexture()
+{
+    m_completion->cancel();
+    delete m_nonAtlasTexture;
+}
+
+int AtlasTexture::textureId() const
+{
+    // The batch renderer compares ids of every node, so this stays free of GL state changes.
+    // The page's contents only get attached once it's bound.
+    QOpenGLFunctions* gl = m_gl ? m_gl->functions() : nullptr;
+    if (!gl) {
+        qWarning() << "Cannot get texture id, GL context is null";
+        return 0;
+    }
+
+    return m_page->textureId(gl);
+}
+
+QSize AtlasTexture::textureSize() const
+{
+    return m_image.size();
+}
+
+bool AtlasTexture::hasAlphaChannel() const
+{
+    return m_hasAlphaChannel;
+}
+
+bool AtlasTexture::hasMipmaps() const
+{
+    return false;
+}
+
+bool AtlasTexture::isAtlasTexture() const
+{
+    return true;
+}
+
+QRectF AtlasTexture::normalizedTextureSubRect() const
+{
+    return m_subRect;
+}
+
+QSGTexture* AtlasTexture::removedFromAtlas() const
+{
+    // Same as Qt's atlas, fall back to a plain texture created from the source image
+    if (!m_nonAtlasTexture) {
+        m_nonAtlasTexture = new QSGPlainTexture();
+        m_nonAtlasTexture->setImage(m_image);
+        m_nonAtlasTexture->setHasAlphaChannel(m_hasAlphaChannel);
+        m_nonAtlasTexture->setFiltering(filtering());
+    }
+    return m_nonAtlasTexture;
+}
+
+void AtlasTexture::bind()
+{
+    QOpenGLFunctions* gl = m_gl ? m_gl->functions() : nullptr;
+    if (!gl) {
+        qWarning() << "Cannot bind texture, GL context is null";
+        return;
+    }
+
+    // Will block until our part of the page got written by the uploader machinery.
+    awaitUpload();
+    m_page->bind(gl, m_manager->eglImageFunctions(), filtering() == QSGTexture::Linear);
+}
+
+void AtlasTexture::awaitUpload() const
+{
+    UploadScheduler::shared()->runQueued(m_completion.get());
+    if (m_completion->wait() != UploadCompletion::Completed)
+        qWarning() << "Atlas upload failed";
+}
+
+AtlasManager::AtlasManager(std::shared_ptr<GrallocBufferPool> bufferPool, std::shared_ptr<UploadScheduler> scheduler,
+                           const uint32_t usage, const uint32_t lockUsage) :
+    m_bufferPool(bufferPool), m_scheduler(scheduler), m_usage(usage), m_lockUsage(lockUsage),
+    m_nextPageSize(initialPageSize)
+{
+}
+
+AtlasManager::~AtlasManager()
+{
+    invalidate(nullptr);
+}
+
+const EglImageFunctions& AtlasManager::eglImageFunctions() const
+{
+    return m_eglImageFunctions;
+}
+
+std::shared_ptr<AtlasPage> AtlasManager::newPage(const int maxTextureSize)
+{
+    const int pageLimit = qMin(maxPageSize, maxTextureSize);
+    const int pageSize = qMin(m_nextPageSize, pageLimit);
+
+    const BufferDescriptor descriptor { pageSize, pageSize, HAL_PIXEL_FORMAT_RGBA_8888, m_usage };
+    std::shared_ptr<GrallocBuffer> buffer = m_bufferPool->acquire(descriptor);
+    if (!buffer || !m_bufferPool->ensureImage(buffer.get())) {
+        qWarning() << "Failed to allocate atlas page of size" << pageSize;
+        return nullptr;
+    }
+
+    // Grow with every page added, busy UIs end up with few large pages
+    m_nextPageSize = qMin(m_nextPageSize * 2, pageLimit);
+
+    auto page = std::make_shared<AtlasPage>(buffer, QSize(pageSize, pageSize));
+    m_pages.push_back(page);
+    return page;
+}
+
+AtlasTexture* AtlasManager::create(const QImage& image, const bool hasAlphaChannel, const int maxTextureSize,
+                                   const bool async, QOpenGLContext* gl)
+{
+    if (image.isNull() || image.width() > atlasSizeLimit || image.height() > atlasSizeLimit)
+        return nullptr;
+
+    const QSize paddedSize = image.size() + QSize(padding * 2, padding * 2);
+    std::shared_ptr<AtlasPage> page;
+    QRect rect;
+
+    {
+        QMutexLocker locker(&m_pagesMutex);
+
+        // Page textures can only go away where the render thread's context is current
+        if (gl && QOpenGLContext::currentContext() == gl)
+            releaseEmptyPagesLocked(gl->functions());
+
+        for (const auto& candidate : m_pages) {
+            rect = candidate->allocate(paddedSize);
+            if (!rect.isEmpty()) {
+                page = candidate;
+                break;
+            }
+        }
+
+        if (!page) {
+            page = newPage(maxTextureSize);
+            if (!page)
+                return nullptr;
+
+            rect = page->allocate(paddedSize);
+            if (rect.isEmpty())
+                return nullptr;
+        }
+    }
+
+    // The rect stays reserved until both the texture and its upload job are done with it
+    std::shared_ptr<QRect> region(new QRect(rect), [page](QRect* freed) {
+        page->free(*freed);
+        delete freed;
+    });
+
+    AtlasTexture* texture = new AtlasTexture(this, page, region, image, hasAlphaChannel, gl);
+    std::shared_ptr<UploadCompletion> completion = texture->m_completion;
+    BufferAllocator* allocator = m_bufferPool->allocator();
+    const uint32_t lockUsage = m_lockUsage;
+
+    auto uploadFunc = [=](UploadCompletion* result) {
+        if (writeRegion(page.get(), allocator, lockUsage, *region, image, hasAlphaChannel))
+            result->complete(page->buffer(), (region->width() * region->height()) * 4);
+        else
+            result->fail();
+    };
+
+    // Atlas regions are never shared, so don't coalesce. The scheduler skips the job should the
+    // texture be gone before it starts, the region is handed back along with the job then.
+    const UploadScheduler::Key key { 0, UploadParameters() };
+    if (!async || !m_scheduler->submit(key, UploadScheduler::Priority_High, completion, uploadFunc))
+        uploadFunc(completion.get());
+
+    return texture;
+}
+
+bool AtlasManager::writeRegion(AtlasPage* page, BufferAllocator* allocator, const uint32_t lockUsage,
+                               const QRect& rect, const QImage& image, const bool hasAlphaChannel)
+{
+    // Atlas pages are plain RGBA_8888 sampled as-is, the pixels are converted the way a texture of their own would be
+    QImage source = image;
+    unsigned int conversion = GrallocTextureCreator::rgbaConversion(image.format(), hasAlphaChannel);
+    if (conversion == PixelConversion_Invalid) {
+        source = image.convertToFormat(hasAlphaChannel ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32);
+        conversion = GrallocTextureCreator::rgbaConversion(source.format(), hasAlphaChannel);
+    }
+
+    const int width = source.width();
+    const int height = source.height();
+    const int srcBytesPerPixel = source.depth() / 8;
+    GrallocBuffer* buffer = page->buffer().get();
+    const int dstBytesPerLine = buffer->stride * 4;
+
+    QMutexLocker locker(page->writeMutex());
+
+    uint8_t* bits = static_cast<uint8_t*>(allocator->lock(buffer->handle, lockUsage));
+    if (bits) {
+        uint8_t* origin = bits + (size_t)rect.y() * dstBytesPerLine + rect.x() * 4;
+
+        // Edge pixels are repeated into the padding so that linear filtering doesn't pick up neighbours.
+        // They are converted from the source again rather than read back from uncached memory.
+        auto writeRow = [&](uint8_t* dst, const uchar* src) {
+            convertPixels(dst + padding * 4, src, width, conversion);
+            convertPixels(dst, src, 1, conversion);
+            convertPixels(dst + (width + padding) * 4, src + (width - 1) * srcBytesPerPixel, 1, conversion);
+        };
+
+        writeRow(origin, source.constScanLine(0));
+        for (int i = 0; i < height; i++) {
+            writeRow(origin + (size_t)(i + padding) * dstBytesPerLine, source.constScanLine(i));
+        }
+        writeRow(origin + (size_t)(height + padding) * dstBytesPerLine, source.constScanLine(height - 1));
+    }
+
+    allocator->unlock(buffer->handle);
+    page->markDirty();
+    return bits != nullptr;
+}
+
+void AtlasManager::releaseEmptyPages(QOpenGLFunctions* gl)
+{
+    QMutexLocker locker(&m_pagesMutex);
+    releaseEmptyPagesLocked(gl);
+}
+
+void AtlasManager::releaseEmptyPagesLocked(QOpenGLFunctions* gl)
+{
+    // Keep the most recent page around even if empty to avoid reallocating it right away
+    for (auto it = m_pages.begin(); it != m_pages.end() && m_pages.size() > 1;) {
+        const auto& page = *it;
+        if (page->isEmpty() && page.use_count() == 1) {
+            page->releaseTexture(gl);
+            it = m_pages.erase(it);
+        } else {
+            it++;
+        }
+    }
+}
+
+void AtlasManager::invalidate(QOpenGLFunctions* gl)
+{
+    QMutexLocker locker(&m_pagesMutex);
+    for (const auto& page : m_pages) {
+        page->releaseTexture(gl);
+    }
+    m_pages.clear();
+    m_nextPageSize = initialPageSize;
+}
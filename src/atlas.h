@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ATLAS_H
+#define ATLAS_H
+
+#include <QImage>
+#include <QMutex>
+#include <QRect>
+#include <QSGTexture>
+
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "bufferpool.h"
+#include "uploadcompletion.h"
+#include "uploadscheduler.h"
+
+class QSGPlainTexture;
+
+// One large gralloc buffer small images are packed into, shelf by shelf.
+class AtlasPage
+{
+public:
+    AtlasPage(std::shared_ptr<GrallocBuffer> buffer, const QSize& size);
+    ~AtlasPage();
+
+    QSize size() const;
+    std::shared_ptr<GrallocBuffer> buffer() const;
+
+    // Reserves a rect of the given size, returns an empty rect if the page is full
+    QRect allocate(const QSize& size);
+    void free(const QRect& rect);
+    bool isEmpty() const;
+
+    // Serializes CPU writes, gralloc buffers can't be locked by several threads at once
+    QMutex* writeMutex();
+    void markDirty();
+
+    // Render thread only, the id is created once and stays the same until the texture is released
+    GLuint textureId(QOpenGLFunctions* gl);
+    void bind(QOpenGLFunctions* gl, const EglImageFunctions& eglImageFunctions, const bool linearFiltering);
+    void releaseTexture(QOpenGLFunctions* gl);
+
+private:
+    struct Shelf {
+        int y;
+        int height;
+        int x;
+        int liveRects;
+    };
+
+    std::shared_ptr<GrallocBuffer> m_buffer;
+    const QSize m_size;
+
+    mutable QMutex m_mutex;
+    std::vector<Shelf> m_shelves;
+    int m_liveRects;
+
+    QMutex m_writeMutex;
+    std::atomic<bool> m_dirty;
+
+    GLuint m_texture;
+    int m_filter;
+};
+
+class AtlasManager;
+
+class AtlasTexture : public QSGTexture
+{
+    Q_OBJECT
+
+public:
+    ~AtlasTexture();
+
+    int textureId() const override;
+    QSize textureSize() const override;
+    bool hasAlphaChannel() const override;
+    bool hasMipmaps() const override;
+    bool isAtlasTexture() const override;
+    QRectF normalizedTextureSubRect() const override;
+    QSGTexture* removedFromAtlas() const override;
+    void bind() override;
+
+private:
+    AtlasTexture(AtlasManager* manager, std::shared_ptr<AtlasPage> page, std::shared_ptr<QRect> rect,
+                 const QImage& image, const bool hasAlphaChannel, QOpenGLContext* gl);
+
+    void awaitUpload() const;
+
+    AtlasManager* m_manager;
+    std::shared_ptr<AtlasPage> m_page;
+    std::shared_ptr<QRect> m_rect;
+    std::shared_ptr<UploadCompletion> m_completion;
+    QImage m_image;
+    bool m_hasAlphaChannel;
+    QRectF m_subRect;
+    QOpenGLContext* m_gl;
+
+    mutable QSGPlainTexture* m_nonAtlasTexture;
+
+    friend class AtlasManager;
+};
+
+// Places small images into atlas pages from the uploader threads, which keeps them
+// mergeable for the batch renderer while taking the pixel copies off the render thread.
+class AtlasManager
+{
+public:
+    AtlasManager(std::shared_ptr<GrallocBufferPool> bufferPool, std::shared_ptr<UploadScheduler> scheduler,
+                 const uint32_t usage, const uint32_t lockUsage);
+    ~AtlasManager();
+
+    AtlasTexture* create(const QImage& image, const bool hasAlphaChannel, const int maxTextureSize,
+                         const bool async, QOpenGLContext* gl);
+
+    // Drops pages nobody uses anymore, render thread only
+    void releaseEmptyPages(QOpenGLFunctions* gl);
+    void invalidate(QOpenGLFunctions* gl);
+
+    const EglImageFunctions& eglImageFunctions() const;
+
+private:
+    // Called with m_pagesMutex held
+    std::shared_ptr<AtlasPage> newPage(const int maxTextureSize);
+    void releaseEmptyPagesLocked(QOpenGLFunctions* gl);
+    static bool writeRegion(AtlasPage* page, BufferAllocator* allocator, const uint32_t lockUsage,
+                            const QRect& rect, const QImage& image, const bool hasAlphaChannel);
+
+    std::shared_ptr<GrallocBufferPool> m_bufferPool;
+    std::shared_ptr<UploadScheduler> m_scheduler;
+    const uint32_t m_usage;
+    const uint32_t m_lockUsage;
+
+    // Textures are created from the render thread and, for synchronous uploads, from others
+    QMutex m_pagesMutex;
+    std::vector<std::shared_ptr<AtlasPage>> m_pages;
+    int m_nextPageSize;
+    EglImageFunctions m_eglImageFunctions;
+};
+
+#endif
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bufferallocator.h"
+#include "halformats.h"
+
+#include <stdexcept>
+
+EglImageFunctions::EglImageFunctions()
+{
+    eglCreateImageKHR = (PFNEGLCREATEIMAGEKHRPROC)eglGetProcAddress("eglCreateImageKHR");
+    if (!eglCreateImageKHR)
+        throw std::runtime_error("eglCreateImageKHR");
+
+    eglDestroyImageKHR = (PFNEGLDESTROYIMAGEKHRPROC)eglGetProcAddress("eglDestroyImageKHR");
+    if (!eglDestroyImageKHR)
+        throw std::runtime_error("eglDestroyImageKHR");
+
+    glEGLImageTargetTexture2DOES = (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC)eglGetProcAddress("glEGLImageTargetTexture2DOES");
+    if (!glEGLImageTargetTexture2DOES)
+        throw std::runtime_error("glEGLImageTargetTexture2DOES");
+}
+
+int halFormatBytesPerPixel(const int format)
+{
+    switch (format) {
+    case HAL_PIXEL_FORMAT_RGBA_8888:
+    case HAL_PIXEL_FORMAT_RGBX_8888:
+    case HAL_PIXEL_FORMAT_BGRA_8888:
+        return 4;
+    case HAL_PIXEL_FORMAT_RGB_888:
+        return 3;
+    case HAL_PIXEL_FORMAT_RGB_565:
+        return 2;
+    default:
+        return 4;
+    }
+}
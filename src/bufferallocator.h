@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BUFFERALLOCATOR_H
+#define BUFFERALLOCATOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <tuple>
+
+#include <QtGui/qopengl.h>
+
+#define EGL_NO_X11 1
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#undef Bool
+#undef None
+
+struct EglImageFunctions {
+    EglImageFunctions();
+    PFNEGLCREATEIMAGEKHRPROC eglCreateImageKHR;
+    PFNEGLDESTROYIMAGEKHRPROC eglDestroyImageKHR;
+    PFNGLEGLIMAGETARGETTEXTURE2DOESPROC glEGLImageTargetTexture2DOES;
+};
+
+// Geometry, HAL pixel format and gralloc usage of a graphics buffer.
+// Buffers with equal descriptors are interchangeable, which is what the pool keys on.
+struct BufferDescriptor {
+    int width = 0;
+    int height = 0;
+    int format = 0;
+    uint32_t usage = 0;
+
+    bool operator<(const BufferDescriptor& other) const {
+        return std::tie(width, height, format, usage) < std::tie(other.width, other.height, other.format, other.usage);
+    }
+    bool operator==(const BufferDescriptor& other) const {
+        return width == other.width && height == other.height && format == other.format && usage == other.usage;
+    }
+};
+
+// Thin interface around the platform's graphics buffer allocator.
+// Handles are opaque to everything but the allocator that created them.
+class BufferAllocator
+{
+public:
+    virtual ~BufferAllocator() {}
+
+    // Whether what the allocator builds on is present on this system
+    virtual bool isAvailable() const = 0;
+
+    // Returns nullptr on failure, otherwise a handle and its stride in pixels
+    virtual void* allocate(const BufferDescriptor& descriptor, int& stride) = 0;
+    virtual void free(void* handle) = 0;
+
+    virtual void* lock(void* handle, uint32_t lockUsage) = 0;
+    virtual void unlock(void* handle) = 0;
+
+    virtual EGLImageKHR createImage(void* handle) = 0;
+    virtual void destroyImage(EGLImageKHR image) = 0;
+};
+
+int halFormatBytesPerPixel(const int format);
+
+#endif
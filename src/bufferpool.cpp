@@ -0,0 +1,271 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bufferpool.h"
+#include "dmabufallocator.h"
+#ifdef HALIUMQSG_HYBRIS
+#include "hybrisbufferallocator.h"
+#endif
+
+#include <QByteArray>
+#include <QDebug>
+#include <QMutexLocker>
+
+#undef None
+#include <deviceinfo/deviceinfo.h>
+
+// Longest a writer waits for the GPU to let go of a buffer, a lost fence mustn't hang the uploaders
+static const quint64 releaseTimeoutNs = 500 * 1000 * 1000;
+
+void markBufferReleased(GrallocBuffer* buffer, std::shared_ptr<GpuFence> fence)
+{
+    if (buffer && fence)
+        std::atomic_store(&buffer->releaseFence, fence);
+}
+
+void awaitBufferRelease(GrallocBuffer* buffer)
+{
+    if (!buffer)
+        return;
+
+    std::shared_ptr<GpuFence> fence = std::atomic_exchange(&buffer->releaseFence, std::shared_ptr<GpuFence>());
+    if (fence && !fence->isSignaled() && !fence->wait(releaseTimeoutNs))
+        qWarning() << "Timed out waiting for the GPU to release a buffer";
+}
+
+GrallocBufferPool::GrallocBufferPool(std::shared_ptr<BufferAllocator> allocator, const size_t byteLimit) :
+    m_allocator(allocator), m_idleBytes(0), m_idleBuffers(0), m_byteLimit(byteLimit),
+    m_hits(0), m_misses(0), m_evictions(0)
+{
+    m_clock.start();
+}
+
+GrallocBufferPool::~GrallocBufferPool()
+{
+    for (auto& bucket : m_idle) {
+        for (auto& idle : bucket.second) {
+            destroy(idle.buffer);
+        }
+    }
+    m_idle.clear();
+}
+
+std::shared_ptr<GrallocBufferPool> GrallocBufferPool::shared()
+{
+    // Intentionally leaked, freeing gralloc buffers from static destructors races the hybris teardown.
+    static std::shared_ptr<GrallocBufferPool>* pool = []() {
+        DeviceInfo deviceInfo(DeviceInfo::None);
+        bool ok = false;
+        size_t limitMiB = QByteArray::fromStdString(deviceInfo.get("HaliumQsgBufferPoolSize", "32")).toULong(&ok);
+        if (!ok)
+            limitMiB = 32;
+
+        // "hybris" for Android's gralloc, "dmabuf" for shared memory exported through udmabuf on plain Linux.
+        // Builds without libhybris only have the latter.
+#ifdef HALIUMQSG_HYBRIS
+        const char* defaultAllocator = "hybris";
+#else
+        const char* defaultAllocator = "dmabuf";
+#endif
+        const QByteArray allocatorName = qEnvironmentVariableIsSet("HALIUMQSG_BUFFER_ALLOCATOR") ?
+            qgetenv("HALIUMQSG_BUFFER_ALLOCATOR") :
+            QByteArray::fromStdString(deviceInfo.get("HaliumQsgBufferAllocator", defaultAllocator));
+        std::shared_ptr<BufferAllocator> allocator;
+#ifdef HALIUMQSG_HYBRIS
+        if (allocatorName == "hybris")
+            allocator = std::make_shared<HybrisBufferAllocator>();
+#endif
+        if (!allocator) {
+            if (allocatorName != "dmabuf")
+                qWarning() << "Unknown buffer allocator" << allocatorName << "using dmabuf instead";
+            allocator = std::make_shared<DmaBufBufferAllocator>();
+        }
+
+        return new std::shared_ptr<GrallocBufferPool>(
+            std::make_shared<GrallocBufferPool>(allocator, limitMiB * 1024 * 1024));
+    }();
+    return *pool;
+}
+
+BufferAllocator* GrallocBufferPool::allocator() const
+{
+    return m_allocator.get();
+}
+
+std::shared_ptr<GrallocBuffer> GrallocBufferPool::acquire(const BufferDescriptor& descriptor)
+{
+    GrallocBuffer* buffer = nullptr;
+
+    {
+        QMutexLocker locker(&m_mutex);
+        auto bucket = m_idle.find(descriptor);
+        if (bucket != m_idle.end() && !bucket->second.empty()) {
+            // Most recently released buffers are the most likely to still be warm in caches
+            buffer = bucket->second.back().buffer;
+            bucket->second.pop_back();
+            if (bucket->second.empty())
+                m_idle.erase(bucket);
+
+            m_idleBytes -= buffer->byteCount;
+            m_idleBuffers--;
+        }
+    }
+
+    if (buffer) {
+        m_hits++;
+    } else {
+        m_misses++;
+
+        int stride = 0;
+        void* handle = m_allocator->allocate(descriptor, stride);
+        if (!handle)
+            return nullptr;
+
+        buffer = new GrallocBuffer;
+        buffer->descriptor = descriptor;
+        buffer->handle = handle;
+        buffer->stride = stride;
+        buffer->byteCount = (size_t)stride * descriptor.height * halFormatBytesPerPixel(descriptor.format);
+    }
+
+    std::weak_ptr<GrallocBufferPool> weakPool = shared_from_this();
+    std::shared_ptr<BufferAllocator> allocator = m_allocator;
+    return std::shared_ptr<GrallocBuffer>(buffer, [weakPool, allocator](GrallocBuffer* buffer) {
+        auto pool = weakPool.lock();
+        if (pool) {
+            pool->recycle(buffer);
+            return;
+        }
+
+        allocator->destroyImage(buffer->image);
+        allocator->free(buffer->handle);
+        delete buffer;
+    });
+}
+
+bool GrallocBufferPool::ensureImage(GrallocBuffer* buffer)
+{
+    if (!buffer)
+        return false;
+
+    // Pooled buffers carry their EGLImage along, only fresh allocations need one created
+    if (buffer->image == EGL_NO_IMAGE_KHR)
+        buffer->image = m_allocator->createImage(buffer->handle);
+
+    return buffer->image != EGL_NO_IMAGE_KHR;
+}
+
+void GrallocBufferPool::recycle(GrallocBuffer* buffer)
+{
+    std::vector<GrallocBuffer*> victims;
+
+    {
+        QMutexLocker locker(&m_mutex);
+        m_idle[buffer->descriptor].push_back({ buffer, m_clock.elapsed() });
+        m_idleBytes += buffer->byteCount;
+        m_idleBuffers++;
+        evictOverLimit(victims);
+    }
+
+    for (GrallocBuffer* victim : victims)
+        destroy(victim);
+}
+
+void GrallocBufferPool::evictOverLimit(std::vector<GrallocBuffer*>& victims)
+{
+    // Evict the least recently released buffers across all buckets until we fit again
+    while (m_idleBytes > m_byteLimit && !m_idle.empty()) {
+        auto oldest = m_idle.begin();
+        for (auto it = m_idle.begin(); it != m_idle.end(); it++) {
+            if (it->second.front().releasedAt < oldest->second.front().releasedAt)
+                oldest = it;
+        }
+
+        GrallocBuffer* victim = oldest->second.front().buffer;
+        oldest->second.pop_front();
+        if (oldest->second.empty())
+            m_idle.erase(oldest);
+
+        m_idleBytes -= victim->byteCount;
+        m_idleBuffers--;
+        m_evictions++;
+        victims.push_back(victim);
+    }
+}
+
+void GrallocBufferPool::trim(const qint64 maxIdleMs)
+{
+    std::vector<GrallocBuffer*> victims;
+
+    {
+        QMutexLocker locker(&m_mutex);
+        const qint64 now = m_clock.elapsed();
+
+        for (auto bucket = m_idle.begin(); bucket != m_idle.end();) {
+            auto& buffers = bucket->second;
+            while (!buffers.empty() && now - buffers.front().releasedAt >= maxIdleMs) {
+                GrallocBuffer* victim = buffers.front().buffer;
+                buffers.pop_front();
+                m_idleBytes -= victim->byteCount;
+                m_idleBuffers--;
+                m_evictions++;
+                victims.push_back(victim);
+            }
+
+            if (buffers.empty())
+                bucket = m_idle.erase(bucket);
+            else
+                bucket++;
+        }
+    }
+
+    for (GrallocBuffer* victim : victims)
+        destroy(victim);
+}
+
+void GrallocBufferPool::setByteLimit(const size_t byteLimit)
+{
+    std::vector<GrallocBuffer*> victims;
+
+    {
+        QMutexLocker locker(&m_mutex);
+        m_byteLimit = byteLimit;
+        evictOverLimit(victims);
+    }
+
+    for (GrallocBuffer* victim : victims)
+        destroy(victim);
+}
+
+GrallocBufferPool::Stats GrallocBufferPool::stats() const
+{
+    Stats stats;
+    stats.hits = m_hits;
+    stats.misses = m_misses;
+    stats.evictions = m_evictions;
+
+    QMutexLocker locker(&m_mutex);
+    stats.idleBuffers = m_idleBuffers;
+    stats.idleBytes = m_idleBytes;
+    return stats;
+}
+
+void GrallocBufferPool::destroy(GrallocBuffer* buffer)
+{
+    m_allocator->destroyImage(buffer->image);
+    m_allocator->free(buffer->handle);
+    delete buffer;
+}
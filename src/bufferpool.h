@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <QElapsedTimer>
+#include <QMutex>
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "bufferallocator.h"
+#include "gpufence.h"
+
+struct GrallocBuffer {
+    BufferDescriptor descriptor;
+    void* handle = nullptr;
+    EGLImageKHR image = EGL_NO_IMAGE_KHR;
+    int stride = 0;
+    size_t byteCount = 0;
+    // Signaled once the GPU is done with the last commands reading the buffer, set through markBufferReleased()
+    std::shared_ptr<GpuFence> releaseFence;
+};
+
+// Records that the GPU reads from the buffer up to the given fence. Null fences are ignored.
+void markBufferReleased(GrallocBuffer* buffer, std::shared_ptr<GpuFence> fence);
+// Blocks until the GPU is done reading the buffer, before the CPU writes to it again
+void awaitBufferRelease(GrallocBuffer* buffer);
+
+// Recycles graphics buffers (and the EGLImages created for them) by descriptor.
+// Buffers are handed out as shared pointers which find their way back into the pool
+// once the last user lets go of them, allowing them to be shared between textures.
+class GrallocBufferPool : public std::enable_shared_from_this<GrallocBufferPool>
+{
+public:
+    struct Stats {
+        quint64 hits = 0;
+        quint64 misses = 0;
+        quint64 evictions = 0;
+        size_t idleBuffers = 0;
+        size_t idleBytes = 0;
+    };
+
+    GrallocBufferPool(std::shared_ptr<BufferAllocator> allocator, const size_t byteLimit);
+    ~GrallocBufferPool();
+
+    // Process-wide pool backed by the allocator deviceinfo or HALIUMQSG_BUFFER_ALLOCATOR selects
+    static std::shared_ptr<GrallocBufferPool> shared();
+
+    std::shared_ptr<GrallocBuffer> acquire(const BufferDescriptor& descriptor);
+    bool ensureImage(GrallocBuffer* buffer);
+
+    // Frees buffers that have been sitting idle for at least maxIdleMs
+    void trim(const qint64 maxIdleMs = 0);
+    void setByteLimit(const size_t byteLimit);
+
+    Stats stats() const;
+    BufferAllocator* allocator() const;
+
+private:
+    struct IdleBuffer {
+        GrallocBuffer* buffer;
+        qint64 releasedAt;
+    };
+
+    void recycle(GrallocBuffer* buffer);
+    void destroy(GrallocBuffer* buffer);
+    void evictOverLimit(std::vector<GrallocBuffer*>& victims);
+
+    std::shared_ptr<BufferAllocator> m_allocator;
+
+    mutable QMutex m_mutex;
+    std::map<BufferDescriptor, std::deque<IdleBuffer>> m_idle;
+    size_t m_idleBytes;
+    size_t m_idleBuffers;
+    size_t m_byteLimit;
+    QElapsedTimer m_clock;
+
+    std::atomic<quint64> m_hits;
+    std::atomic<quint64> m_misses;
+    std::atomic<quint64> m_evictions;
+};
+
+#endif
@@ -0,0 +1,440 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "colorshaderlibrary.h"
+#include "programbinarycache.h"
+
+#include <algorithm>
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QGuiApplication>
+#include <QMutexLocker>
+#include <QOpenGLFunctions>
+
+static const GLchar* COLOR_CONVERSION_VERTEX = {
+    "#version 100\n"
+    "attribute highp vec3 vertexCoord;\n"
+    "attribute highp vec2 textureCoord;\n"
+    "varying highp vec2 uv;\n"
+    "\n"
+    "void main() {\n"
+    "    uv = textureCoord.xy;\n"
+    "    gl_Position = vec4(vertexCoord,1.0);\n"
+    "}\n"
+};
+
+static const GLchar* PASSTHROUGH_SHADER = {
+    "#version 100\n"
+    "precision mediump float;\n"
+    "uniform sampler2D textureSampler;\n"
+    "uniform bool hasAlpha;\n"
+    "varying highp vec2 uv;\n"
+    "\n"
+    "void main() {\n"
+    "    vec3 color = texture2D(textureSampler, uv).rgb;\n"
+    "    float alpha = hasAlpha ? texture2D(textureSampler, uv).a : 1.0;\n"
+    "    gl_FragColor = vec4(color, alpha);\n"
+    "}\n"
+};
+
+static const GLchar* FLIP_COLOR_CHANNELS_SHADER = {
+    "#version 100\n"
+    "precision mediump float;\n"
+    "uniform sampler2D textureSampler;\n"
+    "varying highp vec2 uv;\n"
+    "\n"
+    "void main() {\n"
+    "    gl_FragColor = vec4(texture2D(textureSampler, uv).bgr, 1.0);\n"
+    "}\n"
+};
+
+static const GLchar* FLIP_COLOR_CHANNELS_WITH_ALPHA_SHADER = {
+    "#version 100\n"
+    "precision mediump float;\n"
+    "uniform sampler2D textureSampler;\n"
+    "varying highp vec2 uv;\n"
+    "\n"
+    "void main() {\n"
+    "    gl_FragColor = texture2D(textureSampler, uv).bgra;\n"
+    "}\n"
+};
+
+static const GLchar* RGB32_TO_RGBA8888_SHADER = {
+    "#version 100\n"
+    "precision mediump float;\n"
+    "uniform sampler2D textureSampler;\n"
+    "uniform bool hasAlpha;\n"
+    "varying highp vec2 uv;\n"
+    "\n"
+    "void main() {\n"
+    "    vec4 sampledColor = texture2D(textureSampler, uv);\n"
+    "    vec3 color = sampledColor.bgr;\n"
+    "    float alpha = hasAlpha ? sampledColor.a : 1.0;\n"
+    "    if (hasAlpha) {\n"
+    "        color = vec3(color.r * alpha, color.g * alpha, color.b * alpha);\n"
+    "    }\n"
+    "    gl_FragColor = vec4(color, alpha);\n"
+    "}\n"
+};
+
+static const GLchar* RGB32_TO_RGBA8888_PREMULT_SHADER = {
+    "#version 100\n"
+    "precision mediump float;\n"
+    "uniform sampler2D textureSampler;\n"
+    "uniform bool hasAlpha;\n"
+    "varying highp vec2 uv;\n"
+    "\n"
+    "void main() {\n"
+    "    vec4 sampledColor = texture2D(textureSampler, uv);\n"
+    "    vec3 color = sampledColor.bgr;\n"
+    "    float alpha = hasAlpha ? sampledColor.a : 1.0;\n"
+    "    if (hasAlpha) {\n"
+    "        if (alpha == 0.0) { color = vec3(0.0, 0.0, 0.0); }"
+    "        else { }\n"
+    "    }\n"
+    "    gl_FragColor = vec4(color, alpha);\n"
+    "}\n"
+};
+
+static const GLchar* RED_AND_BLUE_SWAP_SHADER = {
+    "#version 100\n"
+    "precision mediump float;\n"
+    "uniform sampler2D textureSampler;\n"
+    "uniform bool hasAlpha;\n"
+    "varying highp vec2 uv;\n"
+    "\n"
+    "void main() {\n"
+    "    vec3 color = texture2D(textureSampler, uv).bgr;\n"
+    "    float alpha = hasAlpha ? texture2D(textureSampler, uv).a : 1.0;\n"
+    "    gl_FragColor = vec4(color, alpha);\n"
+    "}\n"
+};
+
+// Attribute locations the programs are linked with, part of the cache key of their binaries
+static const char* COLOR_CONVERSION_ATTRIBUTES = "vertexCoord=0;textureCoord=1";
+
+static const GLchar* colorShaderSource(const ColorShader shader)
+{
+    switch (shader) {
+    case ColorShader_Passthrough:
+        return PASSTHROUGH_SHADER;
+    case ColorShader_FlipColorChannels:
+        return FLIP_COLOR_CHANNELS_SHADER;
+    case ColorShader_FlipColorChannelsWithAlpha:
+        return FLIP_COLOR_CHANNELS_WITH_ALPHA_SHADER;
+    case ColorShader_RGB32ToRGBX8888:
+        return RGB32_TO_RGBA8888_SHADER;
+    case ColorShader_RGB32ToRGBX8888_Premult:
+        return RGB32_TO_RGBA8888_PREMULT_SHADER;
+    case ColorShader_RedAndBlueSwap:
+        return RED_AND_BLUE_SWAP_SHADER;
+    default:
+        return nullptr;
+    }
+}
+
+// Longest a thread without the render thread's context waits for a program built in the background
+static const quint64 buildTimeoutNs = 1000 * 1000 * 1000;
+
+class ShaderBuildThread : public QThread
+{
+public:
+    explicit ShaderBuildThread(ColorShaderLibrary* library) : m_library(library)
+    {
+        setObjectName(QStringLiteral("QsgShaders"));
+    }
+
+protected:
+    void run() override
+    {
+        m_library->buildLoop();
+    }
+
+private:
+    ColorShaderLibrary* m_library;
+};
+
+ColorShaderLibrary::ColorShaderLibrary(const bool background) :
+    m_renderThread(nullptr), m_gl(nullptr), m_snapshot(emptySnapshot()), m_quit(false), m_backgroundActive(false)
+{
+    for (int i = 0; i < ColorShader_Count; i++)
+        m_status[i] = Status_Pending;
+
+    if (!background || !qGuiApp || QThread::currentThread() != qGuiApp->thread())
+        return;
+
+    m_surface = std::make_unique<QOffscreenSurface>();
+    m_surface->setFormat(QSurfaceFormat::defaultFormat());
+    m_surface->create();
+    if (!m_surface->isValid())
+        m_surface.reset();
+}
+
+ColorShaderLibrary::~ColorShaderLibrary()
+{
+    stopBuilding();
+}
+
+void ColorShaderLibrary::initialize(QOpenGLContext* gl)
+{
+    invalidate();
+
+    m_gl = gl;
+    m_renderThread = QThread::currentThread();
+    if (!m_gl || !m_surface)
+        return;
+
+    // Programs are shared objects, built in a context of the same share group they're usable right away
+    m_backgroundContext = std::make_unique<QOpenGLContext>();
+    m_backgroundContext->setFormat(m_gl->format());
+    m_backgroundContext->setShareContext(m_gl);
+    if (!m_backgroundContext->create() || !m_backgroundContext->shareContext()) {
+        qWarning() << "Failed to create background context for shader builds, building on demand instead";
+        m_backgroundContext.reset();
+        return;
+    }
+
+    // Everything is built speculatively, requests only change the order
+    {
+        QMutexLocker locker(&m_mutex);
+        m_quit = false;
+        m_backgroundActive = true;
+        for (int i = ColorShader_First; i < ColorShader_Count; i++)
+            m_queue.push_back((ColorShader)i);
+    }
+
+    m_thread = std::make_unique<ShaderBuildThread>(this);
+    m_backgroundContext->moveToThread(m_thread.get());
+    m_thread->start(QThread::LowPriority);
+}
+
+void ColorShaderLibrary::stopBuilding()
+{
+    if (!m_thread)
+        return;
+
+    {
+        QMutexLocker locker(&m_mutex);
+        m_quit = true;
+        m_backgroundActive = false;
+        m_queue.clear();
+        m_wakeup.wakeAll();
+    }
+
+    m_thread->wait();
+    m_thread.reset();
+    m_backgroundContext.reset();
+}
+
+void ColorShaderLibrary::invalidate()
+{
+    stopBuilding();
+
+    // Programs belong to the context going away
+    QMutexLocker locker(&m_mutex);
+    m_queue.clear();
+    for (int i = 0; i < ColorShader_Count; i++) {
+        m_status[i] = Status_Pending;
+        m_bundles[i].reset();
+        m_fences[i].reset();
+    }
+    m_snapshot = emptySnapshot();
+    m_gl = nullptr;
+}
+
+void ColorShaderLibrary::request(const ColorShader shader)
+{
+    if (shader < ColorShader_First || shader >= ColorShader_Count)
+        return;
+
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_status[shader] != Status_Pending)
+            return;
+
+        if (m_backgroundActive) {
+            // Move it to the front, the render thread carries on with a fallback in the meantime
+            m_queue.erase(std::remove(m_queue.begin(), m_queue.end(), shader), m_queue.end());
+            m_queue.push_front(shader);
+            m_wakeup.wakeAll();
+            return;
+        }
+
+        // Programs can only be built where the render thread's context is current
+        if (!m_gl || QOpenGLContext::currentContext() != m_gl)
+            return;
+
+        m_status[shader] = Status_Building;
+    }
+
+    // No background context, build it on the render thread just for the formats that need it
+    finish(shader, build(shader, m_gl), nullptr);
+}
+
+ColorShaderLibrary::Status ColorShaderLibrary::status(const ColorShader shader) const
+{
+    if (shader < 0 || shader >= ColorShader_Count)
+        return Status_Failed;
+
+    QMutexLocker locker(&m_mutex);
+    return m_status[shader];
+}
+
+std::shared_ptr<const ShaderCache> ColorShaderLibrary::emptySnapshot()
+{
+    // Images uploaded without conversion need no program
+    auto shaders = std::make_shared<ShaderCache>();
+    (*shaders)[ColorShader_None] = std::make_shared<ShaderBundle>(nullptr, 0, 0, 0, 0);
+    return shaders;
+}
+
+std::shared_ptr<const ShaderCache> ColorShaderLibrary::collect() const
+{
+    QMutexLocker locker(&m_mutex);
+    std::shared_ptr<ShaderCache> updated;
+    for (int i = ColorShader_First; i < ColorShader_Count; i++) {
+        if (m_status[i] != Status_Ready || m_snapshot->find((ColorShader)i) != m_snapshot->end())
+            continue;
+
+        // Programs built in the background are only used by the render thread's context after the GPU built them
+        if (m_fences[i]) {
+            if (m_gl && QOpenGLContext::currentContext() == m_gl)
+                m_fences[i]->serverWait();
+            else
+                m_fences[i]->wait(buildTimeoutNs);
+        }
+
+        if (!updated)
+            updated = std::make_shared<ShaderCache>(*m_snapshot);
+        (*updated)[(ColorShader)i] = m_bundles[i];
+    }
+
+    if (updated)
+        m_snapshot = updated;
+    return m_snapshot;
+}
+
+void ColorShaderLibrary::finish(const ColorShader shader, std::shared_ptr<ShaderBundle> bundle, std::shared_ptr<GpuFence> fence)
+{
+    QMutexLocker locker(&m_mutex);
+    m_bundles[shader] = bundle;
+    m_fences[shader] = fence;
+    m_status[shader] = bundle ? Status_Ready : Status_Failed;
+}
+
+void ColorShaderLibrary::buildLoop()
+{
+    if (!m_backgroundContext->makeCurrent(m_surface.get())) {
+        qWarning() << "Failed to make background context current, building shaders on demand instead";
+        QMutexLocker locker(&m_mutex);
+        m_queue.clear();
+        m_backgroundActive = false;
+        m_backgroundContext->moveToThread(m_renderThread);
+        return;
+    }
+
+    while (true) {
+        ColorShader shader = ColorShader_None;
+
+        {
+            QMutexLocker locker(&m_mutex);
+            while (!m_quit && m_queue.empty())
+                m_wakeup.wait(&m_mutex);
+            if (m_quit)
+                break;
+
+            shader = m_queue.front();
+            m_queue.pop_front();
+            if (m_status[shader] != Status_Pending)
+                continue;
+            m_status[shader] = Status_Building;
+        }
+
+        std::shared_ptr<ShaderBundle> bundle = build(shader, m_backgroundContext.get());
+
+        // The render thread's context may only use the program once the GPU got past its build.
+        // With a fence the render thread waits for that on the GPU side, otherwise it's waited for here.
+        std::shared_ptr<GpuFence> fence = GpuFence::create();
+        if (fence)
+            m_backgroundContext->functions()->glFlush();
+        else
+            m_backgroundContext->functions()->glFinish();
+        finish(shader, bundle, fence);
+    }
+
+    // Hand the context back for it to be destroyed on the thread that owns the library
+    m_backgroundContext->doneCurrent();
+    m_backgroundContext->moveToThread(m_renderThread);
+}
+
+std::shared_ptr<ShaderBundle> ColorShaderLibrary::build(const ColorShader shader, QOpenGLContext* gl)
+{
+    const GLchar* fragmentShader = colorShaderSource(shader);
+    if (!gl || !fragmentShader) {
+        qWarning() << "No color shader type" << shader;
+        return nullptr;
+    }
+
+    QElapsedTimer buildTimer;
+    buildTimer.start();
+
+    // Linked programs are shared between apps through the on-disk cache, sparing each its own compile
+    ProgramBinaryCache programCache(gl);
+    QOpenGLFunctions* functions = gl->functions();
+    auto program = std::make_shared<QOpenGLShaderProgram>();
+    bool cached = false;
+
+    const QByteArray programKey = programCache.programKey(COLOR_CONVERSION_VERTEX, fragmentShader, COLOR_CONVERSION_ATTRIBUTES);
+    if (programCache.load(program.get(), programKey)) {
+        cached = true;
+    } else {
+        // A failed binary load leaves the program empty and unlinked, ready to be built from source
+        if (!program->addCacheableShaderFromSourceCode(QOpenGLShader::Vertex, COLOR_CONVERSION_VERTEX)) {
+            qWarning() << "Failed to compile vertex shader for color shader" << shader << "Reason:";
+            qWarning() << program->log();
+            return nullptr;
+        }
+
+        if (!program->addCacheableShaderFromSourceCode(QOpenGLShader::Fragment, fragmentShader)) {
+            qWarning() << "Failed to compile fragment shader" << shader << "Reason:";
+            qWarning() << program->log();
+            return nullptr;
+        }
+
+        functions->glBindAttribLocation(program->programId(), 0, "vertexCoord");
+        functions->glBindAttribLocation(program->programId(), 1, "textureCoord");
+
+        if (!program->link()) {
+            qWarning() << "Failed to link shader" << shader << "Reason:";
+            qWarning() << program->log();
+            return nullptr;
+        }
+
+        programCache.store(program.get(), programKey);
+    }
+
+    auto bundle = std::make_shared<ShaderBundle>(
+        program,
+        0,
+        1,
+        functions->glGetUniformLocation(program->programId(), "textureSampler"),
+        functions->glGetUniformLocation(program->programId(), "hasAlpha")
+    );
+
+    qDebug() << "Color shader" << shader << "ready in" << buildTimer.elapsed() << "ms" << (cached ? "from the program cache" : "");
+    return bundle;
+}
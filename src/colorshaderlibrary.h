@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COLORSHADERLIBRARY_H
+#define COLORSHADERLIBRARY_H
+
+#include <QMutex>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QThread>
+#include <QWaitCondition>
+
+#include <deque>
+#include <memory>
+
+#include "gpufence.h"
+#include "gralloctexture.h"
+
+// Builds the color conversion programs one variant at a time as formats need them. With a background
+// context sharing with the render thread's, all variants are built speculatively off the render thread,
+// whichever got requested first. A variant failing to build only disables the formats that need it.
+class ColorShaderLibrary
+{
+public:
+    enum Status {
+        Status_Pending = 0,
+        Status_Building,
+        Status_Ready,
+        Status_Failed
+    };
+
+    // GUI thread, offscreen surfaces can't be created elsewhere on all platforms
+    explicit ColorShaderLibrary(const bool background);
+    ~ColorShaderLibrary();
+
+    // Render thread, with the context the programs are used in current
+    void initialize(QOpenGLContext* gl);
+    void invalidate();
+
+    // Asks for a variant to be built. Without a background context it's built right away.
+    void request(const ColorShader shader);
+    Status status(const ColorShader shader) const;
+
+    // Variants ready by now, for texture creation on any thread. Snapshots never change once handed out,
+    // newly ready variants go into a new one.
+    std::shared_ptr<const ShaderCache> collect() const;
+
+private:
+    void buildLoop();
+    void stopBuilding();
+    std::shared_ptr<ShaderBundle> build(const ColorShader shader, QOpenGLContext* gl);
+    void finish(const ColorShader shader, std::shared_ptr<ShaderBundle> bundle, std::shared_ptr<GpuFence> fence);
+    static std::shared_ptr<const ShaderCache> emptySnapshot();
+
+    std::unique_ptr<QOffscreenSurface> m_surface;
+    std::unique_ptr<QOpenGLContext> m_backgroundContext;
+    std::unique_ptr<QThread> m_thread;
+    QThread* m_renderThread;
+    QOpenGLContext* m_gl;
+
+    mutable QMutex m_mutex;
+    QWaitCondition m_wakeup;
+    std::deque<ColorShader> m_queue;
+    Status m_status[ColorShader_Count];
+    std::shared_ptr<ShaderBundle> m_bundles[ColorShader_Count];
+    std::shared_ptr<GpuFence> m_fences[ColorShader_Count];
+    mutable std::shared_ptr<const ShaderCache> m_snapshot;
+    bool m_quit;
+    // Whether queued variants get picked up by the background thread
+    bool m_backgroundActive;
+
+    friend class ShaderBuildThread;
+};
+
+#endif
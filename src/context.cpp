@@ -19,6 +19,8 @@
 #include "rendercontext.h"
 #include "texturefactory.h"
 
+#include <QDebug>
+#include <QFile>
 #include <QQuickWindow>
 
 #undef None
@@ -45,4 +47,22 @@ QSGRenderContext* Context::createRenderContext()
 QQuickTextureFactory* Context::createTextureFactory(const QImage &image)
 {
     return new TextureFactory(image);
+}
+
+QQuickTextureFactory* Context::createTextureFactory(QIODevice* device, const QByteArray& format)
+{
+    std::shared_ptr<const EncodedImage> encoded = std::make_shared<const EncodedImage>(device, format);
+    if (!encoded->isValid())
+        return nullptr;
+    return new TextureFactory(encoded);
+}
+
+QQuickTextureFactory* Context::createTextureFactory(const QString& fileName, const QByteArray& format)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning() << "Failed to open" << fileName << file.errorString();
+        return nullptr;
+    }
+    return createTextureFactory(&file, format);
 }
\ No newline at end of file
@@ -32,6 +32,9 @@ public:
     QAnimationDriver* createAnimationDriver(QObject *parent) override;
     QSGRenderContext* createRenderContext() override;
     QQuickTextureFactory* createTextureFactory(const QImage &image);
+    // Factories for encoded images (JPEG, PNG, ...), decoded into the texture's buffer when it gets uploaded
+    QQuickTextureFactory* createTextureFactory(QIODevice* device, const QByteArray& format = QByteArray());
+    QQuickTextureFactory* createTextureFactory(const QString& fileName, const QByteArray& format = QByteArray());
 
 private:
     bool m_useHaliumQsgAnimationDriver;
@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "conversionbatch.h"
+#include "gralloctexture.h"
+
+#include <QDebug>
+#include <QMutexLocker>
+
+#include <algorithm>
+
+// The conversion shaders sample the source image on this unit
+static const int sourceTextureUnit = 1;
+
+// Full screen quad, interleaved position and texture coordinates
+static const GLfloat quadVertices[] = {
+    -1,-1, 0,   0, 0,
+    -1, 1, 0,   0, 1,
+     1,-1, 0,   1, 0,
+    -1, 1, 0,   0, 1,
+     1,-1, 0,   1, 0,
+     1, 1, 0,   1, 1
+};
+static const int quadStride = 5 * sizeof(GLfloat);
+
+// Without fences, source buffers are held on to for this many frames after their conversion
+static const int retireFrames = 2;
+
+ConversionBatch::ConversionBatch(std::shared_ptr<GLStateTracker> stateTracker) :
+    m_stateTracker(stateTracker), m_sourceTexture(0), m_gl(nullptr)
+{
+}
+
+ConversionBatch::~ConversionBatch()
+{
+    invalidate();
+}
+
+void ConversionBatch::schedule(const GrallocTexture* texture)
+{
+    QMutexLocker locker(&m_mutex);
+    if (std::find(m_pending.begin(), m_pending.end(), texture) == m_pending.end())
+        m_pending.push_back(texture);
+}
+
+void ConversionBatch::cancel(const GrallocTexture* texture)
+{
+    QMutexLocker locker(&m_mutex);
+    m_pending.erase(std::remove(m_pending.begin(), m_pending.end(), texture), m_pending.end());
+}
+
+void ConversionBatch::flush(QOpenGLContext* gl)
+{
+    // Held throughout, a texture being destroyed on another thread waits in cancel() until its conversion is done
+    QMutexLocker locker(&m_mutex);
+    if (m_pending.empty() || !gl)
+        return;
+
+    // Textures whose placeholder is fine for now stay queued until their upload is done
+    std::vector<const GrallocTexture*> ready;
+    std::vector<const GrallocTexture*> waiting;
+    for (const GrallocTexture* texture : m_pending) {
+        if (texture->m_nonBlocking && texture->uploadPending())
+            waiting.push_back(texture);
+        else
+            ready.push_back(texture);
+    }
+
+    m_pending.swap(waiting);
+    convertLocked(gl, ready);
+}
+
+bool ConversionBatch::ensureGeometry()
+{
+    if (m_vertexBuffer)
+        return m_vertexBuffer->isCreated();
+
+    // Without vertex array object support the attribute setup is simply done without one
+    m_vao = std::make_unique<QOpenGLVertexArrayObject>();
+    m_vao->create();
+
+    m_vertexBuffer = std::make_unique<QOpenGLBuffer>(QOpenGLBuffer::VertexBuffer);
+    if (!m_vertexBuffer->create())
+        return false;
+
+    m_vertexBuffer->setUsagePattern(QOpenGLBuffer::StaticDraw);
+    m_stateTracker->bindArrayBuffer(m_vertexBuffer->bufferId());
+    m_vertexBuffer->allocate(quadVertices, sizeof(quadVertices));
+    return true;
+}
+
+void ConversionBatch::convert(QOpenGLContext* gl, const std::vector<const GrallocTexture*>& textures)
+{
+    QMutexLocker locker(&m_mutex);
+    convertLocked(gl, textures);
+}
+
+void ConversionBatch::convertLocked(QOpenGLContext* gl, const std::vector<const GrallocTexture*>& textures)
+{
+    if (!gl || textures.empty())
+        return;
+
+    // Textures converted here are done with, no matter if they were queued or not
+    std::vector<const GrallocTexture*> batch;
+    for (const GrallocTexture* texture : textures) {
+        m_pending.erase(std::remove(m_pending.begin(), m_pending.end(), texture), m_pending.end());
+        if (texture->prepareConversion())
+            batch.push_back(texture);
+    }
+
+    if (batch.empty())
+        return;
+
+    // Group by program so that each one is bound and set up once
+    std::stable_sort(batch.begin(), batch.end(), [](const GrallocTexture* a, const GrallocTexture* b) {
+        return a->m_shaderCode.get() < b->m_shaderCode.get();
+    });
+
+    QOpenGLFunctions* functions = gl->functions();
+    m_stateTracker->begin(gl);
+
+    if (m_gl != gl) {
+        releaseResources();
+        m_gl = gl;
+    }
+
+    if (!ensureGeometry()) {
+        qWarning() << "Failed to set up conversion geometry";
+        m_stateTracker->end();
+        return;
+    }
+
+    if (m_vao->isCreated())
+        m_vao->bind();
+    m_stateTracker->bindArrayBuffer(m_vertexBuffer->bufferId());
+
+    m_stateTracker->setActiveTexture(GL_TEXTURE0 + sourceTextureUnit);
+    if (m_sourceTexture == 0) {
+        functions->glGenTextures(1, &m_sourceTexture);
+        m_stateTracker->bindTexture(m_sourceTexture);
+        functions->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        functions->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        functions->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        functions->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+    m_stateTracker->bindTexture(m_sourceTexture);
+
+    ShaderBundle* current = nullptr;
+    std::vector<std::shared_ptr<GrallocBuffer>> retiring;
+    for (const GrallocTexture* texture : batch) {
+        ShaderBundle* shader = texture->m_shaderCode.get();
+        if (shader != current) {
+            if (current) {
+                current->program->disableAttributeArray(current->vertexCoord);
+                current->program->disableAttributeArray(current->textureCoord);
+            }
+
+            current = shader;
+            m_stateTracker->useProgram(current->program->programId());
+            current->program->enableAttributeArray(current->vertexCoord);
+            current->program->setAttributeBuffer(current->vertexCoord, GL_FLOAT, 0, 3, quadStride);
+            current->program->enableAttributeArray(current->textureCoord);
+            current->program->setAttributeBuffer(current->textureCoord, GL_FLOAT, 3 * sizeof(GLfloat), 2, quadStride);
+            current->program->setUniformValue(current->texture, sourceTextureUnit);
+        }
+
+        texture->renderConversion(functions, m_sourceTexture);
+
+        std::shared_ptr<GrallocBuffer> source = texture->releaseSource();
+        if (source)
+            retiring.push_back(source);
+    }
+
+    if (current) {
+        current->program->disableAttributeArray(current->vertexCoord);
+        current->program->disableAttributeArray(current->textureCoord);
+    }
+
+    // Detach the last source image, so that its buffer isn't kept alive by the driver until the next batch
+    static const uint8_t transparent[4] = { 0, 0, 0, 0 };
+    m_stateTracker->bindTexture(m_sourceTexture);
+    functions->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, transparent);
+
+    if (m_vao->isCreated())
+        m_vao->release();
+
+    m_stateTracker->end();
+
+    // The converted textures are done with their source buffers as soon as the GPU is. With a fence
+    // they go back to the pool right away, whoever writes to them next waits for it.
+    if (!retiring.empty()) {
+        std::shared_ptr<GpuFence> fence = GpuFence::create();
+        for (auto& buffer : retiring) {
+            if (fence)
+                markBufferReleased(buffer.get(), fence);
+            else
+                m_retired.push_back(RetiredSource { std::move(buffer), 0 });
+        }
+    }
+}
+
+void ConversionBatch::frameRendered()
+{
+    std::shared_ptr<GpuFence> fence = GpuFence::create();
+
+    QMutexLocker locker(&m_mutex);
+    m_frameFence = fence;
+
+    for (auto it = m_retired.begin(); it != m_retired.end();)
+        it = (++it->frames > retireFrames) ? m_retired.erase(it) : it + 1;
+}
+
+std::shared_ptr<GpuFence> ConversionBatch::frameFence() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_frameFence;
+}
+
+void ConversionBatch::invalidate()
+{
+    QMutexLocker locker(&m_mutex);
+    m_pending.clear();
+    m_retired.clear();
+    m_frameFence.reset();
+    releaseResources();
+}
+
+void ConversionBatch::releaseResources()
+{
+    // Objects of a context that is already gone are cleaned up by Qt along with it
+    QOpenGLContext* current = QOpenGLContext::currentContext();
+    if (m_sourceTexture != 0 && current && current == m_gl)
+        current->functions()->glDeleteTextures(1, &m_sourceTexture);
+    m_sourceTexture = 0;
+
+    m_vertexBuffer.reset();
+    m_vao.reset();
+    m_gl = nullptr;
+}
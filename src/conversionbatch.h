@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONVERSIONBATCH_H
+#define CONVERSIONBATCH_H
+
+#include <QMutex>
+#include <QOpenGLBuffer>
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QOpenGLVertexArrayObject>
+
+#include <memory>
+#include <vector>
+
+#include "bufferpool.h"
+#include "glstatetracker.h"
+#include "gpufence.h"
+
+class GrallocTexture;
+
+// Runs the color conversion passes of shader-converted textures in batches, with geometry that
+// persists across frames, each program bound once per batch and GL state restored once.
+// Also keeps track of when the GPU is done with a frame, to tell when buffers it read can be written again.
+// Textures get scheduled, cancelled and ask for the frame fence from whichever thread creates or destroys
+// them, the GL work happens on the render thread.
+class ConversionBatch
+{
+public:
+    explicit ConversionBatch(std::shared_ptr<GLStateTracker> stateTracker);
+    ~ConversionBatch();
+
+    // Queues a texture for the next flush
+    void schedule(const GrallocTexture* texture);
+    void cancel(const GrallocTexture* texture);
+
+    // Converts the queued textures whose contents have arrived, called once per frame before rendering.
+    // Textures with blocking uploads are waited for, they'd block the frame when bound anyway.
+    void flush(QOpenGLContext* gl);
+
+    // Converts the given textures right away
+    void convert(QOpenGLContext* gl, const std::vector<const GrallocTexture*>& textures);
+
+    // Called once the commands of a frame got issued, fences them off
+    void frameRendered();
+    // Signaled once the GPU finished the last frame rendered, null without fence support
+    std::shared_ptr<GpuFence> frameFence() const;
+
+    // The GL context is about to go away
+    void invalidate();
+
+private:
+    // Source buffer of a finished conversion without a fence telling when the GPU is done with it
+    struct RetiredSource {
+        std::shared_ptr<GrallocBuffer> buffer;
+        int frames;
+    };
+
+    void convertLocked(QOpenGLContext* gl, const std::vector<const GrallocTexture*>& textures);
+    bool ensureGeometry();
+    void releaseResources();
+
+    std::shared_ptr<GLStateTracker> m_stateTracker;
+    mutable QMutex m_mutex;
+    std::vector<const GrallocTexture*> m_pending;
+    std::vector<RetiredSource> m_retired;
+    std::shared_ptr<GpuFence> m_frameFence;
+
+    std::unique_ptr<QOpenGLVertexArrayObject> m_vao;
+    std::unique_ptr<QOpenGLBuffer> m_vertexBuffer;
+    GLuint m_sourceTexture;
+    QOpenGLContext* m_gl;
+};
+
+#endif
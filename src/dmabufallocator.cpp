@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dmabufallocator.h"
+#include "halformats.h"
+
+#include <QDebug>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <linux/dma-buf.h>
+#include <linux/udmabuf.h>
+
+#define HALIUMQSG_FOURCC(a, b, c, d) \
+    ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+// Rows are padded to 16 pixels, 64 bytes for 32 bit formats, which GPUs importing linear buffers commonly ask for
+static const int strideAlignment = 16;
+
+struct DmaBufBuffer {
+    int memfd = -1;
+    int dmabuf = -1;
+    void* pixels = MAP_FAILED;
+    size_t size = 0;
+    int width = 0;
+    int height = 0;
+    int pitch = 0;
+    uint32_t fourcc = 0;
+    uint64_t syncFlags = 0;
+};
+
+DmaBufBufferAllocator::DmaBufBufferAllocator() : m_udmabuf(-1), m_memfdSupported(false)
+{
+    const int memfd = memfd_create("haliumqsg-probe", MFD_CLOEXEC);
+    if (memfd >= 0) {
+        m_memfdSupported = true;
+        close(memfd);
+    }
+
+    m_udmabuf = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+    if (m_udmabuf < 0)
+        qWarning() << "No /dev/udmabuf, shared memory buffers can't be imported as EGLImages";
+}
+
+DmaBufBufferAllocator::~DmaBufBufferAllocator()
+{
+    if (m_udmabuf >= 0)
+        close(m_udmabuf);
+}
+
+bool DmaBufBufferAllocator::isAvailable() const
+{
+    return m_memfdSupported && m_udmabuf >= 0;
+}
+
+uint32_t DmaBufBufferAllocator::drmFormat(const int halFormat)
+{
+    // DRM formats are named after little endian words, HAL formats after their bytes in memory
+    switch (halFormat) {
+    case HAL_PIXEL_FORMAT_RGBA_8888:
+        return HALIUMQSG_FOURCC('A', 'B', '2', '4');
+    case HAL_PIXEL_FORMAT_RGBX_8888:
+        return HALIUMQSG_FOURCC('X', 'B', '2', '4');
+    case HAL_PIXEL_FORMAT_BGRA_8888:
+        return HALIUMQSG_FOURCC('A', 'R', '2', '4');
+    case HAL_PIXEL_FORMAT_RGB_888:
+        return HALIUMQSG_FOURCC('B', 'G', '2', '4');
+    case HAL_PIXEL_FORMAT_RGB_565:
+        return HALIUMQSG_FOURCC('R', 'G', '1', '6');
+    default:
+        return 0;
+    }
+}
+
+void* DmaBufBufferAllocator::allocate(const BufferDescriptor& descriptor, int& stride)
+{
+    stride = 0;
+
+    const uint32_t fourcc = drmFormat(descriptor.format);
+    if (!fourcc || descriptor.width <= 0 || descriptor.height <= 0 || !m_memfdSupported)
+        return nullptr;
+
+    const long pageSize = sysconf(_SC_PAGESIZE);
+    const int alignedWidth = (descriptor.width + strideAlignment - 1) / strideAlignment * strideAlignment;
+    const int pitch = alignedWidth * halFormatBytesPerPixel(descriptor.format);
+
+    DmaBufBuffer* buffer = new DmaBufBuffer;
+    buffer->width = descriptor.width;
+    buffer->height = descriptor.height;
+    buffer->pitch = pitch;
+    buffer->fourcc = fourcc;
+    buffer->size = ((size_t)pitch * descriptor.height + pageSize - 1) / pageSize * pageSize;
+
+    // udmabuf only takes memfds that can't shrink underneath it
+    buffer->memfd = memfd_create("haliumqsg-buffer", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (buffer->memfd < 0 || ftruncate(buffer->memfd, buffer->size) < 0 ||
+            fcntl(buffer->memfd, F_ADD_SEALS, F_SEAL_SHRINK) < 0) {
+        free(buffer);
+        return nullptr;
+    }
+
+    if (m_udmabuf >= 0) {
+        struct udmabuf_create create = {};
+        create.memfd = buffer->memfd;
+        create.flags = UDMABUF_FLAGS_CLOEXEC;
+        create.offset = 0;
+        create.size = buffer->size;
+        buffer->dmabuf = ioctl(m_udmabuf, UDMABUF_CREATE, &create);
+    }
+
+    // The mapping stays for the buffer's lifetime, locking only brackets CPU access for cache maintenance
+    buffer->pixels = mmap(nullptr, buffer->size, PROT_READ | PROT_WRITE, MAP_SHARED, buffer->memfd, 0);
+    if (buffer->pixels == MAP_FAILED) {
+        free(buffer);
+        return nullptr;
+    }
+
+    stride = alignedWidth;
+    return buffer;
+}
+
+void DmaBufBufferAllocator::free(void* handle)
+{
+    DmaBufBuffer* buffer = static_cast<DmaBufBuffer*>(handle);
+    if (!buffer)
+        return;
+
+    if (buffer->pixels != MAP_FAILED)
+        munmap(buffer->pixels, buffer->size);
+    if (buffer->dmabuf >= 0)
+        close(buffer->dmabuf);
+    if (buffer->memfd >= 0)
+        close(buffer->memfd);
+    delete buffer;
+}
+
+void* DmaBufBufferAllocator::lock(void* handle, uint32_t lockUsage)
+{
+    DmaBufBuffer* buffer = static_cast<DmaBufBuffer*>(handle);
+    if (!buffer)
+        return nullptr;
+
+    if (buffer->dmabuf >= 0) {
+        buffer->syncFlags = 0;
+        if (lockUsage & GRALLOC_USAGE_SW_READ_MASK)
+            buffer->syncFlags |= DMA_BUF_SYNC_READ;
+        if (lockUsage & GRALLOC_USAGE_SW_WRITE_MASK)
+            buffer->syncFlags |= DMA_BUF_SYNC_WRITE;
+
+        struct dma_buf_sync sync = { DMA_BUF_SYNC_START | buffer->syncFlags };
+        ioctl(buffer->dmabuf, DMA_BUF_IOCTL_SYNC, &sync);
+    }
+
+    return buffer->pixels;
+}
+
+void DmaBufBufferAllocator::unlock(void* handle)
+{
+    DmaBufBuffer* buffer = static_cast<DmaBufBuffer*>(handle);
+    if (!buffer || buffer->dmabuf < 0)
+        return;
+
+    struct dma_buf_sync sync = { DMA_BUF_SYNC_END | buffer->syncFlags };
+    ioctl(buffer->dmabuf, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+EGLImageKHR DmaBufBufferAllocator::createImage(void* handle)
+{
+    DmaBufBuffer* buffer = static_cast<DmaBufBuffer*>(handle);
+    if (!buffer || buffer->dmabuf < 0)
+        return EGL_NO_IMAGE_KHR;
+
+    // Mesa wants the display of the context the image ends up in, which isn't necessarily the default one
+    const EGLDisplay current = eglGetCurrentDisplay();
+    const EGLDisplay dpy = (current != EGL_NO_DISPLAY) ? current : eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    const EGLint attrs[] = {
+        EGL_WIDTH, buffer->width,
+        EGL_HEIGHT, buffer->height,
+        EGL_LINUX_DRM_FOURCC_EXT, (EGLint)buffer->fourcc,
+        EGL_DMA_BUF_PLANE0_FD_EXT, buffer->dmabuf,
+        EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
+        EGL_DMA_BUF_PLANE0_PITCH_EXT, buffer->pitch,
+        EGL_NONE
+    };
+
+    return m_eglImageFunctions.eglCreateImageKHR(dpy, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, nullptr, attrs);
+}
+
+void DmaBufBufferAllocator::destroyImage(EGLImageKHR image)
+{
+    if (image == EGL_NO_IMAGE_KHR)
+        return;
+
+    const EGLDisplay current = eglGetCurrentDisplay();
+    const EGLDisplay dpy = (current != EGL_NO_DISPLAY) ? current : eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    m_eglImageFunctions.eglDestroyImageKHR(dpy, image);
+}
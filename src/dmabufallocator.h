@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DMABUFALLOCATOR_H
+#define DMABUFALLOCATOR_H
+
+#include "bufferallocator.h"
+
+// Allocates buffers in shared memory (memfd) and exports them as dma-bufs through /dev/udmabuf,
+// which Mesa imports as EGLImages with EGL_EXT_image_dma_buf_import. Lets the whole upload
+// path run on plain Linux machines. Configured with ENABLE_HYBRIS off, or without libhybris and
+// android-headers installed, this is the only allocator and nothing of the Android stack is needed.
+class DmaBufBufferAllocator : public BufferAllocator
+{
+public:
+    DmaBufBufferAllocator();
+    ~DmaBufBufferAllocator();
+
+    bool isAvailable() const override;
+
+    void* allocate(const BufferDescriptor& descriptor, int& stride) override;
+    void free(void* handle) override;
+
+    void* lock(void* handle, uint32_t lockUsage) override;
+    void unlock(void* handle) override;
+
+    EGLImageKHR createImage(void* handle) override;
+    void destroyImage(EGLImageKHR image) override;
+
+    // DRM fourcc with the same memory layout as a HAL pixel format, 0 if there is none
+    static uint32_t drmFormat(const int halFormat);
+
+private:
+    int m_udmabuf;
+    bool m_memfdSupported;
+    EglImageFunctions m_eglImageFunctions;
+};
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "encodedimage.h"
+
+#include <QBuffer>
+#include <QDebug>
+#include <QImageReader>
+#include <QPixelFormat>
+
+EncodedImage::EncodedImage(QIODevice* device, const QByteArray& format) :
+    m_data(device ? device->readAll() : QByteArray()), m_format(format), m_imageFormat(QImage::Format_Invalid)
+{
+    readHeader();
+}
+
+EncodedImage::EncodedImage(const QByteArray& data, const QByteArray& format) :
+    m_data(data), m_format(format), m_imageFormat(QImage::Format_Invalid)
+{
+    readHeader();
+}
+
+void EncodedImage::readHeader()
+{
+    QBuffer buffer(&m_data);
+    buffer.open(QIODevice::ReadOnly);
+
+    QImageReader reader(&buffer, m_format);
+    if (m_format.isEmpty())
+        m_format = reader.format();
+    m_size = reader.size();
+    m_imageFormat = reader.imageFormat();
+}
+
+bool EncodedImage::isValid() const
+{
+    return !m_data.isEmpty() && m_size.isValid() && !m_size.isEmpty();
+}
+
+QSize EncodedImage::size() const
+{
+    return m_size;
+}
+
+QImage::Format EncodedImage::format() const
+{
+    return m_imageFormat;
+}
+
+bool EncodedImage::hasAlphaChannel() const
+{
+    // Palettes might or might not carry alpha, which only decoding tells
+    if (m_imageFormat == QImage::Format_Indexed8 || m_imageFormat == QImage::Format_Invalid)
+        return true;
+    return QImage::toPixelFormat(m_imageFormat).alphaUsage() == QPixelFormat::UsesAlpha;
+}
+
+int EncodedImage::byteCount() const
+{
+    // Handlers that can't tell their format up front mostly end up with 32 bits per pixel
+    const int depth = (m_imageFormat != QImage::Format_Invalid) ? QImage::toPixelFormat(m_imageFormat).bitsPerPixel() : 32;
+    return ((m_size.width() * depth + 31) / 32) * 4 * m_size.height();
+}
+
+QImage EncodedImage::decode() const
+{
+    QImage image;
+    decodeInto(&image);
+    return image;
+}
+
+bool EncodedImage::decodeInto(QImage* image) const
+{
+    // A shallow copy, which decoders on several threads can read at once
+    QByteArray data = m_data;
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::ReadOnly);
+
+    QImageReader reader(&buffer, m_format);
+    if (!reader.read(image)) {
+        qWarning() << "Failed to decode image:" << reader.errorString();
+        return false;
+    }
+    return true;
+}
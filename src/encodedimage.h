@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ENCODEDIMAGE_H
+#define ENCODEDIMAGE_H
+
+#include <QByteArray>
+#include <QImage>
+#include <QSize>
+
+class QIODevice;
+
+// Compressed image data (JPEG, PNG, ...) whose pixels are only decoded when they get uploaded.
+// Size and format come from the image header, which is all that is read up front.
+class EncodedImage
+{
+public:
+    // Reads all of the device, the data gets decoded later on and possibly on another thread
+    EncodedImage(QIODevice* device, const QByteArray& format = QByteArray());
+    EncodedImage(const QByteArray& data, const QByteArray& format = QByteArray());
+
+    bool isValid() const;
+    QSize size() const;
+    QImage::Format format() const;
+    bool hasAlphaChannel() const;
+    int byteCount() const;
+
+    QImage decode() const;
+    // Decodes into the given image, which the image handlers fill in place if it has
+    // the right size and format. Returns false if the data couldn't be decoded.
+    bool decodeInto(QImage* image) const;
+
+private:
+    void readHeader();
+
+    QByteArray m_data;
+    QByteArray m_format;
+    QSize m_size;
+    QImage::Format m_imageFormat;
+};
+
+#endif
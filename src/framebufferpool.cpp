@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "framebufferpool.h"
+
+#include <QByteArray>
+#include <QOpenGLFramebufferObjectFormat>
+
+#undef None
+#include <deviceinfo/deviceinfo.h>
+
+// Framebuffers left idle for longer than this are freed when a trim is requested
+static const qint64 maxIdleMsOnTrim = 5000;
+
+FramebufferPool::FramebufferPool(const size_t byteLimit) :
+    m_byteLimit(byteLimit), m_detached(false), m_trimRequested(false), m_allocations(0), m_hits(0), m_evictions(0),
+    m_idleFramebuffers(0), m_idleBytes(0)
+{
+    m_clock.start();
+}
+
+FramebufferPool::~FramebufferPool()
+{
+    clear();
+}
+
+std::shared_ptr<FramebufferPool> FramebufferPool::create()
+{
+    DeviceInfo deviceInfo(DeviceInfo::None);
+    bool ok = false;
+    size_t limitMiB = QByteArray::fromStdString(deviceInfo.get("HaliumQsgFramebufferPoolSize", "16")).toULong(&ok);
+    if (!ok)
+        limitMiB = 16;
+
+    return std::make_shared<FramebufferPool>(limitMiB * 1024 * 1024);
+}
+
+FramebufferPool::Key FramebufferPool::keyFor(const QSize& size, const bool mipmaps)
+{
+    // Exact sizes only, a larger target would need sub-rect texture coordinates that break
+    // repeating wrap modes and let mipmap levels bleed in unrelated contents.
+    return Key(std::make_pair(size.width(), size.height()), mipmaps);
+}
+
+size_t FramebufferPool::byteCount(const QSize& size, const bool mipmaps)
+{
+    const size_t base = (size_t)size.width() * size.height() * 4;
+    return mipmaps ? base + base / 3 : base;
+}
+
+std::unique_ptr<QOpenGLFramebufferObject> FramebufferPool::acquire(const QSize& size, const bool mipmaps)
+{
+    // Acquiring happens with the current context bound, releases are pooled again from here on
+    m_detached = false;
+    processTrimRequest();
+
+    auto bucket = m_idle.find(keyFor(size, mipmaps));
+    while (bucket != m_idle.end() && !bucket->second.empty()) {
+        // Contents are stale, users clear the target before rendering into it anyway
+        IdleFramebuffer idle = bucket->second.back();
+        bucket->second.pop_back();
+        m_idleBytes -= idle.byteCount;
+        m_idleFramebuffers--;
+
+        if (bucket->second.empty()) {
+            m_idle.erase(bucket);
+            bucket = m_idle.end();
+        }
+
+        // The context that owned it might be gone already
+        if (!idle.fbo->isValid()) {
+            delete idle.fbo;
+            continue;
+        }
+
+        m_hits++;
+        return std::unique_ptr<QOpenGLFramebufferObject>(idle.fbo);
+    }
+
+    m_allocations++;
+
+    QOpenGLFramebufferObjectFormat format;
+    format.setMipmap(mipmaps);
+    return std::unique_ptr<QOpenGLFramebufferObject>(new QOpenGLFramebufferObject(size, format));
+}
+
+void FramebufferPool::release(std::unique_ptr<QOpenGLFramebufferObject> fbo)
+{
+    processTrimRequest();
+
+    // Anything released between clear() and the next acquire() belongs to the old context
+    if (m_detached || !fbo || !fbo->isValid())
+        return;
+
+    const bool mipmaps = fbo->format().mipmap();
+    const size_t bytes = byteCount(fbo->size(), mipmaps);
+    if (bytes > m_byteLimit)
+        return;
+
+    m_idle[keyFor(fbo->size(), mipmaps)].push_back({ fbo.release(), bytes, m_clock.elapsed() });
+    m_idleBytes += bytes;
+    m_idleFramebuffers++;
+    evictOverLimit();
+}
+
+void FramebufferPool::evict(std::deque<IdleFramebuffer>& framebuffers)
+{
+    IdleFramebuffer victim = framebuffers.front();
+    framebuffers.pop_front();
+    m_idleBytes -= victim.byteCount;
+    m_idleFramebuffers--;
+    m_evictions++;
+    delete victim.fbo;
+}
+
+void FramebufferPool::evictOverLimit()
+{
+    // Evict the least recently released framebuffers across all buckets until we fit again
+    while (m_idleBytes > m_byteLimit && !m_idle.empty()) {
+        auto oldest = m_idle.begin();
+        for (auto it = m_idle.begin(); it != m_idle.end(); it++) {
+            if (it->second.front().releasedAt < oldest->second.front().releasedAt)
+                oldest = it;
+        }
+
+        evict(oldest->second);
+        if (oldest->second.empty())
+            m_idle.erase(oldest);
+    }
+}
+
+void FramebufferPool::trim(const qint64 maxIdleMs)
+{
+    const qint64 now = m_clock.elapsed();
+
+    for (auto bucket = m_idle.begin(); bucket != m_idle.end();) {
+        auto& framebuffers = bucket->second;
+        while (!framebuffers.empty() && now - framebuffers.front().releasedAt >= maxIdleMs)
+            evict(framebuffers);
+
+        if (framebuffers.empty())
+            bucket = m_idle.erase(bucket);
+        else
+            bucket++;
+    }
+}
+
+void FramebufferPool::requestTrim()
+{
+    m_trimRequested = true;
+}
+
+void FramebufferPool::processTrimRequest()
+{
+    if (m_trimRequested.exchange(false))
+        trim(maxIdleMsOnTrim);
+}
+
+void FramebufferPool::clear()
+{
+    trim(0);
+    m_trimRequested = false;
+    m_detached = true;
+}
+
+FramebufferPool::Stats FramebufferPool::stats() const
+{
+    Stats stats;
+    stats.allocations = m_allocations;
+    stats.hits = m_hits;
+    stats.evictions = m_evictions;
+    stats.idleFramebuffers = m_idleFramebuffers;
+    stats.idleBytes = m_idleBytes;
+    return stats;
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMEBUFFERPOOL_H
+#define FRAMEBUFFERPOOL_H
+
+#include <QElapsedTimer>
+#include <QOpenGLFramebufferObject>
+#include <QSize>
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <utility>
+
+// Recycles the color targets shader-converted textures render into. Framebuffers belong to the
+// GL context of the render thread, so apart from stats() and requestTrim() this is render thread only.
+class FramebufferPool
+{
+public:
+    struct Stats {
+        quint64 allocations = 0;
+        quint64 hits = 0;
+        quint64 evictions = 0;
+        size_t idleFramebuffers = 0;
+        size_t idleBytes = 0;
+    };
+
+    explicit FramebufferPool(const size_t byteLimit);
+    ~FramebufferPool();
+
+    // Pool sized through deviceinfo, one per render context
+    static std::shared_ptr<FramebufferPool> create();
+
+    std::unique_ptr<QOpenGLFramebufferObject> acquire(const QSize& size, const bool mipmaps);
+    void release(std::unique_ptr<QOpenGLFramebufferObject> fbo);
+
+    // Frees framebuffers that have been sitting idle for at least maxIdleMs
+    void trim(const qint64 maxIdleMs = 0);
+    // Any thread, the next acquire() or release() on the render thread trims the pool
+    void requestTrim();
+    // The GL context is about to go away, drops all idle framebuffers. Releases are dropped
+    // as well until the next acquire() is made with the new context.
+    void clear();
+
+    Stats stats() const;
+
+private:
+    typedef std::pair<std::pair<int, int>, bool> Key;
+
+    struct IdleFramebuffer {
+        QOpenGLFramebufferObject* fbo;
+        size_t byteCount;
+        qint64 releasedAt;
+    };
+
+    static Key keyFor(const QSize& size, const bool mipmaps);
+    static size_t byteCount(const QSize& size, const bool mipmaps);
+    void processTrimRequest();
+    void evictOverLimit();
+    void evict(std::deque<IdleFramebuffer>& framebuffers);
+
+    std::map<Key, std::deque<IdleFramebuffer>> m_idle;
+    size_t m_byteLimit;
+    QElapsedTimer m_clock;
+    bool m_detached;
+
+    std::atomic<bool> m_trimRequested;
+    std::atomic<quint64> m_allocations;
+    std::atomic<quint64> m_hits;
+    std::atomic<quint64> m_evictions;
+    std::atomic<size_t> m_idleFramebuffers;
+    std::atomic<size_t> m_idleBytes;
+};
+
+#endif
@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "glstatetracker.h"
+
+#include <QDebug>
+
+#include <algorithm>
+
+template<typename T, int N>
+static bool sameValues(const T (&a)[N], const T (&b)[N])
+{
+    return std::equal(a, a + N, b);
+}
+
+static void queryState(QOpenGLFunctions* gl, const GLenum name, GLint* values)
+{
+    gl->glGetIntegerv(name, values);
+}
+
+static void queryState(QOpenGLFunctions* gl, const GLenum name, GLfloat* values)
+{
+    gl->glGetFloatv(name, values);
+}
+
+template<typename T, int N>
+static bool matchesState(QOpenGLFunctions* gl, const GLenum name, const T (&expected)[N], T& actualFirst)
+{
+    T actual[N];
+    queryState(gl, name, actual);
+    actualFirst = actual[0];
+    return sameValues(actual, expected);
+}
+
+template<typename T, int N>
+static void save(QOpenGLFunctions* gl, const GLenum name, T (&saved)[N], T (&current)[N], bool& touched, bool& currentKnown)
+{
+    if (touched)
+        return;
+
+    queryState(gl, name, saved);
+    std::copy(saved, saved + N, current);
+    touched = true;
+    currentKnown = true;
+}
+
+GLStateTracker::GLStateTracker() :
+    m_gl(nullptr), m_functions(nullptr), m_depth(0), m_verify(false)
+{
+#ifndef NDEBUG
+    m_verify = qEnvironmentVariableIntValue("HALIUMQSG_VERIFY_GL_STATE") == 1;
+#endif
+}
+
+void GLStateTracker::begin(QOpenGLContext* gl)
+{
+    if (m_depth++ > 0)
+        return;
+
+    m_gl = gl;
+    m_functions = gl ? gl->functions() : nullptr;
+}
+
+void GLStateTracker::touch(const int state)
+{
+    QOpenGLFunctions* gl = m_functions;
+
+    switch (state) {
+    case FramebufferBinding:
+        save(gl, GL_FRAMEBUFFER_BINDING, m_framebuffer.saved, m_framebuffer.current, m_framebuffer.touched, m_framebuffer.currentKnown);
+        break;
+    case Viewport:
+        save(gl, GL_VIEWPORT, m_viewport.saved, m_viewport.current, m_viewport.touched, m_viewport.currentKnown);
+        break;
+    case Scissor:
+        save(gl, GL_SCISSOR_BOX, m_scissor.saved, m_scissor.current, m_scissor.touched, m_scissor.currentKnown);
+        break;
+    case ClearColor:
+        save(gl, GL_COLOR_CLEAR_VALUE, m_clearColor.saved, m_clearColor.current, m_clearColor.touched, m_clearColor.currentKnown);
+        break;
+    case ActiveTexture:
+        save(gl, GL_ACTIVE_TEXTURE, m_activeTexture.saved, m_activeTexture.current, m_activeTexture.touched, m_activeTexture.currentKnown);
+        break;
+    case TextureBinding: {
+        auto& texture = m_textures[textureSlot()];
+        save(gl, GL_TEXTURE_BINDING_2D, texture.saved, texture.current, texture.touched, texture.currentKnown);
+        break;
+    }
+    case Program:
+        save(gl, GL_CURRENT_PROGRAM, m_program.saved, m_program.current, m_program.touched, m_program.currentKnown);
+        break;
+    case ArrayBufferBinding:
+        save(gl, GL_ARRAY_BUFFER_BINDING, m_arrayBuffer.saved, m_arrayBuffer.current, m_arrayBuffer.touched, m_arrayBuffer.currentKnown);
+        break;
+    default:
+        break;
+    }
+}
+
+int GLStateTracker::textureSlot() const
+{
+    if (!m_activeTexture.touched)
+        return unknownUnit;
+
+    const int unit = m_activeTexture.current[0] - GL_TEXTURE0;
+    return (unit >= 0 && unit < maxTextureUnits) ? unit : unknownUnit;
+}
+
+void GLStateTracker::bindFramebuffer(const GLuint fbo)
+{
+    touch(FramebufferBinding);
+    if (m_framebuffer.currentKnown && m_framebuffer.current[0] == (GLint)fbo)
+        return;
+
+    m_functions->glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    m_framebuffer.current[0] = fbo;
+    m_framebuffer.currentKnown = true;
+}
+
+void GLStateTracker::setViewport(const GLint x, const GLint y, const GLsizei width, const GLsizei height)
+{
+    const GLint values[4] = { x, y, width, height };
+    touch(Viewport);
+    if (m_viewport.currentKnown && sameValues(m_viewport.current, values))
+        return;
+
+    m_functions->glViewport(x, y, width, height);
+    std::copy(values, values + 4, m_viewport.current);
+    m_viewport.currentKnown = true;
+}
+
+void GLStateTracker::setScissor(const GLint x, const GLint y, const GLsizei width, const GLsizei height)
+{
+    const GLint values[4] = { x, y, width, height };
+    touch(Scissor);
+    if (m_scissor.currentKnown && sameValues(m_scissor.current, values))
+        return;
+
+    m_functions->glScissor(x, y, width, height);
+    std::copy(values, values + 4, m_scissor.current);
+    m_scissor.currentKnown = true;
+}
+
+void GLStateTracker::setClearColor(const GLfloat red, const GLfloat green, const GLfloat blue, const GLfloat alpha)
+{
+    const GLfloat values[4] = { red, green, blue, alpha };
+    touch(ClearColor);
+    if (m_clearColor.currentKnown && sameValues(m_clearColor.current, values))
+        return;
+
+    m_functions->glClearColor(red, green, blue, alpha);
+    std::copy(values, values + 4, m_clearColor.current);
+    m_clearColor.currentKnown = true;
+}
+
+void GLStateTracker::setActiveTexture(const GLenum unit)
+{
+    touch(ActiveTexture);
+
+    // Bindings made so far went to the unit that was active originally, which is known now
+    auto& unknown = m_textures[unknownUnit];
+    if (unknown.touched) {
+        const int slot = textureSlot();
+        if (slot != unknownUnit && !m_textures[slot].touched)
+            m_textures[slot] = unknown;
+        unknown = Tracked<GLint, 1>();
+    }
+
+    if (m_activeTexture.currentKnown && m_activeTexture.current[0] == (GLint)unit)
+        return;
+
+    m_functions->glActiveTexture(unit);
+    m_activeTexture.current[0] = unit;
+    m_activeTexture.currentKnown = true;
+}
+
+void GLStateTracker::bindTexture(const GLuint texture)
+{
+    touch(TextureBinding);
+    auto& binding = m_textures[textureSlot()];
+    if (binding.currentKnown && binding.current[0] == (GLint)texture)
+        return;
+
+    m_functions->glBindTexture(GL_TEXTURE_2D, texture);
+    binding.current[0] = texture;
+    binding.currentKnown = true;
+}
+
+void GLStateTracker::useProgram(const GLuint program)
+{
+    touch(Program);
+    if (m_program.currentKnown && m_program.current[0] == (GLint)program)
+        return;
+
+    m_functions->glUseProgram(program);
+    m_program.current[0] = program;
+    m_program.currentKnown = true;
+}
+
+void GLStateTracker::bindArrayBuffer(const GLuint buffer)
+{
+    touch(ArrayBufferBinding);
+    if (m_arrayBuffer.currentKnown && m_arrayBuffer.current[0] == (GLint)buffer)
+        return;
+
+    m_functions->glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    m_arrayBuffer.current[0] = buffer;
+    m_arrayBuffer.currentKnown = true;
+}
+
+void GLStateTracker::invalidate(const int states)
+{
+    static const int all[] = { FramebufferBinding, Viewport, Scissor, ClearColor, ActiveTexture, TextureBinding, Program, ArrayBufferBinding };
+
+    for (const int state : all) {
+        if (!(states & state))
+            continue;
+
+        touch(state);
+        switch (state) {
+        case FramebufferBinding: m_framebuffer.currentKnown = false; break;
+        case Viewport: m_viewport.currentKnown = false; break;
+        case Scissor: m_scissor.currentKnown = false; break;
+        case ClearColor: m_clearColor.currentKnown = false; break;
+        case ActiveTexture: m_activeTexture.currentKnown = false; break;
+        case TextureBinding: m_textures[textureSlot()].currentKnown = false; break;
+        case Program: m_program.currentKnown = false; break;
+        case ArrayBufferBinding: m_arrayBuffer.currentKnown = false; break;
+        }
+    }
+}
+
+void GLStateTracker::verify(const char* when)
+{
+    QOpenGLFunctions* gl = m_functions;
+
+    const auto check = [&](const char* name, const GLenum pname, auto& tracked) {
+        if (!tracked.touched || !tracked.currentKnown)
+            return;
+
+        auto actual = tracked.current[0];
+        if (!matchesState(gl, pname, tracked.current, actual))
+            qWarning() << "GL state mismatch" << when << "for" << name << "shadowed:" << tracked.current[0] << "actual:" << actual;
+    };
+
+    check("framebuffer binding", GL_FRAMEBUFFER_BINDING, m_framebuffer);
+    check("viewport", GL_VIEWPORT, m_viewport);
+    check("scissor box", GL_SCISSOR_BOX, m_scissor);
+    check("clear color", GL_COLOR_CLEAR_VALUE, m_clearColor);
+    check("program", GL_CURRENT_PROGRAM, m_program);
+    check("array buffer binding", GL_ARRAY_BUFFER_BINDING, m_arrayBuffer);
+
+    // Texture bindings are per unit, the active unit is checked after those
+    GLint active = 0;
+    gl->glGetIntegerv(GL_ACTIVE_TEXTURE, &active);
+    for (int unit = 0; unit < maxTextureUnits; unit++) {
+        if (m_textures[unit].touched && m_textures[unit].currentKnown) {
+            gl->glActiveTexture(GL_TEXTURE0 + unit);
+            check("texture binding", GL_TEXTURE_BINDING_2D, m_textures[unit]);
+        }
+    }
+    gl->glActiveTexture(active);
+    check("texture binding", GL_TEXTURE_BINDING_2D, m_textures[unknownUnit]);
+    check("active texture", GL_ACTIVE_TEXTURE, m_activeTexture);
+}
+
+void GLStateTracker::end(const int keep)
+{
+    if (m_depth == 0 || --m_depth > 0)
+        return;
+
+    QOpenGLFunctions* gl = m_functions;
+    if (!gl)
+        return;
+
+    if (m_verify)
+        verify("before restoring");
+
+    const auto restore = [](auto& tracked) {
+        const bool changed = !tracked.currentKnown || !sameValues(tracked.current, tracked.saved);
+        std::copy(tracked.saved, tracked.saved + sizeof(tracked.saved) / sizeof(tracked.saved[0]), tracked.current);
+        tracked.currentKnown = true;
+        return tracked.touched && changed;
+    };
+
+    // Keeping the texture binding only concerns the unit that was active originally
+    int keptUnit = -1;
+    if (keep & TextureBinding)
+        keptUnit = m_activeTexture.touched ? m_activeTexture.saved[0] - GL_TEXTURE0 : unknownUnit;
+
+    // Bindings on units other than the active one need their unit selected first
+    bool switchedUnits = false;
+    for (int unit = 0; unit < maxTextureUnits; unit++) {
+        if (unit == keptUnit || !m_textures[unit].touched || !restore(m_textures[unit]))
+            continue;
+
+        gl->glActiveTexture(GL_TEXTURE0 + unit);
+        gl->glBindTexture(GL_TEXTURE_2D, m_textures[unit].saved[0]);
+        switchedUnits = true;
+    }
+    if ((switchedUnits || !(keep & ActiveTexture)) && m_activeTexture.touched) {
+        if (restore(m_activeTexture) || switchedUnits)
+            gl->glActiveTexture(m_activeTexture.saved[0]);
+    }
+    if (keptUnit != unknownUnit && restore(m_textures[unknownUnit]))
+        gl->glBindTexture(GL_TEXTURE_2D, m_textures[unknownUnit].saved[0]);
+
+    if (!(keep & FramebufferBinding) && restore(m_framebuffer))
+        gl->glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer.saved[0]);
+    if (!(keep & Viewport) && restore(m_viewport))
+        gl->glViewport(m_viewport.saved[0], m_viewport.saved[1], m_viewport.saved[2], m_viewport.saved[3]);
+    if (!(keep & Scissor) && restore(m_scissor))
+        gl->glScissor(m_scissor.saved[0], m_scissor.saved[1], m_scissor.saved[2], m_scissor.saved[3]);
+    if (!(keep & ClearColor) && restore(m_clearColor))
+        gl->glClearColor(m_clearColor.saved[0], m_clearColor.saved[1], m_clearColor.saved[2], m_clearColor.saved[3]);
+    if (!(keep & Program) && restore(m_program))
+        gl->glUseProgram(m_program.saved[0]);
+    if (!(keep & ArrayBufferBinding) && restore(m_arrayBuffer))
+        gl->glBindBuffer(GL_ARRAY_BUFFER, m_arrayBuffer.saved[0]);
+
+    if (m_verify && !keep)
+        verify("after restoring");
+
+    // Qt takes over again and may change anything, nothing is known about the state from here on
+    m_framebuffer = Tracked<GLint, 1>();
+    m_viewport = Tracked<GLint, 4>();
+    m_scissor = Tracked<GLint, 4>();
+    m_clearColor = Tracked<GLfloat, 4>();
+    m_activeTexture = Tracked<GLint, 1>();
+    for (auto& texture : m_textures)
+        texture = Tracked<GLint, 1>();
+    m_program = Tracked<GLint, 1>();
+    m_arrayBuffer = Tracked<GLint, 1>();
+    m_gl = nullptr;
+    m_functions = nullptr;
+}
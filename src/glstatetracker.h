@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GLSTATETRACKER_H
+#define GLSTATETRACKER_H
+
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+
+// Shadows the pieces of GL state this plugin changes while preparing textures, which is called into
+// from the middle of Qt's rendering. Only state actually touched within a begin()/end() pair is queried,
+// once, and only state that ended up different gets restored. Some drivers sync the whole pipeline on
+// every glGet, so those are kept to a minimum. Render thread only, one per GL context.
+//
+// Debug builds compare the shadow with the real state on end() with HALIUMQSG_VERIFY_GL_STATE=1 set.
+class GLStateTracker
+{
+public:
+    enum State {
+        FramebufferBinding = 0x1,
+        Viewport = 0x2,
+        Scissor = 0x4,
+        ClearColor = 0x8,
+        ActiveTexture = 0x10,
+        TextureBinding = 0x20,
+        Program = 0x40,
+        ArrayBufferBinding = 0x80
+    };
+
+    GLStateTracker();
+
+    // Scopes nest, only the outermost end() restores
+    void begin(QOpenGLContext* gl);
+    // State in keep is left as it is, for callers about to set it themselves anyway.
+    // For TextureBinding that's the binding of the unit active when the scope began.
+    void end(const int keep = 0);
+
+    void bindFramebuffer(const GLuint fbo);
+    void setViewport(const GLint x, const GLint y, const GLsizei width, const GLsizei height);
+    void setScissor(const GLint x, const GLint y, const GLsizei width, const GLsizei height);
+    void setClearColor(const GLfloat red, const GLfloat green, const GLfloat blue, const GLfloat alpha);
+    void setActiveTexture(const GLenum unit);
+    void bindTexture(const GLuint texture);
+    void useProgram(const GLuint program);
+    void bindArrayBuffer(const GLuint buffer);
+
+    // For code changing state behind the tracker's back, e.g. Qt creating a framebuffer object
+    void invalidate(const int states);
+
+private:
+    static const int maxTextureUnits = 8;
+    // Texture bindings made before any unit got selected go to whatever unit was active
+    static const int unknownUnit = maxTextureUnits;
+
+    template<typename T, int N>
+    struct Tracked {
+        T saved[N];
+        T current[N];
+        bool touched = false;
+        bool currentKnown = false;
+    };
+
+    void touch(const int state);
+    int textureSlot() const;
+    void verify(const char* when);
+
+    QOpenGLContext* m_gl;
+    QOpenGLFunctions* m_functions;
+    int m_depth;
+    bool m_verify;
+
+    Tracked<GLint, 1> m_framebuffer;
+    Tracked<GLint, 4> m_viewport;
+    Tracked<GLint, 4> m_scissor;
+    Tracked<GLfloat, 4> m_clearColor;
+    Tracked<GLint, 1> m_activeTexture;
+    Tracked<GLint, 1> m_textures[maxTextureUnits + 1];
+    Tracked<GLint, 1> m_program;
+    Tracked<GLint, 1> m_arrayBuffer;
+};
+
+#endif
@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gpufence.h"
+
+#include <QDebug>
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+
+#include <poll.h>
+#include <unistd.h>
+
+#ifndef EGL_SYNC_NATIVE_FENCE_ANDROID
+#define EGL_SYNC_NATIVE_FENCE_ANDROID 0x3144
+#define EGL_SYNC_NATIVE_FENCE_FD_ANDROID 0x3145
+#define EGL_NO_NATIVE_FENCE_FD_ANDROID -1
+#endif
+
+// Declared here rather than taken from eglext.h, older headers lack them
+typedef EGLint (EGLAPIENTRYP DupNativeFenceFdFunction)(EGLDisplay display, EGLSyncKHR sync);
+typedef EGLint (EGLAPIENTRYP WaitSyncFunction)(EGLDisplay display, EGLSyncKHR sync, EGLint flags);
+
+// Longest a server side wait falls back to waiting on the CPU
+static const quint64 fallbackWaitNs = 1000 * 1000 * 1000;
+
+struct FenceFunctions {
+    FenceFunctions() :
+        eglCreateSyncKHR((PFNEGLCREATESYNCKHRPROC)eglGetProcAddress("eglCreateSyncKHR")),
+        eglDestroySyncKHR((PFNEGLDESTROYSYNCKHRPROC)eglGetProcAddress("eglDestroySyncKHR")),
+        eglClientWaitSyncKHR((PFNEGLCLIENTWAITSYNCKHRPROC)eglGetProcAddress("eglClientWaitSyncKHR")),
+        eglWaitSyncKHR((WaitSyncFunction)eglGetProcAddress("eglWaitSyncKHR")),
+        eglDupNativeFenceFDANDROID((DupNativeFenceFdFunction)eglGetProcAddress("eglDupNativeFenceFDANDROID"))
+    {
+    }
+
+    bool isResolved() const
+    {
+        return eglCreateSyncKHR && eglDestroySyncKHR && eglClientWaitSyncKHR;
+    }
+
+    PFNEGLCREATESYNCKHRPROC eglCreateSyncKHR;
+    PFNEGLDESTROYSYNCKHRPROC eglDestroySyncKHR;
+    PFNEGLCLIENTWAITSYNCKHRPROC eglClientWaitSyncKHR;
+    WaitSyncFunction eglWaitSyncKHR;
+    DupNativeFenceFdFunction eglDupNativeFenceFDANDROID;
+};
+
+// What the display supports, there's only ever the one display around
+struct FenceSupport {
+    bool fence = false;
+    bool waitSync = false;
+    bool nativeFence = false;
+};
+
+static const FenceFunctions& fenceFunctions()
+{
+    static const FenceFunctions functions;
+    return functions;
+}
+
+static bool hasExtension(EGLDisplay display, const char* name)
+{
+    const char* extensions = eglQueryString(display, EGL_EXTENSIONS);
+    if (!extensions)
+        return false;
+
+    // Whole words only, some names are prefixes of others
+    const size_t length = strlen(name);
+    for (const char* match = strstr(extensions, name); match; match = strstr(match + length, name)) {
+        const bool start = (match == extensions || match[-1] == ' ');
+        const bool end = (match[length] == ' ' || match[length] == '\0');
+        if (start && end)
+            return true;
+    }
+    return false;
+}
+
+static const FenceSupport& fenceSupport(EGLDisplay display)
+{
+    static const FenceSupport support = [display]() {
+        const FenceFunctions& functions = fenceFunctions();
+        FenceSupport result;
+        result.fence = functions.isResolved() && hasExtension(display, "EGL_KHR_fence_sync");
+        result.waitSync = result.fence && functions.eglWaitSyncKHR && hasExtension(display, "EGL_KHR_wait_sync");
+        result.nativeFence = result.fence && functions.eglDupNativeFenceFDANDROID &&
+                             hasExtension(display, "EGL_ANDROID_native_fence_sync");
+        qDebug() << "EGL fences:" << result.fence << "server side waits:" << result.waitSync << "native fences:" << result.nativeFence;
+        return result;
+    }();
+    return support;
+}
+
+// Waits for a native fence, -1 for as long as it takes
+static bool pollFd(const int fd, const int timeoutMs)
+{
+    struct pollfd descriptor;
+    descriptor.fd = fd;
+    descriptor.events = POLLIN;
+
+    int result = 0;
+    do {
+        result = poll(&descriptor, 1, timeoutMs);
+    } while (result < 0 && (errno == EINTR || errno == EAGAIN));
+
+    return result > 0 && (descriptor.revents & POLLIN);
+}
+
+GpuFence::GpuFence(EGLDisplay display, EGLSyncKHR sync, const int fd) : m_display(display), m_sync(sync), m_fd(fd)
+{
+}
+
+GpuFence::~GpuFence()
+{
+    if (m_fd >= 0)
+        close(m_fd);
+    if (m_sync != EGL_NO_SYNC_KHR)
+        fenceFunctions().eglDestroySyncKHR(m_display, m_sync);
+}
+
+bool GpuFence::isSupported()
+{
+    EGLDisplay display = eglGetCurrentDisplay();
+    if (display == EGL_NO_DISPLAY)
+        return false;
+
+    return fenceSupport(display).fence;
+}
+
+std::shared_ptr<GpuFence> GpuFence::create()
+{
+    if (!isSupported())
+        return nullptr;
+
+    const FenceFunctions& functions = fenceFunctions();
+    EGLDisplay display = eglGetCurrentDisplay();
+
+    if (fenceSupport(display).nativeFence) {
+        static const EGLint attributes[] = { EGL_SYNC_NATIVE_FENCE_FD_ANDROID, EGL_NO_NATIVE_FENCE_FD_ANDROID, EGL_NONE };
+        EGLSyncKHR sync = functions.eglCreateSyncKHR(display, EGL_SYNC_NATIVE_FENCE_ANDROID, attributes);
+        if (sync != EGL_NO_SYNC_KHR) {
+            // The file descriptor only exists once the fence got flushed to the GPU
+            QOpenGLContext* current = QOpenGLContext::currentContext();
+            if (current)
+                current->functions()->glFlush();
+
+            const int fd = functions.eglDupNativeFenceFDANDROID(display, sync);
+            if (fd >= 0)
+                return std::shared_ptr<GpuFence>(new GpuFence(display, sync, fd));
+
+            functions.eglDestroySyncKHR(display, sync);
+        }
+    }
+
+    EGLSyncKHR sync = functions.eglCreateSyncKHR(display, EGL_SYNC_FENCE_KHR, nullptr);
+    if (sync == EGL_NO_SYNC_KHR) {
+        qWarning() << "Failed to create fence, EGL error" << eglGetError();
+        return nullptr;
+    }
+
+    return std::shared_ptr<GpuFence>(new GpuFence(display, sync, -1));
+}
+
+bool GpuFence::isSignaled() const
+{
+    if (m_fd >= 0)
+        return pollFd(m_fd, 0);
+
+    return fenceFunctions().eglClientWaitSyncKHR(m_display, m_sync, 0, 0) == EGL_CONDITION_SATISFIED_KHR;
+}
+
+bool GpuFence::wait(const quint64 timeoutNs) const
+{
+    if (m_fd >= 0) {
+        const quint64 timeoutMs = (timeoutNs + 999999) / 1000000;
+        return pollFd(m_fd, timeoutMs > INT_MAX ? -1 : (int)timeoutMs);
+    }
+
+    const EGLint result = fenceFunctions().eglClientWaitSyncKHR(m_display, m_sync, EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, timeoutNs);
+    return result == EGL_CONDITION_SATISFIED_KHR;
+}
+
+void GpuFence::serverWait() const
+{
+    if (fenceSupport(m_display).waitSync && fenceFunctions().eglWaitSyncKHR(m_display, m_sync, 0) == EGL_TRUE)
+        return;
+
+    if (!wait(fallbackWaitNs))
+        qWarning() << "Timed out waiting for fence";
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GPUFENCE_H
+#define GPUFENCE_H
+
+#include <QtGlobal>
+
+#include <memory>
+
+#define EGL_NO_X11 1
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#undef Bool
+#undef None
+
+// A point in the command stream of the current GL context, signaled once the GPU got past it.
+// Lets memory the GPU reads from be freed or reused without stalling on glFinish().
+// Backed by an Android native fence where EGL_ANDROID_native_fence_sync is available,
+// which any thread can wait for on the file descriptor without going through EGL.
+class GpuFence
+{
+public:
+    ~GpuFence();
+
+    // Whether the EGL display of the current context supports EGL_KHR_fence_sync
+    static bool isSupported();
+
+    // Inserts a fence after the commands issued so far, null if fences aren't supported
+    static std::shared_ptr<GpuFence> create();
+
+    // Polls without blocking
+    bool isSignaled() const;
+    // Blocks the calling thread for at most timeoutNs
+    bool wait(const quint64 timeoutNs) const;
+    // Makes the GPU wait for the fence before running commands issued to the current context
+    // from here on, without blocking the calling thread. Waits on the CPU without EGL_KHR_wait_sync.
+    void serverWait() const;
+
+private:
+    GpuFence(EGLDisplay display, EGLSyncKHR sync, const int fd);
+
+    EGLDisplay m_display;
+    EGLSyncKHR m_sync;
+    int m_fd;
+};
+
+#endif
@@ -15,17 +15,24 @@
  */
 
 #include "gralloctexture.h"
+#include "rowbands.h"
+#include "streamcopy.h"
+#include "tiledtexture.h"
 
 #include <QAbstractEventDispatcher>
 #include <QDebug>
-#include <QtConcurrent>
 #include <QElapsedTimer>
+#include <QGuiApplication>
 #include <QMutexLocker>
 #include <QTimer>
 #include <QQuickWindow>
 #include <QOpenGLExtraFunctions>
 
+#include <QtQuick/private/qsgcontext_p.h>
+
+#include <cstring>
 #include <exception>
+#include <vector>
 
 #include <sys/sysinfo.h>
 
@@ -33,27 +40,30 @@ extern "C" {
 void hybris_ui_initialize();
 }
 
-static EglImageFunctions eglImageFunctions;
-
-EglImageFunctions::EglImageFunctions()
-{
-    eglCreateImageKHR = (PFNEGLCREATEIMAGEKHRPROC)eglGetProcAddress("eglCreateImageKHR");
-    if (!eglCreateImageKHR)
-        throw std::runtime_error("eglCreateImageKHR");
-
-    eglDestroyImageKHR = (PFNEGLDESTROYIMAGEKHRPROC)eglGetProcAddress("eglDestroyImageKHR");
-    if (!eglDestroyImageKHR)
-        throw std::runtime_error("eglDestroyImageKHR");
+// GLES 3 texture swizzle, not part of the GLES 2 headers Qt might be built against
+#ifndef GL_TEXTURE_SWIZZLE_R
+#define GL_TEXTURE_SWIZZLE_R 0x8E42
+#define GL_TEXTURE_SWIZZLE_G 0x8E43
+#define GL_TEXTURE_SWIZZLE_B 0x8E44
+#define GL_TEXTURE_SWIZZLE_A 0x8E45
+#endif
+#ifndef GL_RED
+#define GL_RED 0x1903
+#endif
+#ifndef GL_GREEN
+#define GL_GREEN 0x1904
+#endif
+#ifndef GL_BLUE
+#define GL_BLUE 0x1905
+#endif
 
-    glEGLImageTargetTexture2DOES = (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC)eglGetProcAddress("glEGLImageTargetTexture2DOES");
-    if (!glEGLImageTargetTexture2DOES)
-        throw std::runtime_error("glEGLImageTargetTexture2DOES");
-}
+static EglImageFunctions eglImageFunctions;
 
 static inline QThreadPool* initThreadPool()
 {
+    // Helpers splitting large copies into row bands, uploads themselves run on the upload scheduler.
     // Leave room for the render and main threads to be scheduled often
-    // Pools 2 uploader threads at minimum.
+    // Pools 2 helper threads at minimum.
     const int maxThreads = std::max<int>(2, get_nprocs_conf() - 2);
     QThreadPool* pool = new QThreadPool();
     pool->setMaxThreadCount(maxThreads);
@@ -62,9 +72,272 @@ static inline QThreadPool* initThreadPool()
 }
 
 GrallocTextureCreator::GrallocTextureCreator(QObject* parent) :
-    QObject(parent), m_threadPool(initThreadPool()), m_debug(qEnvironmentVariableIsSet("HALIUMQSG_LOG_TEXTURES"))
+    QObject(parent), m_threadPool(initThreadPool()), m_scheduler(UploadScheduler::shared()), m_bufferPool(GrallocBufferPool::shared()),
+    m_textureCache(TextureCache::shared()), m_framebufferPool(FramebufferPool::create()), m_stateTracker(std::make_shared<GLStateTracker>()),
+    m_conversionBatch(std::make_shared<ConversionBatch>(m_stateTracker)), m_atlasManager(new AtlasManager(m_bufferPool, m_scheduler, convertUsage(), convertLockUsage())),
+    m_trimTimer(new QTimer(this)), m_cpuConversionFormats(0), m_nonBlocking(false), m_resampleFilter(ResampleFilter_Lanczos), m_debug(qEnvironmentVariableIsSet("HALIUMQSG_LOG_TEXTURES")),
+    m_swizzleSupport(SwizzleSupport_Unknown)
 {
+    // Give pooled buffers back to the system once texture creation has calmed down
+    m_trimTimer->setSingleShot(true);
+    m_trimTimer->setInterval(5000);
+    QObject::connect(m_trimTimer, &QTimer::timeout, this, &GrallocTextureCreator::trimBufferPool);
+}
 
+void GrallocTextureCreator::trimBufferPool()
+{
+    if (m_debug) {
+        const auto stats = m_bufferPool->stats();
+        qInfo() << "Buffer pool hits:" << stats.hits << "misses:" << stats.misses << "evictions:" << stats.evictions
+                << "idle buffers:" << stats.idleBuffers << "idle bytes:" << stats.idleBytes;
+
+        const auto cacheStats = m_textureCache->stats();
+        const quint64 lookups = cacheStats.hits + cacheStats.misses;
+        qInfo() << "Texture cache hit rate:" << (lookups ? (100.0 * cacheStats.hits / lookups) : 0.0) << "%"
+                << "bytes saved:" << cacheStats.bytesSaved << "entries:" << cacheStats.entries << "bytes:" << cacheStats.bytes;
+
+        const auto schedulerStats = m_scheduler->stats();
+        qInfo() << "Upload scheduler submitted:" << schedulerStats.submitted << "coalesced:" << schedulerStats.coalesced
+                << "cancelled:" << schedulerStats.cancelled << "rejected:" << schedulerStats.rejected
+                << "stolen:" << schedulerStats.stolen << "ran by waiter:" << schedulerStats.ranByWaiter
+                << "queue depth:" << schedulerStats.queueDepth << "max queue depth:" << schedulerStats.maxQueueDepth
+                << "average wait:" << schedulerStats.averageWaitUs << "us max wait:" << schedulerStats.maxWaitUs << "us";
+
+        const auto fboStats = m_framebufferPool->stats();
+        const quint64 fboRequests = fboStats.hits + fboStats.allocations;
+        qInfo() << "Framebuffer pool hit rate:" << (fboRequests ? (100.0 * fboStats.hits / fboRequests) : 0.0) << "%"
+                << "allocations:" << fboStats.allocations << "evictions:" << fboStats.evictions
+                << "idle framebuffers:" << fboStats.idleFramebuffers << "idle bytes:" << fboStats.idleBytes;
+    }
+
+    m_bufferPool->trim();
+    // Framebuffers can only be freed on the render thread, which picks this up with its next texture
+    m_framebufferPool->requestTrim();
+}
+
+// Note: On some devices anything other than HAL_PIXEL_FORMAT_RGBA_8888 is impossible
+//       to be used together with a shader and results in a solely blank surface.
+//       This is especially apparent on older generations of hardware, ie Halium 7 and some 9 devices.
+#define NATIVE_FORMAT(format, halFormat, halFormatWithAlpha, bytesPerPixel, shader, shaderWithAlpha) \
+    { QImage::Format_##format, #format, FormatStrategy_Native, QImage::Format_##format, \
+      halFormat, halFormatWithAlpha, bytesPerPixel, shader, shaderWithAlpha }
+#define LOOKUP_FORMAT(format) \
+    { QImage::Format_##format, #format, FormatStrategy_Lookup, QImage::Format_##format, \
+      HAL_PIXEL_FORMAT_RGBA_8888, HAL_PIXEL_FORMAT_RGBA_8888, 4, ColorShader_None, ColorShader_None }
+#define CONVERT_FORMAT(format, uploadFormat) \
+    { QImage::Format_##format, #format, FormatStrategy_Convert, QImage::Format_##uploadFormat, \
+      -1, -1, 0, ColorShader_None, ColorShader_None }
+
+// Indexed by QImage::Format
+static constexpr FormatDescriptor formatDescriptors[] = {
+    { QImage::Format_Invalid, "Invalid", FormatStrategy_Unsupported, QImage::Format_Invalid, -1, -1, 0, ColorShader_None, ColorShader_None },
+    CONVERT_FORMAT(Mono, ARGB32_Premultiplied),
+    CONVERT_FORMAT(MonoLSB, ARGB32_Premultiplied),
+    LOOKUP_FORMAT(Indexed8),
+    NATIVE_FORMAT(RGB32, HAL_PIXEL_FORMAT_RGBA_8888, HAL_PIXEL_FORMAT_BGRA_8888, 4, ColorShader_RGB32ToRGBX8888, ColorShader_None),
+    NATIVE_FORMAT(ARGB32, HAL_PIXEL_FORMAT_RGBA_8888, HAL_PIXEL_FORMAT_RGBA_8888, 4, ColorShader_RGB32ToRGBX8888, ColorShader_RGB32ToRGBX8888),
+    NATIVE_FORMAT(ARGB32_Premultiplied, HAL_PIXEL_FORMAT_RGBX_8888, HAL_PIXEL_FORMAT_BGRA_8888, 4, ColorShader_RGB32ToRGBX8888, ColorShader_None),
+    NATIVE_FORMAT(RGB16, HAL_PIXEL_FORMAT_RGB_565, HAL_PIXEL_FORMAT_RGB_565, 2, ColorShader_None, ColorShader_None),
+    CONVERT_FORMAT(ARGB8565_Premultiplied, ARGB32_Premultiplied),
+    CONVERT_FORMAT(RGB666, RGB32),
+    CONVERT_FORMAT(ARGB6666_Premultiplied, ARGB32_Premultiplied),
+    CONVERT_FORMAT(RGB555, RGB32),
+    CONVERT_FORMAT(ARGB8555_Premultiplied, ARGB32_Premultiplied),
+    NATIVE_FORMAT(RGB888, HAL_PIXEL_FORMAT_RGB_888, HAL_PIXEL_FORMAT_RGB_888, 3, ColorShader_None, ColorShader_None),
+    CONVERT_FORMAT(RGB444, RGB32),
+    CONVERT_FORMAT(ARGB4444_Premultiplied, ARGB32_Premultiplied),
+    NATIVE_FORMAT(RGBX8888, HAL_PIXEL_FORMAT_RGBX_8888, HAL_PIXEL_FORMAT_RGBX_8888, 4, ColorShader_None, ColorShader_None),
+    CONVERT_FORMAT(RGBA8888, RGBA8888_Premultiplied),
+    NATIVE_FORMAT(RGBA8888_Premultiplied, HAL_PIXEL_FORMAT_RGBX_8888, HAL_PIXEL_FORMAT_RGBA_8888, 4, ColorShader_None, ColorShader_None),
+    CONVERT_FORMAT(BGR30, RGB32),
+    CONVERT_FORMAT(A2BGR30_Premultiplied, ARGB32_Premultiplied),
+    CONVERT_FORMAT(RGB30, RGB32),
+    CONVERT_FORMAT(A2RGB30_Premultiplied, ARGB32_Premultiplied),
+    LOOKUP_FORMAT(Alpha8),
+    LOOKUP_FORMAT(Grayscale8),
+    CONVERT_FORMAT(RGBX64, RGB32),
+    CONVERT_FORMAT(RGBA64, ARGB32_Premultiplied),
+    CONVERT_FORMAT(RGBA64_Premultiplied, ARGB32_Premultiplied),
+#if QT_VERSION >= QT_VERSION_CHECK(5, 13, 0)
+    CONVERT_FORMAT(Grayscale16, Grayscale8),
+#endif
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+    CONVERT_FORMAT(BGR888, RGB888),
+#endif
+};
+
+#undef NATIVE_FORMAT
+#undef LOOKUP_FORMAT
+#undef CONVERT_FORMAT
+
+static constexpr int formatDescriptorCount = sizeof(formatDescriptors) / sizeof(formatDescriptors[0]);
+
+static constexpr bool formatDescriptorsOrdered(const int index = 0)
+{
+    return index == formatDescriptorCount ||
+           (formatDescriptors[index].format == index && formatDescriptorsOrdered(index + 1));
+}
+
+static_assert(formatDescriptorCount == QImage::NImageFormats, "Every QImage format needs a descriptor");
+static_assert(formatDescriptorsOrdered(), "Format descriptors must be indexed by QImage::Format");
+
+const FormatDescriptor& GrallocTextureCreator::formatDescriptor(const QImage::Format format)
+{
+    if (format < 0 || format >= formatDescriptorCount)
+        return formatDescriptors[QImage::Format_Invalid];
+    return formatDescriptors[format];
+}
+
+QImage::Format GrallocTextureCreator::uploadFormat(const QImage::Format format)
+{
+    return formatDescriptor(format).uploadFormat;
+}
+
+void GrallocTextureCreator::setCpuConversionFormats(const QByteArray& formats)
+{
+    m_cpuConversionFormats = 0;
+
+    for (const QByteArray& name : formats.split(',')) {
+        const QByteArray trimmed = name.trimmed();
+        if (trimmed.isEmpty() || trimmed == "none")
+            continue;
+
+        // Only natively uploaded formats go through conversion shaders
+        for (const auto& entry : formatDescriptors) {
+            if (entry.strategy != FormatStrategy_Native)
+                continue;
+            if (trimmed == "all" || trimmed == entry.name)
+                m_cpuConversionFormats |= (1ull << entry.format);
+        }
+    }
+
+    if (m_debug)
+        qInfo() << "CPU color conversion using" << pixelConversionBackend() << "kernels, formats:" << formats;
+}
+
+bool GrallocTextureCreator::cpuConversionEnabled(const QImage::Format format) const
+{
+    return (m_cpuConversionFormats & (1ull << format)) != 0;
+}
+
+void GrallocTextureCreator::setNonBlockingUploads(const bool nonBlocking)
+{
+    m_nonBlocking = nonBlocking;
+}
+
+void GrallocTextureCreator::setResampleFilter(const ResampleFilter filter)
+{
+    m_resampleFilter = filter;
+}
+
+void GrallocTextureCreator::setTextureSwizzle(const bool enabled)
+{
+    m_swizzleSupport = enabled ? SwizzleSupport_Unknown : SwizzleSupport_Rejected;
+}
+
+bool GrallocTextureCreator::textureSwizzleProbed() const
+{
+    return m_swizzleSupport != SwizzleSupport_Unknown;
+}
+
+void GrallocTextureCreator::setTextureSwizzleAccepted(const bool accepted)
+{
+    m_swizzleSupport = accepted ? SwizzleSupport_Accepted : SwizzleSupport_Rejected;
+
+    if (!accepted)
+        qWarning() << "Texture swizzle rejected for EGLImage textures, using conversion shaders instead";
+    else if (m_debug)
+        qInfo() << "Texture swizzle accepted for EGLImage textures";
+}
+
+bool GrallocTextureCreator::textureSwizzleSupported(QOpenGLContext* gl)
+{
+    if (!gl)
+        return false;
+
+    if (gl->isOpenGLES())
+        return gl->format().majorVersion() >= 3;
+
+    return gl->format().version() >= qMakePair(3, 3) || gl->hasExtension(QByteArrayLiteral("GL_ARB_texture_swizzle"));
+}
+
+// Mirrors what the respective conversion shader samples, for the shaders doing nothing but that
+bool GrallocTextureCreator::textureSwizzle(const ColorShader conversionShader, const bool alpha, GLint* mask)
+{
+    switch (conversionShader) {
+    case ColorShader_Passthrough:
+        mask[0] = GL_RED;
+        mask[1] = GL_GREEN;
+        mask[2] = GL_BLUE;
+        mask[3] = alpha ? GL_ALPHA : GL_ONE;
+        return true;
+    case ColorShader_FlipColorChannels:
+        mask[0] = GL_BLUE;
+        mask[1] = GL_GREEN;
+        mask[2] = GL_RED;
+        mask[3] = GL_ONE;
+        return true;
+    case ColorShader_FlipColorChannelsWithAlpha:
+        mask[0] = GL_BLUE;
+        mask[1] = GL_GREEN;
+        mask[2] = GL_RED;
+        mask[3] = GL_ALPHA;
+        return true;
+    case ColorShader_RedAndBlueSwap:
+        mask[0] = GL_BLUE;
+        mask[1] = GL_GREEN;
+        mask[2] = GL_RED;
+        mask[3] = alpha ? GL_ALPHA : GL_ONE;
+        return true;
+    default:
+        return false;
+    }
+}
+
+void GrallocTextureCreator::scheduleRepaint()
+{
+    // Uploads finishing in a burst only need a single frame to get swapped in
+    static std::atomic<bool> repaintPending(false);
+    if (repaintPending.exchange(true))
+        return;
+
+    // Windows are only to be looked at from the GUI thread, QQuickWindow::update() takes care of the rest
+    QMetaObject::invokeMethod(qApp, []() {
+        repaintPending = false;
+        for (QWindow* window : QGuiApplication::topLevelWindows()) {
+            QQuickWindow* quickWindow = qobject_cast<QQuickWindow*>(window);
+            if (quickWindow)
+                quickWindow->update();
+        }
+    }, Qt::QueuedConnection);
+}
+
+// Mirrors what the respective conversion shader writes into its FBO, so that the
+// resulting buffer can be bound as-is.
+unsigned int GrallocTextureCreator::cpuConversion(const ColorShader conversionShader, const int numChannels, const bool alpha)
+{
+    const unsigned int expand = (numChannels == 3) ? PixelConversion_ExpandRGB888 : PixelConversion_None;
+    const unsigned int opaque = alpha ? PixelConversion_None : PixelConversion_ForceOpaque;
+
+    if (numChannels != 3 && numChannels != 4)
+        return PixelConversion_Invalid;
+
+    switch (conversionShader) {
+    case ColorShader_None:
+        return PixelConversion_None;
+    case ColorShader_Passthrough:
+        return expand | opaque;
+    case ColorShader_FlipColorChannels:
+        return expand | PixelConversion_SwapRedBlue | PixelConversion_ForceOpaque;
+    case ColorShader_FlipColorChannelsWithAlpha:
+        return expand | PixelConversion_SwapRedBlue;
+    case ColorShader_RGB32ToRGBX8888:
+        return expand | PixelConversion_SwapRedBlue | (alpha ? PixelConversion_Premultiply : PixelConversion_ForceOpaque);
+    case ColorShader_RedAndBlueSwap:
+        return expand | PixelConversion_SwapRedBlue | opaque;
+    default:
+        return PixelConversion_Invalid;
+    }
 }
 
 constexpr uint32_t GrallocTextureCreator::convertUsage()
@@ -77,211 +350,276 @@ constexpr uint32_t GrallocTextureCreator::convertLockUsage()
     return GRALLOC_USAGE_SW_READ_NEVER | GRALLOC_USAGE_SW_WRITE_RARELY;
 }
 
-int GrallocTextureCreator::convertFormat(const QImage& image, int& numChannels, ColorShader& conversionShader, const bool alpha)
-{
-    // Note: On some devices anything other than HAL_PIXEL_FORMAT_RGBA_8888 is impossible
-    //       to be used together with a shader and results in a solely blank surface.
-    //       This is especially apparent on older generations of hardware, ie Halium 7 and some 9 devices.
-
-    const auto format = image.format();
-    switch (format) {
-    case QImage::Format_Mono:
-        break;
-    case QImage::Format_MonoLSB:
-        break;
-    case QImage::Format_Indexed8:
-        break;
-
-    case QImage::Format_RGB32:
-        conversionShader = alpha ? ColorShader_None : ColorShader_RGB32ToRGBX8888;
-        numChannels = 4;
-        return alpha ? HAL_PIXEL_FORMAT_BGRA_8888 : HAL_PIXEL_FORMAT_RGBA_8888;
-
-    case QImage::Format_ARGB32:
-        conversionShader = ColorShader_RGB32ToRGBX8888;
-        numChannels = 4;
-        return HAL_PIXEL_FORMAT_RGBA_8888;
-
-    case QImage::Format_ARGB32_Premultiplied:
-        conversionShader = alpha ? ColorShader_None : ColorShader_RGB32ToRGBX8888;
-        numChannels = 4;
-        return alpha ? HAL_PIXEL_FORMAT_BGRA_8888 : HAL_PIXEL_FORMAT_RGBX_8888;
-
-    case QImage::Format_RGB16:
-        break;
-    case QImage::Format_ARGB8565_Premultiplied:
-        break;
-    case QImage::Format_RGB666:
-        break;
-    case QImage::Format_ARGB6666_Premultiplied:
-        break;
-    case QImage::Format_RGB555:
-        break;
-    case QImage::Format_ARGB8555_Premultiplied:
-        break;
-    case QImage::Format_RGB888:
-        conversionShader = ColorShader_RedAndBlueSwap;
-        numChannels = 3;
-        return HAL_PIXEL_FORMAT_RGB_888;
-
-    case QImage::Format_RGB444:
-        break;
-    case QImage::Format_ARGB4444_Premultiplied:
-        break;
-    case QImage::Format_RGBX8888:
-        conversionShader = ColorShader_RedAndBlueSwap;
-        numChannels = 4;
-        return HAL_PIXEL_FORMAT_RGBX_8888;
-
-    case QImage::Format_RGBA8888:
-        conversionShader = ColorShader_RedAndBlueSwap;
-        numChannels = 4;
-        return HAL_PIXEL_FORMAT_RGBA_8888;
-
-    case QImage::Format_RGBA8888_Premultiplied:
-        conversionShader = ColorShader_RedAndBlueSwap;
-        numChannels = 4;
-        return HAL_PIXEL_FORMAT_RGBA_8888;
-
-    case QImage::Format_BGR30:
-        break;
-    case QImage::Format_A2BGR30_Premultiplied:
-        break;
-    case QImage::Format_RGB30:
-        break;
-    case QImage::Format_A2RGB30_Premultiplied:
-        break;
-    case QImage::Format_Alpha8:
-        break;
-    case QImage::Format_Grayscale8:
-        break;
-    case QImage::Format_RGBX64:
-        break;
-    case QImage::Format_RGBA64:
-        break;
-    case QImage::Format_RGBA64_Premultiplied:
-        break;
-    default:
-        break;
+unsigned int GrallocTextureCreator::rgbaConversion(const QImage::Format format, const bool alpha)
+{
+    int numChannels = 0;
+    ColorShader shader = ColorShader_None;
+    const int halFormat = convertFormat(format, numChannels, shader, alpha);
+    if (halFormat < 0 || formatDescriptor(format).strategy != FormatStrategy_Native)
+        return PixelConversion_Invalid;
+
+    unsigned int conversion = cpuConversion(shader == ColorShader_None ? ColorShader_Passthrough : shader, numChannels, alpha);
+    if (conversion == PixelConversion_Invalid)
+        return PixelConversion_Invalid;
+
+    // Without a shader the buffer's HAL format does the rest
+    if (shader == ColorShader_None && halFormat == HAL_PIXEL_FORMAT_BGRA_8888)
+        conversion |= PixelConversion_SwapRedBlue;
+    if (shader == ColorShader_None && halFormat == HAL_PIXEL_FORMAT_RGBX_8888)
+        conversion |= PixelConversion_ForceOpaque;
+    return conversion;
+}
+
+// Premultiplied RGBA like Qt's own uploads
+std::vector<uint32_t> GrallocTextureCreator::pixelLookupTable(const QImage& image, const bool alpha)
+{
+    std::vector<uint32_t> table(256, 0);
+
+    for (int i = 0; i < 256; i++) {
+        QRgb color = 0;
+        switch (image.format()) {
+        case QImage::Format_Alpha8:
+            color = qRgba(0, 0, 0, i);
+            break;
+        case QImage::Format_Grayscale8:
+            color = qRgb(i, i, i);
+            break;
+        default:
+            color = (i < image.colorCount()) ? image.color(i) : 0;
+            break;
+        }
+
+        color = alpha ? qPremultiply(color) : (color | 0xff000000);
+
+        const uint8_t pixel[4] = { (uint8_t)qRed(color), (uint8_t)qGreen(color), (uint8_t)qBlue(color), (uint8_t)qAlpha(color) };
+        memcpy(&table[i], pixel, sizeof(pixel));
     }
 
-    return -1;
+    return table;
 }
 
-// After the pixels have arrived at GPU memory, turn them into an EGLImage for easy consumption from within GL.
-void GrallocTextureCreator::signalUploadComplete(const GrallocTexture* texture, struct graphic_buffer* handle, const int textureSize)
+int GrallocTextureCreator::convertFormat(const QImage::Format format, int& numChannels, ColorShader& conversionShader, const bool alpha)
 {
-    EGLImageKHR image = EGL_NO_IMAGE_KHR;
+    const FormatDescriptor& descriptor = formatDescriptor(format);
+    if (descriptor.strategy != FormatStrategy_Native && descriptor.strategy != FormatStrategy_Lookup)
+        return -1;
 
-    if (handle) {
-        const EGLDisplay dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
-        const EGLContext context = EGL_NO_CONTEXT;
-        static const EGLint attrs[] = { EGL_IMAGE_PRESERVED_KHR, EGL_TRUE, EGL_NONE };
+    conversionShader = alpha ? descriptor.shaderWithAlpha : descriptor.shader;
+    numChannels = descriptor.bytesPerPixel;
+    return alpha ? descriptor.halFormatWithAlpha : descriptor.halFormat;
+}
 
-        void* native_buffer = graphic_buffer_get_native_buffer(handle);
-        image = eglImageFunctions.eglCreateImageKHR(dpy, context, EGL_NATIVE_BUFFER_ANDROID, native_buffer, attrs);
-        graphic_buffer_free(handle);
+void GrallocTextureCreator::finishUpload(UploadCompletion* completion, std::shared_ptr<GrallocBuffer> buffer, const int textureSize)
+{
+    // After the pixels have arrived at GPU memory, make sure there's an EGLImage for easy consumption from within GL.
+    // Recycled buffers still carry the one created for their previous user.
+    if (buffer && !m_bufferPool->ensureImage(buffer.get())) {
+        qWarning() << "Failed to create EGLImage";
+        buffer.reset();
     }
 
-    // Here we indicate upload progression/completeness through enqueueing a signal into the main loop.
-    // This allows us to allocate GrallocTextures quickly while a separate thread uploads the pixels to the GPU.
-    // Should the GrallocTexture disappear before the upload thread finishes then it won't result in invalid accesses
-    // as Qt doesn't forward signals to deleted objects, safely.
-    Q_EMIT uploadComplete(texture, image, textureSize);
+    // Hand the result straight to the texture's completion. Should the GrallocTexture have disappeared
+    // in the meantime it cancelled the completion, and the buffer simply goes back to the pool.
+    completion->complete(buffer, textureSize);
 }
 
-GrallocTexture* GrallocTextureCreator::createTexture(const QImage& image, ShaderCache& cachedShaders, const int maxTextureSize, const uint flags, const bool async, QOpenGLContext* gl)
+GrallocTexture* GrallocTextureCreator::createTexture(const QImage& image, const ShaderCache& cachedShaders, const int maxTextureSize, const uint flags, const bool async, QOpenGLContext* gl)
+{
+    return createTexture(image, nullptr, cachedShaders, maxTextureSize, flags, async, gl);
+}
+
+GrallocTexture* GrallocTextureCreator::createEncodedTexture(std::shared_ptr<const EncodedImage> encoded, const ShaderCache& cachedShaders, const int maxTextureSize, const uint flags, const bool async, QOpenGLContext* gl)
+{
+    if (!encoded || !encoded->isValid())
+        return nullptr;
+    return createTexture(QImage(), encoded, cachedShaders, maxTextureSize, flags, async, gl);
+}
+
+GrallocTexture* GrallocTextureCreator::createTexture(const QImage& image, std::shared_ptr<const EncodedImage> encoded, const ShaderCache& cachedShaders,
+                                                     const int maxTextureSize, const uint flags, const bool async, QOpenGLContext* gl)
 {
     int numChannels = 0;
     ColorShader conversionShader = ColorShader_None;
 
-    const bool hasAlphaChannel = image.hasAlphaChannel() && (flags & QQuickWindow::TextureHasAlphaChannel); 
-    const int format = convertFormat(image, numChannels, conversionShader, hasAlphaChannel);
+    // Encoded images are only decoded by the upload job, what they'll decode to is known from their header
+    const QSize imageSize = encoded ? encoded->size() : image.size();
+    const QImage::Format imageFormat = encoded ? encoded->format() : image.format();
+    const bool imageAlpha = encoded ? encoded->hasAlphaChannel() : image.hasAlphaChannel();
+
+    // Oversized images are scaled down to fit along both axes, keeping their aspect ratio
+    QSize size = imageSize;
+    float scaleFactor = 1.0;
+    if (size.width() > maxTextureSize || size.height() > maxTextureSize)
+        scaleFactor = qMin((float)maxTextureSize / (float)size.width(), (float)maxTextureSize / (float)size.height());
+
+    if (scaleFactor != 1.0)
+        size = QSize(qBound(1, (int)(size.width() * scaleFactor), maxTextureSize), qBound(1, (int)(size.height() * scaleFactor), maxTextureSize));
+
+    // Formats without a native gralloc counterpart are converted on the uploader thread.
+    // 8 bit formats don't come out of scaling as such, those are scaled in 32 bits instead.
+    // Filtering straight alpha would bleed the color of transparent pixels into their neighbours.
+    QImage::Format targetFormat = uploadFormat(imageFormat);
+    if (size != imageSize && formatDescriptor(targetFormat).strategy == FormatStrategy_Lookup)
+        targetFormat = QImage::Format_ARGB32_Premultiplied;
+    else if (size != imageSize && targetFormat == QImage::Format_ARGB32)
+        targetFormat = QImage::Format_ARGB32_Premultiplied;
+    const bool lookup = (formatDescriptor(targetFormat).strategy == FormatStrategy_Lookup);
+
+    const bool hasAlphaChannel = imageAlpha && (flags & QQuickWindow::TextureHasAlphaChannel); 
+    int format = convertFormat(targetFormat, numChannels, conversionShader, hasAlphaChannel);
     if (format < 0) {
-        qDebug() << "Unknown color format" << image.format();
+        qDebug() << "Unknown color format" << imageFormat;
         return nullptr;
     }
 
+    // Pure channel reorders are sampled straight from the EGLImage through the texture swizzle, no FBO needed.
+    // Until the driver is known to accept it on EGLImage textures, the shader has to be around to fall back to.
+    // EGLImage textures have a single level, mipmaps still need the FBO.
+    const bool mipmaps = (flags & QSGRenderContext::CreateTexture_Mipmap);
+    const bool shaderReady = cachedShaders.find(conversionShader) != cachedShaders.end();
+    GLint swizzleMask[4] = { GL_RED, GL_GREEN, GL_BLUE, GL_ALPHA };
+    const bool swizzle = conversionShader != ColorShader_None && !mipmaps && !cpuConversionEnabled(targetFormat) &&
+                         m_swizzleSupport != SwizzleSupport_Rejected && (shaderReady || textureSwizzleProbed()) &&
+                         textureSwizzleSupported(gl) && textureSwizzle(conversionShader, hasAlphaChannel, swizzleMask);
+
+    // Swizzle and premultiply while copying into the buffer where requested,
+    // which spares us the FBO and render pass of the conversion shader.
+    // Also done while the shader is still being built or failed to build, rather than waiting for it.
+    unsigned int pixelConversion = PixelConversion_None;
+    if (conversionShader != ColorShader_None && !swizzle && (cpuConversionEnabled(targetFormat) || !shaderReady)) {
+        const unsigned int conversion = cpuConversion(conversionShader, numChannels, hasAlphaChannel);
+        if (conversion != PixelConversion_Invalid) {
+            pixelConversion = conversion;
+            conversionShader = ColorShader_None;
+            format = HAL_PIXEL_FORMAT_RGBA_8888;
+            numChannels = 4;
+        }
+    }
+
+    // EGLImage textures only have a single level, mipmaps are generated from the FBO a shader renders into.
+    // The passthrough shader serves as a plain copy for images that need no conversion.
+    if (mipmaps) {
+        if (!mipmapsSupported(gl, imageSize, maxTextureSize))
+            return nullptr;
+        if (conversionShader == ColorShader_None)
+            conversionShader = ColorShader_Passthrough;
+    }
+
     GrallocTexture* texture = nullptr;
 
     {
         std::shared_ptr<ShaderBundle> shaderBundle {nullptr};
-        if (cachedShaders.find(conversionShader) != cachedShaders.end())
-            shaderBundle = cachedShaders[conversionShader];
+        const auto cached = cachedShaders.find(conversionShader);
+        if (cached != cachedShaders.end())
+            shaderBundle = cached->second;
 
         // Fall back to Qt-based uploading of textures in case no shaders are available
-        if (conversionShader != ColorShader_None && !shaderBundle)
+        if (conversionShader != ColorShader_None && !shaderBundle && !swizzle)
             return nullptr;
 
         try {
-            const bool threadPoolCongested = m_threadPool->activeThreadCount() >= m_threadPool->maxThreadCount();
-            texture = new GrallocTexture(this, hasAlphaChannel, shaderBundle, eglImageFunctions, (async && !threadPoolCongested), gl);
+            const bool nonBlocking = async && m_nonBlocking;
+            texture = new GrallocTexture(this, hasAlphaChannel, shaderBundle, eglImageFunctions, async, mipmaps, nonBlocking, gl);
+            texture->m_framebufferPool = m_framebufferPool;
+            texture->m_bufferPool = m_bufferPool;
+            texture->m_conversionBatch = m_conversionBatch;
+            texture->m_stateTracker = m_stateTracker;
+            if (swizzle) {
+                memcpy(texture->m_swizzleMask, swizzleMask, sizeof(swizzleMask));
+                texture->m_swizzle = true;
+            }
+            if (texture->rendersWithShader())
+                m_conversionBatch->schedule(texture);
 
             if (m_debug) {
-                qInfo() << QThread::currentThread() << "Texture created" << texture << "async & not congested:" << (async && !threadPoolCongested)
-                         << "image:" << image << "with alpha channel:" << hasAlphaChannel << "shader" << conversionShader;
+                qInfo() << QThread::currentThread() << "Texture created" << texture << "async:" << async
+                         << "image:" << imageSize << imageFormat << "encoded:" << (encoded != nullptr) << "with alpha channel:" << hasAlphaChannel << "shader" << conversionShader
+                         << "CPU conversion" << pixelConversion << "swizzle:" << swizzle << "mipmaps:" << mipmaps;
             }
 
             if (texture) {
-                QSize size = image.size();
-                float scaleFactor = 1.0;
-                if (size.width() > maxTextureSize)
-                    scaleFactor = (float)maxTextureSize / (float)size.width();
-                if (size.height() > maxTextureSize)
-                    scaleFactor = (float)maxTextureSize / (float)size.height();
-
-                size = QSize(size.width() * scaleFactor, size.height() * scaleFactor);
                 texture->provideSizeInfo(size);
 
-                // Mediate texture uploads from the concurrent thread through the creator up to the GrallocTexture
-                // as a means to only guarantee access to valid, undeleted QSG/GrallocTextures
-                QObject::connect(this, &GrallocTextureCreator::uploadComplete, texture, &GrallocTexture::createdEglImage, Qt::DirectConnection);
+                UploadRecipe recipe;
+                recipe.targetFormat = targetFormat;
+                recipe.halFormat = format;
+                recipe.numChannels = numChannels;
+                recipe.pixelConversion = pixelConversion;
+                recipe.lookup = lookup;
+                recipe.alpha = hasAlphaChannel;
+                recipe.imageSize = imageSize;
+                recipe.textureSize = size;
+                recipe.scaleFactor = scaleFactor;
+                texture->m_recipe = recipe;
+
+                // Identical images uploaded earlier on share their buffer, skipping the upload entirely.
+                // Encoded images have no pixels to recognize them by before decoding, they are never shared.
+                const UploadParameters parameters { size.width(), size.height(), format, pixelConversion, hasAlphaChannel };
+                int cachedTextureSize = 0;
+                std::shared_ptr<GrallocBuffer> cached = encoded ? nullptr : m_textureCache->findImage(image.cacheKey(), parameters, cachedTextureSize);
+                if (cached) {
+                    texture->m_completion->complete(cached, cachedTextureSize);
+                    return texture;
+                }
+
+                // The upload job only ever talks to the completion it is handed, which outlives the texture if need be.
+                // Queued jobs complete a completion of their own, which the scheduler passes on to all textures
+                // waiting for the same upload.
+                std::shared_ptr<UploadCompletion> completion = texture->m_completion;
+                if (nonBlocking)
+                    completion->setFinishedCallback(&GrallocTextureCreator::scheduleRepaint);
 
-                //auto uploadFunc = [ this, image, texture, numChannels, format, size, scaleFactor ]() {
-                auto uploadFunc = [=]() {
-                    const QImage toUpload = (size != image.size()) ? image.transformed(QTransform::fromScale(scaleFactor, scaleFactor)) : image;
-                    const uint32_t usage = convertUsage();
-                    struct graphic_buffer* handle = graphic_buffer_new_sized(toUpload.width(), toUpload.height(), format, usage);
-                    if (!handle) {
-                        qWarning() << "No buffer allocated";
-                        signalUploadComplete(texture, handle, 0);
+                // Encoded images needing neither scaling nor conversion on the CPU are decoded right into the buffer
+                const bool decodeInPlace = encoded && size == imageSize && targetFormat == imageFormat &&
+                                           !lookup && pixelConversion == PixelConversion_None;
+
+                auto uploadFunc = [=](UploadCompletion* result) {
+                    if (encoded) {
+                        uploadEncoded(result, *encoded, recipe, decodeInPlace);
                         return;
                     }
 
-                    const int stride = graphic_buffer_get_stride(handle);
-                    const int lockUsage = convertLockUsage();
-                    const int bytesPerLine = toUpload.bytesPerLine();
-                    const int grallocBytesPerLine = stride * numChannels;
-                    const int copyBytesPerLine = qMin(bytesPerLine, grallocBytesPerLine);  
-                    const int textureSize = (bytesPerLine != grallocBytesPerLine) ?
-                        copyBytesPerLine * toUpload.height() :
-                        toUpload.sizeInBytes();
-
-                    void* vmemAddr = nullptr;
-                    graphic_buffer_lock(handle, lockUsage, &vmemAddr);
-
-                    if (vmemAddr) {
-                        if (bytesPerLine == grallocBytesPerLine) {
-                            const uchar* src = toUpload.constBits();
-                            memcpy(vmemAddr, (const void*)src, textureSize);
-                        } else {
-                            for (int i = 0; i < toUpload.height(); i++) {
-                                void* dst = (vmemAddr + (grallocBytesPerLine * i));
-                                const void* src = toUpload.constScanLine(i);
-                                memcpy(dst, src, copyBytesPerLine);
-                            }
+                    quint64 contentHash = 0;
+                    if (m_textureCache->hashesContents()) {
+                        contentHash = TextureCache::hashContents(image);
+
+                        int duplicateTextureSize = 0;
+                        std::shared_ptr<GrallocBuffer> duplicate = m_textureCache->findContents(image.cacheKey(), contentHash, parameters, duplicateTextureSize);
+                        if (duplicate) {
+                            finishUpload(result, duplicate, duplicateTextureSize);
+                            return;
                         }
                     }
 
-                    graphic_buffer_unlock(handle);
-                    signalUploadComplete(texture, handle, textureSize);
+                    const QImage toUpload = prepareImage(image, recipe);
+
+                    const BufferDescriptor descriptor { recipe.textureSize.width(), recipe.textureSize.height(), format, convertUsage() };
+                    std::shared_ptr<GrallocBuffer> buffer = m_bufferPool->acquire(descriptor);
+                    if (!buffer) {
+                        qWarning() << "No buffer allocated";
+                        result->fail();
+                        return;
+                    }
+
+                    const int textureSize = writePixels(buffer.get(), toUpload, recipe, 0, recipe.textureSize.height());
+                    if (textureSize < 0) {
+                        qWarning() << "Failed to lock buffer";
+                        result->fail();
+                        return;
+                    }
+
+                    finishUpload(result, buffer, textureSize);
+
+                    if (buffer->image != EGL_NO_IMAGE_KHR)
+                        m_textureCache->insert(image.cacheKey(), contentHash, parameters, buffer, textureSize);
                 };
 
-                if (async && !threadPoolCongested) {
-                    QtConcurrent::run(m_threadPool, std::move(uploadFunc));
-                } else {
-                    uploadFunc();
-                }
+                QMetaObject::invokeMethod(m_trimTimer, "start", Qt::QueuedConnection);
+
+                // A full queue means the uploader threads are far behind, upload on this thread then
+                const UploadScheduler::Key key { encoded ? 0 : (quint64)image.cacheKey(), parameters };
+                if (!async || !m_scheduler->submit(key, uploadPriority(imageSize, size), completion, uploadFunc))
+                    uploadFunc(completion.get());
             }
         } catch (const std::exception& ex) {
             texture = nullptr;
@@ -291,23 +629,389 @@ GrallocTexture* GrallocTextureCreator::createTexture(const QImage& image, Shader
     return texture;
 }
 
+bool GrallocTextureCreator::mipmapsSupported(QOpenGLContext* gl, const QSize& size, const int maxTextureSize)
+{
+    if (!gl)
+        return false;
+
+    // OpenGL ES 2 without GL_OES_texture_npot can only mipmap power of two sizes
+    if (gl->functions()->hasOpenGLFeature(QOpenGLFunctions::NPOTTextures))
+        return true;
+
+    // Oversized images get downscaled to sizes that are hardly ever a power of two
+    const auto isPowerOfTwo = [](const int value) { return value > 0 && (value & (value - 1)) == 0; };
+    return size.width() <= maxTextureSize && size.height() <= maxTextureSize &&
+           isPowerOfTwo(size.width()) && isPowerOfTwo(size.height());
+}
+
+QImage GrallocTextureCreator::prepareImage(const QImage& image, const UploadRecipe& recipe)
+{
+    QImage toUpload = (image.format() != recipe.targetFormat) ? image.convertToFormat(recipe.targetFormat) : image;
+
+    // Downscaling mostly happens while writing into the buffer, only formats the resampler can't handle are scaled here
+    if (recipe.textureSize != image.size() && !Resampler::supportsBytesPerPixel(toUpload.depth() / 8))
+        toUpload = toUpload.scaled(recipe.textureSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    if (toUpload.format() != recipe.targetFormat)
+        toUpload = toUpload.convertToFormat(recipe.targetFormat);
+    return toUpload;
+}
+
+UploadedImage::UploadedImage(const QImage& image) :
+    m_image(image), m_size(image.size()), m_format(image.format())
+{
+}
+
+QImage UploadedImage::image() const
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        if (!m_buffer)
+            return m_image;
+    }
+
+    return readBack();
+}
+
+QSize UploadedImage::size() const
+{
+    return m_size;
+}
+
+int UploadedImage::byteCount() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_buffer ? (int)m_buffer->byteCount : (int)m_image.sizeInBytes();
+}
+
+bool UploadedImage::isUploaded() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_buffer != nullptr;
+}
+
+void UploadedImage::adopt(std::shared_ptr<GrallocBufferPool> pool, std::shared_ptr<GrallocBuffer> buffer, const UploadRecipe& recipe)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_buffer || !pool || !buffer)
+        return;
+
+    // Buffers are allocated for the GPU to read, not every gralloc lets the CPU do so as well
+    BufferAllocator* allocator = pool->allocator();
+    void* vmemAddr = allocator->lock(buffer->handle, GRALLOC_USAGE_SW_READ_RARELY | GRALLOC_USAGE_SW_WRITE_NEVER);
+    allocator->unlock(buffer->handle);
+    if (!vmemAddr)
+        return;
+
+    m_pool = pool;
+    m_buffer = buffer;
+    m_recipe = recipe;
+    m_image = QImage();
+}
+
+QImage UploadedImage::readBack() const
+{
+    // Converted pixels are RGBA in memory order, everything else is laid out as the format uploaded
+    const unsigned int conversion = m_recipe.pixelConversion;
+    QImage::Format format = m_recipe.targetFormat;
+    if (m_recipe.lookup || conversion != PixelConversion_None) {
+        const bool premultiplied = m_recipe.lookup || (conversion & PixelConversion_Premultiply) ||
+            QImage::toPixelFormat(m_recipe.targetFormat).premultiplied() == QPixelFormat::Premultiplied;
+        if (!m_recipe.alpha || (conversion & PixelConversion_ForceOpaque))
+            format = QImage::Format_RGBX8888;
+        else
+            format = premultiplied ? QImage::Format_RGBA8888_Premultiplied : QImage::Format_RGBA8888;
+    }
+
+    BufferAllocator* allocator = m_pool->allocator();
+    void* vmemAddr = allocator->lock(m_buffer->handle, GRALLOC_USAGE_SW_READ_RARELY | GRALLOC_USAGE_SW_WRITE_NEVER);
+    if (!vmemAddr) {
+        allocator->unlock(m_buffer->handle);
+        qWarning() << "Failed to lock buffer for reading";
+        return QImage();
+    }
+
+    const int bytesPerLine = m_buffer->stride * m_recipe.numChannels;
+    QImage image = QImage(static_cast<const uchar*>(vmemAddr), m_size.width(), m_size.height(), bytesPerLine, format).copy();
+    allocator->unlock(m_buffer->handle);
+
+    // Palette images can't be restored, those stay 32 bit
+    if (image.format() != m_format && m_format != QImage::Format_Indexed8 &&
+            m_format != QImage::Format_Mono && m_format != QImage::Format_MonoLSB)
+        image = image.convertToFormat(m_format);
+    return image;
+}
+
+int GrallocTextureCreator::writePixels(GrallocBuffer* buffer, const QImage& toUpload, const UploadRecipe& recipe,
+                                       const int firstRow, const int rowCount)
+{
+    const std::vector<uint32_t> lookupTable = recipe.lookup ? pixelLookupTable(toUpload, recipe.alpha) : std::vector<uint32_t>();
+
+    // Images still larger than the texture get resampled row by row straight into the buffer
+    std::unique_ptr<Resampler> resampler;
+    if (toUpload.size() != recipe.textureSize) {
+        const bool premultiplied = toUpload.pixelFormat().premultiplied() == QPixelFormat::Premultiplied;
+        resampler = std::make_unique<Resampler>(toUpload.width(), toUpload.height(),
+                                                recipe.textureSize.width(), recipe.textureSize.height(),
+                                                toUpload.depth() / 8, m_resampleFilter, premultiplied);
+    }
+
+    BufferAllocator* allocator = m_bufferPool->allocator();
+    const int stride = buffer->stride;
+    const int lockUsage = convertLockUsage();
+    const int numChannels = recipe.numChannels;
+    const unsigned int pixelConversion = recipe.pixelConversion;
+    const int width = recipe.textureSize.width();
+    const int bytesPerLine = resampler ? width * (toUpload.depth() / 8) : toUpload.bytesPerLine();
+    const int grallocBytesPerLine = stride * numChannels;
+    const bool expands = (pixelConversion != PixelConversion_None || recipe.lookup);
+    const int copyBytesPerLine = expands ?
+        width * numChannels :
+        qMin(bytesPerLine, grallocBytesPerLine);
+    const int textureSize = (expands || resampler || bytesPerLine != grallocBytesPerLine) ?
+        copyBytesPerLine * recipe.textureSize.height() :
+        toUpload.sizeInBytes();
+
+    // Writes one row of the texture, however it was produced
+    const auto writeRow = [&](uint8_t* dst, const uint8_t* src) {
+        if (recipe.lookup)
+            lookupPixels(dst, src, width, lookupTable.data());
+        else if (pixelConversion != PixelConversion_None)
+            convertPixels(dst, src, width, pixelConversion);
+        else
+            memcpy(dst, src, copyBytesPerLine);
+    };
+
+    // Recycled buffers and back buffers of dynamic textures might still be read by the GPU
+    awaitBufferRelease(buffer);
+
+    void* vmemAddr = allocator->lock(buffer->handle, lockUsage);
+
+    // Large images are split into bands of rows copied concurrently by otherwise idle uploader threads
+    if (vmemAddr) {
+        uint8_t* const dstBits = static_cast<uint8_t*>(vmemAddr) + (size_t)grallocBytesPerLine * firstRow;
+        // Resampled rows are worth every source row they are made of
+        const size_t bandBytesPerRow = resampler ?
+            (size_t)toUpload.bytesPerLine() * toUpload.height() / recipe.textureSize.height() :
+            (size_t)copyBytesPerLine;
+        forEachRowBand(m_threadPool, rowCount, bandBytesPerRow, [&](int bandRow, int bandRowCount) {
+            const int srcRow = firstRow + bandRow;
+            if (resampler) {
+                resampler->resampleRows(toUpload.constBits(), toUpload.bytesPerLine(), srcRow, bandRowCount,
+                                        [&](int row, const uint8_t* pixels) {
+                    writeRow(dstBits + (size_t)grallocBytesPerLine * (row - firstRow), pixels);
+                });
+            } else if (recipe.lookup) {
+                for (int i = 0; i < bandRowCount; i++) {
+                    uint8_t* dst = dstBits + (size_t)grallocBytesPerLine * (bandRow + i);
+                    lookupPixels(dst, toUpload.constScanLine(srcRow + i), toUpload.width(), lookupTable.data());
+                }
+            } else if (pixelConversion != PixelConversion_None) {
+                for (int i = 0; i < bandRowCount; i++) {
+                    uint8_t* dst = dstBits + (size_t)grallocBytesPerLine * (bandRow + i);
+                    convertPixels(dst, toUpload.constScanLine(srcRow + i), toUpload.width(), pixelConversion);
+                }
+            } else {
+                streamCopyPlane(dstBits + (size_t)grallocBytesPerLine * bandRow, grallocBytesPerLine,
+                                toUpload.constScanLine(srcRow), bytesPerLine,
+                                copyBytesPerLine, bandRowCount);
+            }
+        });
+    }
+
+    allocator->unlock(buffer->handle);
+    return vmemAddr ? textureSize : -1;
+}
+
+void GrallocTextureCreator::uploadEncoded(UploadCompletion* completion, const EncodedImage& encoded, const UploadRecipe& recipe,
+                                          const bool decodeInPlace)
+{
+    const BufferDescriptor descriptor { recipe.textureSize.width(), recipe.textureSize.height(), recipe.halFormat, convertUsage() };
+    std::shared_ptr<GrallocBuffer> buffer = m_bufferPool->acquire(descriptor);
+    if (!buffer) {
+        qWarning() << "No buffer allocated";
+        completion->fail();
+        return;
+    }
+
+    QImage decoded;
+    int textureSize = -1;
+    if (decodeInPlace)
+        textureSize = decodePixels(buffer.get(), encoded, recipe, decoded);
+    else
+        decoded = encoded.decode();
+
+    // Whatever didn't end up in the buffer right away is copied over like any other image
+    if (textureSize < 0 && !decoded.isNull())
+        textureSize = writePixels(buffer.get(), prepareImage(decoded, recipe), recipe, 0, recipe.textureSize.height());
+
+    if (textureSize < 0) {
+        qWarning() << "Failed to decode image into buffer";
+        completion->fail();
+        return;
+    }
+
+    finishUpload(completion, buffer, textureSize);
+}
+
+int GrallocTextureCreator::decodePixels(GrallocBuffer* buffer, const EncodedImage& encoded, const UploadRecipe& recipe, QImage& decoded)
+{
+    BufferAllocator* allocator = m_bufferPool->allocator();
+    const int grallocBytesPerLine = buffer->stride * recipe.numChannels;
+
+    awaitBufferRelease(buffer);
+
+    void* vmemAddr = allocator->lock(buffer->handle, convertLockUsage());
+    if (!vmemAddr) {
+        allocator->unlock(buffer->handle);
+        return -1;
+    }
+
+    // Image handlers fill an image of the size and format they decode to in place, any other they replace.
+    // Should the header have promised something else, the pixels come back in an image of their own.
+    QImage target(static_cast<uchar*>(vmemAddr), recipe.textureSize.width(), recipe.textureSize.height(),
+                  grallocBytesPerLine, recipe.targetFormat);
+    const bool decodedInto = encoded.decodeInto(&target);
+    const bool inPlace = decodedInto && target.constBits() == vmemAddr;
+    allocator->unlock(buffer->handle);
+
+    if (!inPlace) {
+        decoded = decodedInto ? target : QImage();
+        return -1;
+    }
+
+    return recipe.textureSize.width() * recipe.numChannels * recipe.textureSize.height();
+}
+
+std::shared_ptr<UploadCompletion> GrallocTextureCreator::submitUpdate(std::shared_ptr<GrallocBuffer> buffer, const QImage& image,
+                                                                     const UploadRecipe& recipe, const int firstRow, const int rowCount)
+{
+    std::shared_ptr<UploadCompletion> completion = std::make_shared<UploadCompletion>();
+    completion->setFinishedCallback(&GrallocTextureCreator::scheduleRepaint);
+
+    auto updateFunc = [=](UploadCompletion* result) {
+        const QImage toUpload = prepareImage(image, recipe);
+        std::shared_ptr<GrallocBuffer> target = buffer;
+        int first = firstRow;
+        int count = rowCount;
+
+        // A fresh buffer has none of the previous contents, so all of it gets written
+        if (!target) {
+            const BufferDescriptor descriptor { recipe.textureSize.width(), recipe.textureSize.height(), recipe.halFormat, convertUsage() };
+            target = m_bufferPool->acquire(descriptor);
+            first = 0;
+            count = recipe.textureSize.height();
+        }
+
+        if (!target) {
+            qWarning() << "No buffer allocated";
+            result->fail();
+            return;
+        }
+
+        const int textureSize = writePixels(target.get(), toUpload, recipe, first, count);
+        if (textureSize < 0) {
+            qWarning() << "Failed to lock buffer";
+            result->fail();
+            return;
+        }
+
+        finishUpload(result, target, textureSize);
+    };
+
+    // Updates are what the user is looking at right now, they go ahead of everything else
+    const UploadScheduler::Key key { 0, UploadParameters() };
+    if (!m_scheduler->submit(key, UploadScheduler::Priority_High, completion, updateFunc))
+        updateFunc(completion.get());
+
+    return completion;
+}
+
+UploadScheduler::Priority GrallocTextureCreator::uploadPriority(const QSize& imageSize, const QSize& textureSize)
+{
+    // Oversized images are expensive to scale down and small ones are cheap to get out of the way
+    if (imageSize != textureSize)
+        return UploadScheduler::Priority_Low;
+    if (imageSize.width() * imageSize.height() <= 256 * 256)
+        return UploadScheduler::Priority_High;
+    return UploadScheduler::Priority_Normal;
+}
+
+QSGTexture* GrallocTextureCreator::createAtlasTexture(const QImage& image, const int maxTextureSize, const bool alpha, const bool async, QOpenGLContext* gl)
+{
+    AtlasTexture* texture = m_atlasManager->create(image, alpha, maxTextureSize, async, gl);
+
+    if (m_debug && texture)
+        qInfo() << "Placed" << image.size() << "into atlas at" << texture->normalizedTextureSubRect();
+
+    return texture;
+}
+
+QSGTexture* GrallocTextureCreator::createTiledTexture(const QImage& image, const ShaderCache& cachedShaders, const int maxTextureSize, const uint flags, const bool async, QOpenGLContext* gl)
+{
+    GrallocTexture* overview = createTexture(image, cachedShaders, maxTextureSize, flags, async, gl);
+    if (!overview)
+        return nullptr;
+
+    TiledTexture* texture = new TiledTexture(this, overview, image, cachedShaders, maxTextureSize, flags, gl);
+
+    if (m_debug)
+        qInfo() << "Tiled" << image.size() << "into" << texture->tileCount() << "tiles";
+
+    return texture;
+}
+
+void GrallocTextureCreator::invalidate(QOpenGLContext* gl)
+{
+    m_atlasManager->invalidate(gl ? gl->functions() : nullptr);
+    m_conversionBatch->invalidate();
+    m_framebufferPool->clear();
+}
+
+void GrallocTextureCreator::flushConversions(QOpenGLContext* gl)
+{
+    m_conversionBatch->flush(gl);
+}
+
+void GrallocTextureCreator::frameRendered()
+{
+    m_conversionBatch->frameRendered();
+}
+
 GrallocTexture::GrallocTexture(GrallocTextureCreator* creator, const bool hasAlphaChannel, std::shared_ptr<ShaderBundle> conversionShader,
-                               EglImageFunctions eglImageFunctions, const bool async, QOpenGLContext* gl) :
-    QSGTexture(), m_image(EGL_NO_IMAGE_KHR), m_texture(0), m_textureSize(0),
+                               EglImageFunctions eglImageFunctions, const bool async, const bool mipmaps, const bool nonBlocking,
+                               QOpenGLContext* gl) :
+    QSGDynamicTexture(), m_image(EGL_NO_IMAGE_KHR), m_texture(0), m_textureSize(0),
     m_hasAlphaChannel(hasAlphaChannel), m_shaderCode(conversionShader), m_bound(false), m_valid(true),
-    m_rendered(false), m_async(async), m_eglImageFunctions(eglImageFunctions), m_creator(creator), m_gl(gl)
+    m_rendered(false), m_sourceReleased(false), m_swizzle(false), m_async(async), m_mipmaps(mipmaps), m_nonBlocking(nonBlocking), m_placeholder(false), m_bindOptionsApplied(false), m_completion(std::make_shared<UploadCompletion>()),
+    m_eglImageFunctions(eglImageFunctions), m_frontOwned(false), m_backInUse(false), m_updating(false), m_creator(creator), m_gl(gl)
 {
 }
 
-GrallocTexture::GrallocTexture() : m_valid(false)
+GrallocTexture::GrallocTexture() : m_valid(false), m_sourceReleased(false), m_swizzle(false), m_mipmaps(false), m_nonBlocking(false), m_placeholder(false), m_bindOptionsApplied(false),
+    m_frontOwned(false), m_backInUse(false), m_updating(false), m_creator(nullptr), m_gl(nullptr)
 {
 }
 
 GrallocTexture::~GrallocTexture()
 {
+    // Lets a queued upload skip its work, or drop its result should it already be running
+    if (m_completion)
+        m_completion->cancel();
+    if (m_updateCompletion)
+        m_updateCompletion->cancel();
+    if (m_conversionBatch)
+        m_conversionBatch->cancel(this);
+
+    // The last frame might still be sampling the buffer, its next user waits for that
+    if (m_buffer && m_conversionBatch)
+        markBufferReleased(m_buffer.get(), m_conversionBatch->frameFence());
+
     releaseResources();
 
+    // Hand the color target on to the next texture of the same size
     if (m_fbo) {
+        if (m_framebufferPool)
+            m_framebufferPool->release(std::move(m_fbo));
         m_fbo.reset(nullptr);
     }
 
@@ -336,23 +1040,28 @@ int GrallocTexture::textureId() const
         return 0;
     }
 
-    if (!m_shaderCode || !m_shaderCode->program) {
+    // Everything below restores the GL state it touches in one go
+    m_stateTracker->begin(m_gl);
+
+    if (!rendersWithShader()) {
         ensureBoundTexture(gl);
     } else {
         ensureFbo(gl);
     }
 
-    if (m_async) {
-        QMutexLocker locker(&m_uploadMutex);
-        would_wait = (m_image == EGL_NO_IMAGE_KHR);
-    }
+    if (m_async)
+        would_wait = uploadPending();
 
     // We can safely call ::drawTexture() again until successfully rendered.
     // Also should speed up getting texture contents rendered in case of a synchronous upload.
     if (!would_wait)
         drawTexture(gl);
+    else if (m_nonBlocking)
+        ensurePlaceholder(gl);
+
+    m_stateTracker->end();
 
-    if (!m_shaderCode || !m_shaderCode->program) {
+    if (!rendersWithShader()) {
         return m_texture;
     } else {
         return m_fbo->texture();
@@ -371,12 +1080,27 @@ bool GrallocTexture::hasAlphaChannel() const
 
 bool GrallocTexture::hasMipmaps() const
 {
-    return false;
+    return m_mipmaps;
 }
 
 int GrallocTexture::textureByteCount() const
 {
-    return m_textureSize;
+    int bytes = 0;
+
+    // Converted textures only keep their FBO around once the source buffer is released
+    if (!m_sourceReleased) {
+        if (m_completion && m_completion->status() == UploadCompletion::Completed)
+            bytes = m_completion->textureSize();
+        else
+            bytes = m_textureSize;
+    }
+
+    if (m_fbo) {
+        const int levelBytes = m_size.width() * m_size.height() * 4;
+        bytes += m_mipmaps ? levelBytes * 4 / 3 : levelBytes;
+    }
+
+    return bytes;
 }
 
 void GrallocTexture::provideSizeInfo(const QSize& size)
@@ -384,25 +1108,6 @@ void GrallocTexture::provideSizeInfo(const QSize& size)
     m_size = size;
 }
 
-void GrallocTexture::createdEglImage(const GrallocTexture* texture, EGLImageKHR image, const int textureSize)
-{
-    // GrallocTextureCreator "broadcasts" EGLImage readyness to every GrallocTexture it is currently uploading pixels for.
-    // Just make sure this slot call is actually meant for us and disconnect when done.
-    if (texture != this)
-        return;
-
-    QObject::disconnect(m_creator, &GrallocTextureCreator::uploadComplete, this, &GrallocTexture::createdEglImage);
-
-    qDebug() << QThread::currentThread() << "EGLImage created";
-
-    {
-        QMutexLocker locker(&m_uploadMutex);
-        m_textureSize = textureSize;
-        m_image = image;
-        m_uploadCondition.wakeOne();
-    }
-}
-
 void GrallocTexture::ensureBoundTexture(QOpenGLFunctions* gl) const
 {
     if (m_texture == 0) {
@@ -415,186 +1120,205 @@ bool GrallocTexture::dumpImageOnly(QOpenGLFunctions* gl) const
     if (m_rendered)
         return false;
 
-    const auto state = storeGlState(gl);
+    m_stateTracker->begin(m_gl);
 
     ensureBoundTexture(gl);
-    gl->glBindTexture(GL_TEXTURE_2D, m_texture);
+    m_stateTracker->bindTexture(m_texture);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     m_eglImageFunctions.glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, m_image);
 
-    restoreGlState(gl, state);
+    if (m_swizzle && !applySwizzle(gl)) {
+        // Rejected for EGLImage textures, the conversion shader takes over from here on
+        m_stateTracker->end();
+        m_swizzle = false;
+        return renderTexture(gl);
+    }
+
+    m_stateTracker->end();
 
     m_rendered = true;
     return true;
 }
 
+bool GrallocTexture::applySwizzle(QOpenGLFunctions* gl) const
+{
+    // Only the first swizzled texture checks for errors, which means draining whatever errors came before
+    const bool probing = m_creator && !m_creator->textureSwizzleProbed();
+    if (probing) {
+        for (int i = 0; i < 16 && gl->glGetError() != GL_NO_ERROR; i++) {}
+    }
+
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_R, m_swizzleMask[0]);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_G, m_swizzleMask[1]);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_B, m_swizzleMask[2]);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_A, m_swizzleMask[3]);
+
+    if (!probing)
+        return true;
+
+    const bool accepted = gl->glGetError() == GL_NO_ERROR;
+    m_creator->setTextureSwizzleAccepted(accepted);
+    return accepted;
+}
+
+bool GrallocTexture::rendersWithShader() const
+{
+    return m_shaderCode && m_shaderCode->program && !m_swizzle;
+}
+
 void GrallocTexture::ensureFbo(QOpenGLFunctions* gl) const
 {
     if (m_fbo)
         return;
 
-    const auto state = storeGlState(gl);
-    m_fbo = std::make_unique<QOpenGLFramebufferObject>(m_size);
-    restoreGlState(gl, state);
+    // Qt binds the new framebuffer and its texture while setting them up
+    m_stateTracker->begin(m_gl);
+    m_stateTracker->invalidate(GLStateTracker::FramebufferBinding | GLStateTracker::TextureBinding);
+    createFbo();
+    m_stateTracker->end();
 }
 
-const GLState GrallocTexture::storeGlState(QOpenGLFunctions* gl) const
+void GrallocTexture::createFbo() const
 {
-    // Could be called at arbitrary points in time with various OpenGL states,
-    // better store and reset them after we're done with OpenGL calls.
-    GLState state;
-
-    gl->glGetIntegerv(GL_TEXTURE_BINDING_2D, &state.prevTexture);
+    if (m_fbo)
+        return;
 
-    // That's enough for the bind-only usecase
-    if (!m_shaderCode || !m_shaderCode->program) {
-        return state;
+    if (m_framebufferPool) {
+        m_fbo = m_framebufferPool->acquire(m_size, m_mipmaps);
+    } else {
+        QOpenGLFramebufferObjectFormat format;
+        format.setMipmap(m_mipmaps);
+        m_fbo = std::make_unique<QOpenGLFramebufferObject>(m_size, format);
     }
+}
 
-    // For the render-to-texture usecase, store a few more details
-    gl->glGetIntegerv(GL_FRAMEBUFFER_BINDING, &state.prevFbo);
-    gl->glGetIntegerv(GL_ACTIVE_TEXTURE, &state.prevActiveTexture);
-    gl->glGetIntegerv(GL_CURRENT_PROGRAM, &state.prevProgram);
-    gl->glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &state.prevArrayBuf);
-    gl->glGetIntegerv(GL_ELEMENT_ARRAY_BUFFER_BINDING, &state.prevElementArrayBuf);
-    gl->glGetIntegerv(GL_VIEWPORT, state.prevViewport);
-    gl->glGetIntegerv(GL_SCISSOR_BOX, state.prevScissor);
-    gl->glGetIntegerv(GL_COLOR_CLEAR_VALUE, state.prevColorClear);
+void GrallocTexture::ensurePlaceholder(QOpenGLFunctions* gl) const
+{
+    if (m_placeholder || m_rendered)
+        return;
 
-    qDebug() << "prevFbo:" << state.prevFbo << "prevTexture:" << state.prevTexture << "prevActiveTexture:" << state.prevActiveTexture
-             << "prevProgram:" << state.prevProgram << "prevArrayBuf:" << state.prevArrayBuf << "prevElementArrayBuf:" << state.prevElementArrayBuf;
+    // Same texture the contents end up in later, so the texture id stays the same for the renderer
+    m_stateTracker->begin(m_gl);
 
-    return state;
-}
+    if (!rendersWithShader()) {
+        static const uint8_t transparent[4] = { 0, 0, 0, 0 };
+        ensureBoundTexture(gl);
+        m_stateTracker->bindTexture(m_texture);
+        gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, transparent);
+    } else {
+        ensureFbo(gl);
+        if (!m_fbo || !m_fbo->isValid()) {
+            m_stateTracker->end();
+            return;
+        }
 
-void GrallocTexture::restoreGlState(QOpenGLFunctions* gl, const GLState& state) const
-{
-    // Reset OpenGL state that we messed with
+        m_stateTracker->bindFramebuffer(m_fbo->handle());
+        m_stateTracker->setViewport(0, 0, m_size.width(), m_size.height());
+        m_stateTracker->setScissor(0, 0, m_size.width(), m_size.height());
+        m_stateTracker->setClearColor(0.0, 0.0, 0.0, 0.0);
+        gl->glClear(GL_COLOR_BUFFER_BIT);
 
-    // That's enough for the bind-only usecase
-    if (!m_shaderCode || !m_shaderCode->program) {
-        gl->glBindTexture(GL_TEXTURE_2D, state.prevTexture);
-        return;
+        if (m_mipmaps) {
+            m_stateTracker->bindTexture(m_fbo->texture());
+            gl->glGenerateMipmap(GL_TEXTURE_2D);
+        }
     }
 
-    gl->glBindFramebuffer(GL_FRAMEBUFFER, state.prevFbo);
-    gl->glClearColor(state.prevColorClear[0], state.prevColorClear[1], state.prevColorClear[2], state.prevColorClear[3]);
-    gl->glViewport(state.prevViewport[0], state.prevViewport[1], state.prevViewport[2], state.prevViewport[3]);
-    gl->glScissor(state.prevScissor[0], state.prevScissor[1], state.prevScissor[2], state.prevScissor[3]);
-    gl->glActiveTexture(state.prevActiveTexture);
-    gl->glBindTexture(GL_TEXTURE_2D, state.prevTexture);
-    gl->glUseProgram(state.prevProgram);
-    gl->glBindBuffer(GL_ARRAY_BUFFER, state.prevArrayBuf);
-    gl->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, state.prevElementArrayBuf);
+    m_stateTracker->end();
+    m_placeholder = true;
 }
 
 void GrallocTexture::renderWithShader(QOpenGLFunctions* gl) const
 {
-    const auto& size = m_size;
-    const auto width = size.width();
-    const auto height = size.height();
-    const int textureUnit = 1;
-    GLuint tmpTexture = 0;
-
-    static const GLfloat vertex_buffer_data[] = {
-        -1,-1, 0,
-        -1, 1, 0,
-         1,-1, 0,
-        -1, 1, 0,
-         1,-1, 0,
-         1, 1, 0
-    };
+    Q_UNUSED(gl);
 
-    static const GLfloat texture_buffer_data[] = {
-        0, 0,
-        0, 1,
-        1, 0,
-        0, 1,
-        1, 0,
-        1, 1
-    };
+    // Usually converted along with the other textures of the frame before rendering starts,
+    // this is for textures needed before that.
+    if (m_conversionBatch) {
+        m_conversionBatch->convert(m_gl, { this });
+    } else {
+        ConversionBatch batch(m_stateTracker);
+        batch.convert(m_gl, { this });
+    }
+}
+
+bool GrallocTexture::prepareConversion() const
+{
+    if (m_rendered || !rendersWithShader())
+        return false;
 
-    const GLState state = storeGlState(gl);
+    if (m_async && uploadPending())
+        awaitUpload();
+    adoptUpload();
+
+    return m_image != EGL_NO_IMAGE_KHR;
+}
+
+void GrallocTexture::renderConversion(QOpenGLFunctions* gl, const GLuint sourceTexture) const
+{
+    const auto width = m_size.width();
+    const auto height = m_size.height();
+
+    // Part of a batch, which has set up the program, geometry and source texture unit and restores state afterwards.
+    // Qt binds a new framebuffer and its texture while setting them up.
+    if (!m_fbo) {
+        m_stateTracker->invalidate(GLStateTracker::FramebufferBinding | GLStateTracker::TextureBinding);
+        createFbo();
+        m_stateTracker->bindTexture(sourceTexture);
+    }
 
-    ensureFbo(gl);
+    m_rendered = true;
     if (!m_fbo || !m_fbo->isValid()) {
         qWarning() << "Failed to set up FBO";
-        restoreGlState(gl, state);
         return;
     }
 
-    m_fbo->bind();
-    gl->glViewport(0, 0, width, height);
-    gl->glScissor(0, 0, width, height);
+    m_stateTracker->bindFramebuffer(m_fbo->handle());
+    m_stateTracker->setViewport(0, 0, width, height);
+    m_stateTracker->setScissor(0, 0, width, height);
 
-#if 1
     const GLenum attachments[2] = { GL_DEPTH_ATTACHMENT, GL_STENCIL_ATTACHMENT };
     m_gl->extraFunctions()->glInvalidateFramebuffer(GL_FRAMEBUFFER, 2, attachments);
-#endif
 
-    gl->glClearColor(0.0, 0.0, 0.0, m_hasAlphaChannel ? 0.0 : 1.0);
+    m_stateTracker->setClearColor(0.0, 0.0, 0.0, m_hasAlphaChannel ? 0.0 : 1.0);
     gl->glClear(GL_COLOR_BUFFER_BIT);
 
-    // Now apply the shader
-    QOpenGLVertexArrayObject vao;
-    QOpenGLBuffer vertexBuffer;
-    QOpenGLBuffer textureBuffer;
-
-    vao.create();
-    vao.bind();
-
-    vertexBuffer.create();
-    vertexBuffer.bind();
-    vertexBuffer.setUsagePattern(QOpenGLBuffer::StaticDraw);
-    vertexBuffer.allocate(vertex_buffer_data, 18 * sizeof(GLfloat));
-    m_shaderCode->program->enableAttributeArray(m_shaderCode->vertexCoord);
-    m_shaderCode->program->setAttributeBuffer(m_shaderCode->vertexCoord, GL_FLOAT, 0, 3, 0);
-    vertexBuffer.release();
-
-    textureBuffer.create();
-    textureBuffer.bind();
-    textureBuffer.setUsagePattern(QOpenGLBuffer::StaticDraw);
-    textureBuffer.allocate(texture_buffer_data, 12 * sizeof(GLfloat));
-    m_shaderCode->program->enableAttributeArray(m_shaderCode->textureCoord);
-    m_shaderCode->program->setAttributeBuffer(m_shaderCode->textureCoord, GL_FLOAT, 0, 2, 0);
-    textureBuffer.release();
-
-    // Make use of the swizzle shader or otherwise color-changing OpenGL program
-    m_shaderCode->program->bind();
-
-    // Generate and bind the temporary texture to the shader's sampler
-    gl->glGenTextures(1, &tmpTexture);
-    gl->glActiveTexture(GL_TEXTURE0 + textureUnit);
-    gl->glBindTexture(GL_TEXTURE_2D, tmpTexture);
-    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     m_eglImageFunctions.glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, m_image);
-
-    m_shaderCode->program->setUniformValue(m_shaderCode->texture, textureUnit);
     m_shaderCode->program->setUniformValue(m_shaderCode->alpha, m_hasAlphaChannel);
 
-    // Render the temporary texture through the shader into the color attachment
+    // Render the source image through the shader into the color attachment
     gl->glDrawArrays(GL_TRIANGLES, 0, 6);
-    gl->glFlush();
 
-    // We're done, reset the use of the shader
-    vao.release();
-    vertexBuffer.destroy();
-    textureBuffer.destroy();
-    vao.destroy();
-    m_shaderCode->program->release();
+    // Derive the remaining levels on the GPU, the CPU side only ever touched level 0
+    if (m_mipmaps) {
+        m_stateTracker->bindTexture(m_fbo->texture());
+        gl->glGenerateMipmap(GL_TEXTURE_2D);
+        m_stateTracker->bindTexture(sourceTexture);
+    }
+}
 
-    // Release the FBO and clean up
-    m_fbo->release();
+std::shared_ptr<GrallocBuffer> GrallocTexture::releaseSource() const
+{
+    if (!m_rendered || !m_fbo || !m_fbo->isValid() || !m_buffer)
+        return nullptr;
 
-    gl->glDeleteTextures(1, &tmpTexture);
+    // Textures receiving content updates keep both of their buffers, so that updates only need to write the rows that changed
+    if (m_frontOwned)
+        return nullptr;
 
-    restoreGlState(gl, state);
+    std::shared_ptr<GrallocBuffer> source = m_buffer;
+    if (m_completion)
+        m_completion->releaseBuffer();
+    releaseResources();
+    m_sourceReleased = true;
+    return source;
 }
 
 bool GrallocTexture::renderTexture(QOpenGLFunctions* gl) const
@@ -615,20 +1339,23 @@ bool GrallocTexture::drawTexture(QOpenGLFunctions* gl) const
     // Usual preparations (waiting for EGLImage to arrive) in case we're certain
     // no actual rendering has happened yet.
     if (!m_rendered) {
-        if (m_async) {
-            QMutexLocker locker(&m_uploadMutex);
-            wait = (m_image == EGL_NO_IMAGE_KHR);
-        }
+        if (m_async)
+            wait = uploadPending();
 
         if (wait) {
             awaitUpload();
         }
+        adoptUpload();
     } else {
-        // No update to the texture supported, this is not a QSGDynamicTexture
+        // Nothing new to show, updateTexture() resets this once new contents got swapped in
         return false;
     }
 
-    if (!m_shaderCode || !m_shaderCode->program) {
+    // A failed upload leaves the texture empty, there's nothing to render from
+    if (m_image == EGL_NO_IMAGE_KHR)
+        return false;
+
+    if (!rendersWithShader()) {
         ret = dumpImageOnly(gl);
     } else {
         ret = renderTexture(gl);
@@ -648,36 +1375,205 @@ void GrallocTexture::bind()
         return;
     }
 
-    // Will block until EGLImage is received from the uploader machinery.
-    drawTexture(gl);
+    // Will block until EGLImage is received from the uploader machinery,
+    // unless placeholder contents are fine until a later frame.
+    // The texture binding is ours right after, no need to restore it.
+    m_stateTracker->begin(m_gl);
+    if (m_nonBlocking && uploadPending())
+        ensurePlaceholder(gl);
+    else
+        drawTexture(gl);
+    m_stateTracker->end(GLStateTracker::TextureBinding);
 
-    if (!m_shaderCode || !m_shaderCode->program) {
+    if (!rendersWithShader()) {
         gl->glBindTexture(GL_TEXTURE_2D, m_texture);
     } else {
-        gl->glBindTexture(GL_TEXTURE_2D, m_fbo->texture());
+        gl->glBindTexture(GL_TEXTURE_2D, m_fbo ? m_fbo->texture() : 0);
+    }
+
+    // Mipmapped textures are sampled with the node's mipmap filtering
+    if (m_mipmaps) {
+        updateBindOptions(!m_bindOptionsApplied);
+        m_bindOptionsApplied = true;
     }
 }
 
+bool GrallocTexture::keepUploadedImage(std::shared_ptr<UploadedImage> image)
+{
+    if (!m_valid || !image || m_recipe.textureSize != m_recipe.imageSize)
+        return false;
+
+    if (m_buffer)
+        image->adopt(m_bufferPool, m_buffer, m_recipe);
+    else
+        m_uploadedImage = image;
+    return true;
+}
+
+bool GrallocTexture::setImage(const QImage& image, const QRect& dirtyRect)
+{
+    if (!m_valid || !m_creator || image.isNull() || image.size() != m_recipe.imageSize)
+        return false;
+
+    const QRect imageRect(QPoint(0, 0), image.size());
+    QRect dirty = dirtyRect.isNull() ? imageRect : (dirtyRect & imageRect);
+    if (dirty.isEmpty())
+        return true;
+
+    // Only whole scanlines are copied. Downscaled images map their dirty rows onto the texture's rows,
+    // with enough margin for rounding and the reach of the resampling filter.
+    int top = dirty.top();
+    int bottom = dirty.bottom();
+    if (m_recipe.textureSize != m_recipe.imageSize) {
+        top = qMax(0, (int)(top * m_recipe.scaleFactor) - 3);
+        bottom = qMin(m_recipe.textureSize.height() - 1, (int)((bottom + 1) * m_recipe.scaleFactor) + 3);
+    }
+    const QRect rows(0, top, m_recipe.textureSize.width(), bottom - top + 1);
+
+    {
+        QMutexLocker locker(&m_updateMutex);
+        m_pendingImage = image;
+        m_pendingRows = m_pendingRows.isNull() ? rows : m_pendingRows.united(rows);
+
+        // The back buffer might still be sampled from the last frame, or an update is still being written.
+        // Either way updateTexture() picks up the pending contents later on.
+        if (m_backInUse || m_updating)
+            return true;
+    }
+
+    submitPendingUpdate();
+    return true;
+}
+
+void GrallocTexture::submitPendingUpdate()
+{
+    std::shared_ptr<GrallocBuffer> backBuffer;
+    QImage image;
+    QRect rows;
+
+    {
+        QMutexLocker locker(&m_updateMutex);
+        if (m_pendingImage.isNull() || m_backInUse || m_updating)
+            return;
+
+        // Besides the rows that changed, the back buffer lacks whatever changed with the previous update
+        image = m_pendingImage;
+        m_updateRows = m_pendingRows;
+        rows = m_backStaleRows.isNull() ? m_pendingRows : m_pendingRows.united(m_backStaleRows);
+        m_pendingImage = QImage();
+        m_pendingRows = QRect();
+        m_backStaleRows = QRect();
+
+        backBuffer = m_backBuffer;
+        m_backBuffer.reset();
+        m_updating = true;
+    }
+
+    std::shared_ptr<UploadCompletion> completion =
+        m_creator->submitUpdate(backBuffer, image, m_recipe, rows.top(), rows.height());
+
+    QMutexLocker locker(&m_updateMutex);
+    m_updateCompletion = completion;
+}
+
+bool GrallocTexture::updateTexture()
+{
+    std::shared_ptr<UploadCompletion> completion;
+
+    {
+        QMutexLocker locker(&m_updateMutex);
+
+        // A frame went by since the last swap, the GPU is done sampling the buffer that was replaced
+        m_backInUse = false;
+
+        if (m_updateCompletion && m_updateCompletion->status() != UploadCompletion::Pending) {
+            completion = m_updateCompletion;
+            m_updateCompletion.reset();
+            m_updating = false;
+        }
+    }
+
+    bool changed = false;
+    if (completion && completion->status() == UploadCompletion::Completed && completion->buffer()) {
+        // The buffer replaced is written to next, unless it was shared through the texture cache
+        std::shared_ptr<GrallocBuffer> previous = m_buffer;
+
+        if (m_completion && m_completion != completion)
+            m_completion->cancel();
+        m_completion = completion;
+        m_buffer = completion->buffer();
+        m_image = m_buffer->image;
+        m_textureSize = completion->textureSize();
+        m_rendered = false;
+        m_sourceReleased = false;
+
+        // The buffer replaced was sampled by the last frame at most. With that frame fenced off, the next update
+        // can start writing to it right away and waits for the GPU to let go of it first. Otherwise the next
+        // update has to wait for another frame to go by.
+        std::shared_ptr<GpuFence> released = m_conversionBatch ? m_conversionBatch->frameFence() : nullptr;
+        if (previous)
+            markBufferReleased(previous.get(), released);
+
+        QMutexLocker locker(&m_updateMutex);
+        m_backBuffer = m_frontOwned ? previous : nullptr;
+        m_backStaleRows = m_backBuffer ? m_updateRows : QRect();
+        m_frontOwned = true;
+        m_backInUse = !released;
+        changed = true;
+    } else if (completion) {
+        qWarning() << "Texture update failed";
+    }
+
+    // Shader-converted contents are redone along with the other conversions of the frame
+    if (changed && rendersWithShader() && m_conversionBatch)
+        m_conversionBatch->schedule(this);
+    else if (changed && m_gl && m_gl->functions())
+        drawTexture(m_gl->functions());
+
+    submitPendingUpdate();
+    return changed;
+}
+
+bool GrallocTexture::uploadPending() const
+{
+    return m_completion && m_completion->status() == UploadCompletion::Pending;
+}
+
 void GrallocTexture::awaitUpload() const
 {
-    if (!m_async)
+    if (!m_async || !m_completion)
         return;
 
     if (m_rendered)
         return;
 
-    QMutexLocker locker(&m_uploadMutex);
-    while (m_image == EGL_NO_IMAGE_KHR) {
-        m_uploadCondition.wait(&m_uploadMutex);
+    // Rather than waiting behind other jobs, do the upload right here if no uploader thread got to it yet
+    UploadScheduler::shared()->runQueued(m_completion.get());
+
+    if (m_completion->wait() != UploadCompletion::Completed)
+        qWarning() << "Upload failed";
+    else
+        qDebug() << "Upload complete";
+}
+
+void GrallocTexture::adoptUpload() const
+{
+    if (m_buffer || !m_completion || m_completion->status() != UploadCompletion::Completed)
+        return;
+
+    m_buffer = m_completion->buffer();
+    m_image = m_buffer ? m_buffer->image : EGL_NO_IMAGE_KHR;
+    m_textureSize = m_completion->textureSize();
+
+    if (m_uploadedImage && m_buffer) {
+        m_uploadedImage->adopt(m_bufferPool, m_buffer, m_recipe);
+        m_uploadedImage.reset();
     }
-    qDebug() << "Upload complete";
 }
 
 void GrallocTexture::releaseResources() const
 {
-    if (m_image != EGL_NO_IMAGE_KHR) {
-        EGLDisplay dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
-        m_eglImageFunctions.eglDestroyImageKHR(dpy, m_image);
-        m_image = EGL_NO_IMAGE_KHR;
-    }
+    // Hand the buffer back to the pool, its EGLImage is kept alive along with it for the next user
+    m_image = EGL_NO_IMAGE_KHR;
+    m_buffer.reset();
 }
\ No newline at end of file
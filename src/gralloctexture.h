@@ -19,17 +19,21 @@
 
 #include <QObject>
 #include <QImage>
+#include <QRect>
 #include <QSize>
+#include <QSGDynamicTexture>
 #include <QSGTexture>
 #include <QMutex>
 #include <QThread>
 #include <QThreadPool>
+#include <QTimer>
 #include <QWaitCondition>
 
 #include <QOpenGLContext>
 #include <QOpenGLFunctions>
 #include <QOpenGLShaderProgram>
 #include <QOpenGLFramebufferObject>
+#include <QOpenGLFramebufferObjectFormat>
 #include <QOpenGLVertexArrayObject>
 #include <QOpenGLBuffer>
 #include <QOpenGLTexture>
@@ -42,13 +46,22 @@
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
 
-#include <hybris/ui/ui_compatibility_layer.h>
-#include <hybris/gralloc/gralloc.h>
-#include <hardware/gralloc.h>
-
 #undef Bool
 #undef None
 
+#include "atlas.h"
+#include "bufferpool.h"
+#include "conversionbatch.h"
+#include "encodedimage.h"
+#include "framebufferpool.h"
+#include "glstatetracker.h"
+#include "halformats.h"
+#include "pixelconversion.h"
+#include "resampler.h"
+#include "texturecache.h"
+#include "uploadcompletion.h"
+#include "uploadscheduler.h"
+
 enum ColorShader {
     ColorShader_None = 0,
     ColorShader_Passthrough,
@@ -63,6 +76,28 @@ enum ColorShader {
     ColorShader_Count = ColorShader_Last + 1
 };
 
+enum FormatStrategy {
+    FormatStrategy_Unsupported = 0,
+    // Pixels are copied as they are, a conversion shader fixes up the channel order where needed
+    FormatStrategy_Native,
+    // 8 bit pixels expanded to RGBA through a lookup table on the uploader thread
+    FormatStrategy_Lookup,
+    // Converted by Qt into the upload format on the uploader thread first
+    FormatStrategy_Convert
+};
+
+struct FormatDescriptor {
+    QImage::Format format;
+    const char* name;
+    FormatStrategy strategy;
+    QImage::Format uploadFormat;
+    int halFormat;
+    int halFormatWithAlpha;
+    int bytesPerPixel;
+    ColorShader shader;
+    ColorShader shaderWithAlpha;
+};
+
 struct ShaderBundle {
     ShaderBundle(std::shared_ptr<QOpenGLShaderProgram> program, int vertexCoord, int textureCoord, int textureSampler, int hasAlpha) :
         program(program), vertexCoord(vertexCoord), textureCoord(textureCoord), texture(textureSampler), alpha(hasAlpha) {}
@@ -75,23 +110,47 @@ struct ShaderBundle {
 
 typedef std::map<ColorShader, std::shared_ptr<ShaderBundle>> ShaderCache;
 
-struct EglImageFunctions {
-    EglImageFunctions();
-    PFNEGLCREATEIMAGEKHRPROC eglCreateImageKHR;
-    PFNEGLDESTROYIMAGEKHRPROC eglDestroyImageKHR;
-    PFNGLEGLIMAGETARGETTEXTURE2DOESPROC glEGLImageTargetTexture2DOES;
+// Everything needed to turn an image into the pixels of a texture's gralloc buffer once more
+struct UploadRecipe {
+    QImage::Format targetFormat = QImage::Format_Invalid;
+    int halFormat = -1;
+    int numChannels = 0;
+    unsigned int pixelConversion = 0;
+    bool lookup = false;
+    bool alpha = false;
+    QSize imageSize;
+    QSize textureSize;
+    float scaleFactor = 1.0;
 };
 
-struct GLState {
-    GLint prevProgram = 0;
-    GLint prevFbo = 0;
-    GLint prevTexture = 0;
-    GLint prevActiveTexture = 0;
-    GLint prevArrayBuf = 0;
-    GLint prevElementArrayBuf = 0;
-    GLint prevViewport[4];
-    GLint prevScissor[4];
-    GLint prevColorClear[4];
+// An image whose pixels move out of system memory once a texture uploaded them. From then on the
+// gralloc buffer is kept instead and read back from whenever the image is asked for again.
+class UploadedImage
+{
+public:
+    UploadedImage(const QImage& image);
+
+    // The source image while it is still around, the pixels read back from the buffer afterwards
+    QImage image() const;
+    QSize size() const;
+    // Bytes kept resident for the image, in system or graphics memory
+    int byteCount() const;
+    bool isUploaded() const;
+
+private:
+    // Takes over the uploaded buffer if the CPU can read it, letting go of the source image
+    void adopt(std::shared_ptr<GrallocBufferPool> pool, std::shared_ptr<GrallocBuffer> buffer, const UploadRecipe& recipe);
+    QImage readBack() const;
+
+    mutable QMutex m_mutex;
+    QImage m_image;
+    const QSize m_size;
+    const QImage::Format m_format;
+    std::shared_ptr<GrallocBufferPool> m_pool;
+    std::shared_ptr<GrallocBuffer> m_buffer;
+    UploadRecipe m_recipe;
+
+    friend class GrallocTexture;
 };
 
 class GrallocTexture;
@@ -101,23 +160,98 @@ class GrallocTextureCreator : public QObject
 public:
     GrallocTextureCreator(QObject* parent = nullptr);
 
-    GrallocTexture* createTexture(const QImage& image, ShaderCache& cachedShaders, const int maxTextureSize, const uint flags, const bool async, QOpenGLContext* gl);
-    static int convertFormat(const QImage& image, int& numChannels, ColorShader& conversionShader, const bool alpha);
+    GrallocTexture* createTexture(const QImage& image, const ShaderCache& cachedShaders, const int maxTextureSize, const uint flags, const bool async, QOpenGLContext* gl);
+    // Decodes the image on the uploader threads, straight into the gralloc buffer where its format allows
+    GrallocTexture* createEncodedTexture(std::shared_ptr<const EncodedImage> encoded, const ShaderCache& cachedShaders, const int maxTextureSize, const uint flags, const bool async, QOpenGLContext* gl);
+    QSGTexture* createAtlasTexture(const QImage& image, const int maxTextureSize, const bool alpha, const bool async, QOpenGLContext* gl);
+    // Oversized images, downscaled for the scene graph with their full resolution tiles uploaded on demand
+    QSGTexture* createTiledTexture(const QImage& image, const ShaderCache& cachedShaders, const int maxTextureSize, const uint flags, const bool async, QOpenGLContext* gl);
+    void invalidate(QOpenGLContext* gl);
+    // Runs the conversion passes queued up since the last frame, render thread only
+    void flushConversions(QOpenGLContext* gl);
+    // Fences off the frame just rendered, render thread only
+    void frameRendered();
+    static int convertFormat(const QImage::Format format, int& numChannels, ColorShader& conversionShader, const bool alpha);
+    static const FormatDescriptor& formatDescriptor(const QImage::Format format);
+    // Format the pixels of an image in the given format are handed to gralloc in
+    static QImage::Format uploadFormat(const QImage::Format format);
+    static unsigned int cpuConversion(const ColorShader conversionShader, const int numChannels, const bool alpha);
+    // Turns the pixels of a natively uploaded format into premultiplied RGBA in memory order, the way sampling
+    // its texture sees them. PixelConversion_Invalid for formats it can't express, like RGB16.
+    static unsigned int rgbaConversion(const QImage::Format format, const bool alpha);
+    // Destination pixels for every possible 8 bit source pixel of a lookup format
+    static std::vector<uint32_t> pixelLookupTable(const QImage& image, const bool alpha);
+    static bool mipmapsSupported(QOpenGLContext* gl, const QSize& size, const int maxTextureSize);
+    // Swizzle doing what a shader only reordering channels does, false for any other shader
+    static bool textureSwizzle(const ColorShader conversionShader, const bool alpha, GLint* mask);
+    static bool textureSwizzleSupported(QOpenGLContext* gl);
+    static UploadScheduler::Priority uploadPriority(const QSize& imageSize, const QSize& textureSize);
+
+    // Comma separated list of QImage format names (without "Format_"), "all" or "none"
+    void setCpuConversionFormats(const QByteArray& formats);
+    bool cpuConversionEnabled(const QImage::Format format) const;
+
+    // Let textures whose upload is still in flight bind transparent placeholder contents
+    // instead of blocking the render thread, with a repaint scheduled once the upload finished.
+    void setNonBlockingUploads(const bool nonBlocking);
+
+    // Filter oversized images are downscaled with while being written into their buffers
+    void setResampleFilter(const ResampleFilter filter);
+
+    // Let textures needing a pure channel reorder sample their EGLImage through the texture swizzle
+    // instead of rendering into an FBO. The first such texture finds out whether the driver accepts it.
+    void setTextureSwizzle(const bool enabled);
+    bool textureSwizzleProbed() const;
+    void setTextureSwizzleAccepted(const bool accepted);
+
+    // Writes the given rows of an image into a buffer of the recipe's size and format from the uploader
+    // threads, acquiring a buffer first if none is given. Completes with the buffer written to.
+    std::shared_ptr<UploadCompletion> submitUpdate(std::shared_ptr<GrallocBuffer> buffer, const QImage& image,
+                                                   const UploadRecipe& recipe, const int firstRow, const int rowCount);
 
-public Q_SLOTS:
-    void signalUploadComplete(const GrallocTexture* texture, struct graphic_buffer* handle, const int textureSize);
-
-Q_SIGNALS:
-    void uploadComplete(const GrallocTexture* texture, EGLImageKHR image, const int textureSize);
+private Q_SLOTS:
+    void trimBufferPool();
 
 private:
+    GrallocTexture* createTexture(const QImage& image, std::shared_ptr<const EncodedImage> encoded, const ShaderCache& cachedShaders,
+                                  const int maxTextureSize, const uint flags, const bool async, QOpenGLContext* gl);
+    void finishUpload(UploadCompletion* completion, std::shared_ptr<GrallocBuffer> buffer, const int textureSize);
+    void uploadEncoded(UploadCompletion* completion, const EncodedImage& encoded, const UploadRecipe& recipe, const bool decodeInPlace);
+    // Returns the number of bytes making up the texture, -1 if the pixels didn't end up in the buffer.
+    // Those decoded elsewhere after all are handed back through decoded.
+    int decodePixels(GrallocBuffer* buffer, const EncodedImage& encoded, const UploadRecipe& recipe, QImage& decoded);
+    static QImage prepareImage(const QImage& image, const UploadRecipe& recipe);
+    // Returns the number of bytes making up the texture, -1 if the buffer couldn't be locked
+    int writePixels(GrallocBuffer* buffer, const QImage& toUpload, const UploadRecipe& recipe,
+                    const int firstRow, const int rowCount);
+    static void scheduleRepaint();
+
     QThreadPool* m_threadPool;
+    std::shared_ptr<UploadScheduler> m_scheduler;
+    std::shared_ptr<GrallocBufferPool> m_bufferPool;
+    std::shared_ptr<TextureCache> m_textureCache;
+    std::shared_ptr<FramebufferPool> m_framebufferPool;
+    std::shared_ptr<GLStateTracker> m_stateTracker;
+    std::shared_ptr<ConversionBatch> m_conversionBatch;
+    std::unique_ptr<AtlasManager> m_atlasManager;
+    QTimer* m_trimTimer;
+    quint64 m_cpuConversionFormats;
+    bool m_nonBlocking;
+    ResampleFilter m_resampleFilter;
     bool m_debug;
+
+    enum SwizzleSupport {
+        SwizzleSupport_Unknown = 0,
+        SwizzleSupport_Accepted,
+        SwizzleSupport_Rejected
+    };
+    std::atomic<int> m_swizzleSupport;
+
     static constexpr uint32_t convertUsage();
     static constexpr uint32_t convertLockUsage();
 };
 
-class GrallocTexture : public QSGTexture
+class GrallocTexture : public QSGDynamicTexture
 {
     Q_OBJECT
 
@@ -129,12 +263,22 @@ public:
     virtual bool hasAlphaChannel() const override;
     virtual bool hasMipmaps() const override;
     virtual void bind() override;
+    virtual bool updateTexture() override;
 
     int textureByteCount() const;
 
+    // Replaces the texture's contents, copying only the scanlines touched by dirtyRect (all of them if it's null)
+    // into the buffer the GPU isn't sampling. The new contents show up with the next updateTexture() call.
+    // Returns false if the image doesn't fit this texture, which then needs replacing.
+    // Reachable through QMetaObject::invokeMethod() without linking against the plugin.
+    Q_INVOKABLE bool setImage(const QImage& image, const QRect& dirtyRect = QRect());
+
+    // Hands the buffer over to the image once the upload is done, so its source pixels can go. Returns false
+    // if the buffer won't hold the image as it is, as with downscaled images. Meant for textures never updated.
+    bool keepUploadedImage(std::shared_ptr<UploadedImage> image);
+
 public Q_SLOTS:
     void provideSizeInfo(const QSize& size);
-    void createdEglImage(const GrallocTexture* texture, EGLImageKHR image, const int textureSize);
 
 private Q_SLOTS:
     bool drawTexture(QOpenGLFunctions* gl) const;
@@ -143,20 +287,28 @@ private:
     GrallocTexture(GrallocTextureCreator* creator, const bool hasAlphaChannel,
                    std::shared_ptr<ShaderBundle> conversionShader,
                    EglImageFunctions eglImageFunctions, const bool async,
-                   QOpenGLContext* gl);
+                   const bool mipmaps, const bool nonBlocking, QOpenGLContext* gl);
     ~GrallocTexture();
 
     void ensureBoundTexture(QOpenGLFunctions* gl) const;
     void ensureFbo(QOpenGLFunctions* gl) const;
+    void createFbo() const;
+    void ensurePlaceholder(QOpenGLFunctions* gl) const;
 	
     void renderWithShader(QOpenGLFunctions* gl) const;
+    bool prepareConversion() const;
+    void renderConversion(QOpenGLFunctions* gl, const GLuint sourceTexture) const;
+    // Lets go of the source buffer once its contents live on in the FBO, returning it for the GPU to finish with
+    std::shared_ptr<GrallocBuffer> releaseSource() const;
     bool dumpImageOnly(QOpenGLFunctions* gl) const;
     bool renderTexture(QOpenGLFunctions* gl) const;
+    bool rendersWithShader() const;
+    bool applySwizzle(QOpenGLFunctions* gl) const;
 
+    bool uploadPending() const;
     void awaitUpload() const;
-
-    const GLState storeGlState(QOpenGLFunctions* gl) const;
-    void restoreGlState(QOpenGLFunctions* gl, const GLState& state) const;
+    void adoptUpload() const;
+    void submitPendingUpdate();
 
     void releaseResources() const;
 
@@ -164,7 +316,11 @@ private:
     std::shared_ptr<ShaderBundle> m_shaderCode;
 
     mutable std::unique_ptr<QOpenGLFramebufferObject> m_fbo;
+    std::shared_ptr<FramebufferPool> m_framebufferPool;
+    std::shared_ptr<ConversionBatch> m_conversionBatch;
+    std::shared_ptr<GLStateTracker> m_stateTracker;
 
+    mutable std::shared_ptr<GrallocBuffer> m_buffer;
     mutable EGLImageKHR m_image;
     mutable int m_textureSize;
     mutable QSize m_size;
@@ -172,17 +328,42 @@ private:
     mutable bool m_bound;
     mutable bool m_valid;
     mutable bool m_rendered;
+    mutable bool m_sourceReleased;
 
-    mutable QWaitCondition m_uploadCondition;
-    mutable QMutex m_uploadMutex;
+    // Channel reorder applied when sampling the EGLImage, in place of the conversion shader
+    GLint m_swizzleMask[4];
+    mutable bool m_swizzle;
+
+    std::shared_ptr<UploadCompletion> m_completion;
+    std::shared_ptr<GrallocBufferPool> m_bufferPool;
+    mutable std::shared_ptr<UploadedImage> m_uploadedImage;
 
     bool m_async;
+    bool m_mipmaps;
+    bool m_nonBlocking;
+    mutable bool m_placeholder;
+    bool m_bindOptionsApplied;
 
     EglImageFunctions m_eglImageFunctions;
 
+    // Content updates, written into a back buffer and swapped in on the render thread
+    UploadRecipe m_recipe;
+    QMutex m_updateMutex;
+    std::shared_ptr<GrallocBuffer> m_backBuffer;
+    std::shared_ptr<UploadCompletion> m_updateCompletion;
+    QImage m_pendingImage;
+    QRect m_pendingRows;
+    QRect m_updateRows;
+    QRect m_backStaleRows;
+    bool m_frontOwned;
+    bool m_backInUse;
+    bool m_updating;
+
     GrallocTextureCreator* m_creator;
     QOpenGLContext* m_gl;
     friend class GrallocTextureCreator;
+    friend class ConversionBatch;
+    friend class TiledTexture;
 };
 
 #endif
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HALFORMATS_H
+#define HALFORMATS_H
+
+// HAL pixel formats and gralloc usage flags buffers are described with. Builds without libhybris
+// don't have Android's headers, the values are part of the HAL ABI and the same everywhere.
+#ifdef HALIUMQSG_HYBRIS
+#include <hardware/gralloc.h>
+#else
+enum {
+    HAL_PIXEL_FORMAT_RGBA_8888 = 1,
+    HAL_PIXEL_FORMAT_RGBX_8888 = 2,
+    HAL_PIXEL_FORMAT_RGB_888 = 3,
+    HAL_PIXEL_FORMAT_RGB_565 = 4,
+    HAL_PIXEL_FORMAT_BGRA_8888 = 5
+};
+
+enum {
+    GRALLOC_USAGE_SW_READ_NEVER = 0x00000000,
+    GRALLOC_USAGE_SW_READ_RARELY = 0x00000002,
+    GRALLOC_USAGE_SW_READ_OFTEN = 0x00000003,
+    GRALLOC_USAGE_SW_READ_MASK = 0x0000000F,
+    GRALLOC_USAGE_SW_WRITE_NEVER = 0x00000000,
+    GRALLOC_USAGE_SW_WRITE_RARELY = 0x00000020,
+    GRALLOC_USAGE_SW_WRITE_OFTEN = 0x00000030,
+    GRALLOC_USAGE_SW_WRITE_MASK = 0x000000F0,
+    GRALLOC_USAGE_HW_TEXTURE = 0x00000100
+};
+#endif
+
+#endif
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hybrisbufferallocator.h"
+
+#include <hybris/common/dlfcn.h>
+#include <hybris/ui/ui_compatibility_layer.h>
+#include <hybris/gralloc/gralloc.h>
+#include <hardware/gralloc.h>
+
+HybrisBufferAllocator::HybrisBufferAllocator()
+{
+}
+
+bool HybrisBufferAllocator::isAvailable() const
+{
+    // Check whether the prerequisite library can be dlopened
+#ifdef __LP64__
+    const char* ldpath = "/system/lib64/libui_compat_layer.so";
+#else
+    const char* ldpath = "/system/lib/libui_compat_layer.so";
+#endif
+    void* handle = hybris_dlopen(ldpath, RTLD_LAZY);
+    if (!handle)
+        return false;
+
+    hybris_dlclose(handle);
+    return true;
+}
+
+void* HybrisBufferAllocator::allocate(const BufferDescriptor& descriptor, int& stride)
+{
+    struct graphic_buffer* handle = graphic_buffer_new_sized(descriptor.width, descriptor.height,
+                                                             descriptor.format, descriptor.usage);
+    stride = handle ? graphic_buffer_get_stride(handle) : 0;
+    return handle;
+}
+
+void HybrisBufferAllocator::free(void* handle)
+{
+    if (handle)
+        graphic_buffer_free(static_cast<struct graphic_buffer*>(handle));
+}
+
+void* HybrisBufferAllocator::lock(void* handle, uint32_t lockUsage)
+{
+    void* vmemAddr = nullptr;
+    graphic_buffer_lock(static_cast<struct graphic_buffer*>(handle), lockUsage, &vmemAddr);
+    return vmemAddr;
+}
+
+void HybrisBufferAllocator::unlock(void* handle)
+{
+    graphic_buffer_unlock(static_cast<struct graphic_buffer*>(handle));
+}
+
+// After the pixels have arrived at GPU memory, turn them into an EGLImage for easy consumption from within GL.
+EGLImageKHR HybrisBufferAllocator::createImage(void* handle)
+{
+    const EGLDisplay dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    const EGLContext context = EGL_NO_CONTEXT;
+    static const EGLint attrs[] = { EGL_IMAGE_PRESERVED_KHR, EGL_TRUE, EGL_NONE };
+
+    void* native_buffer = graphic_buffer_get_native_buffer(static_cast<struct graphic_buffer*>(handle));
+    return m_eglImageFunctions.eglCreateImageKHR(dpy, context, EGL_NATIVE_BUFFER_ANDROID, native_buffer, attrs);
+}
+
+void HybrisBufferAllocator::destroyImage(EGLImageKHR image)
+{
+    if (image == EGL_NO_IMAGE_KHR)
+        return;
+
+    const EGLDisplay dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    m_eglImageFunctions.eglDestroyImageKHR(dpy, image);
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HYBRISBUFFERALLOCATOR_H
+#define HYBRISBUFFERALLOCATOR_H
+
+#include "bufferallocator.h"
+
+// Android's gralloc through libhybris, for Halium devices
+class HybrisBufferAllocator : public BufferAllocator
+{
+public:
+    HybrisBufferAllocator();
+
+    bool isAvailable() const override;
+
+    void* allocate(const BufferDescriptor& descriptor, int& stride) override;
+    void free(void* handle) override;
+
+    void* lock(void* handle, uint32_t lockUsage) override;
+    void unlock(void* handle) override;
+
+    EGLImageKHR createImage(void* handle) override;
+    void destroyImage(EGLImageKHR image) override;
+
+private:
+    EglImageFunctions m_eglImageFunctions;
+};
+
+#endif
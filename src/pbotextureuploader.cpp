@@ -0,0 +1,447 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pbotextureuploader.h"
+#include "streamcopy.h"
+
+#include <QDebug>
+#include <QGuiApplication>
+#include <QMutexLocker>
+#include <QOpenGLExtraFunctions>
+#include <QOpenGLFunctions>
+
+#include <QtQuick/private/qsgcontext_p.h>
+
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#endif
+#ifndef GL_STREAM_DRAW
+#define GL_STREAM_DRAW 0x88E0
+#endif
+#ifndef GL_MAP_WRITE_BIT
+#define GL_MAP_WRITE_BIT 0x0002
+#endif
+#ifndef GL_MAP_INVALIDATE_BUFFER_BIT
+#define GL_MAP_INVALIDATE_BUFFER_BIT 0x0008
+#endif
+
+// Qt's atlas takes images up to half its 512 pixel pages by default, it's the better place for those
+static const int atlasSizeLimit = 256;
+
+PboUpload::PboUpload() : m_status(Pending), m_texture(0)
+{
+}
+
+bool PboUpload::complete(const GLuint texture, std::shared_ptr<GpuFence> fence)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_status == Cancelled)
+        return false;
+
+    m_texture = texture;
+    m_fence = fence;
+    m_status = texture ? Completed : Failed;
+    m_condition.wakeAll();
+    return true;
+}
+
+void PboUpload::fail()
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_status == Pending)
+        m_status = Failed;
+    m_condition.wakeAll();
+}
+
+bool PboUpload::isCancelled() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_status == Cancelled;
+}
+
+void PboUpload::cancel()
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_status == Pending)
+        m_status = Cancelled;
+}
+
+PboUpload::Status PboUpload::wait() const
+{
+    QMutexLocker locker(&m_mutex);
+    while (m_status == Pending)
+        m_condition.wait(&m_mutex);
+    return m_status;
+}
+
+GLuint PboUpload::texture() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_texture;
+}
+
+std::shared_ptr<GpuFence> PboUpload::fence() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_fence;
+}
+
+PboTexture::PboTexture(PboTextureUploader* uploader, std::shared_ptr<PboUpload> upload, const QSize& size, const bool hasAlphaChannel) :
+    m_uploader(uploader), m_upload(upload), m_size(size), m_hasAlphaChannel(hasAlphaChannel),
+    m_texture(0), m_fenceWaited(false), m_bindOptionsApplied(false)
+{
+}
+
+PboTexture::~PboTexture()
+{
+    // A pending upload deletes its texture itself once it sees the cancellation
+    m_upload->cancel();
+    const GLuint texture = m_upload->texture();
+    if (!texture)
+        return;
+
+    QOpenGLContext* current = QOpenGLContext::currentContext();
+    if (current && m_uploader->m_gl && QOpenGLContext::areSharing(current, m_uploader->m_gl))
+        current->functions()->glDeleteTextures(1, &texture);
+    else
+        m_uploader->releaseTexture(texture);
+}
+
+GLuint PboTexture::awaitUpload() const
+{
+    if (m_texture || m_upload->wait() != PboUpload::Completed)
+        return m_texture;
+
+    // The upload context flushed its commands, the render thread's context waits for them on the GPU
+    if (!m_fenceWaited) {
+        std::shared_ptr<GpuFence> fence = m_upload->fence();
+        if (fence)
+            fence->serverWait();
+        m_fenceWaited = true;
+    }
+
+    m_texture = m_upload->texture();
+    return m_texture;
+}
+
+int PboTexture::textureId() const
+{
+    return awaitUpload();
+}
+
+QSize PboTexture::textureSize() const
+{
+    return m_size;
+}
+
+bool PboTexture::hasAlphaChannel() const
+{
+    return m_hasAlphaChannel;
+}
+
+bool PboTexture::hasMipmaps() const
+{
+    return false;
+}
+
+void PboTexture::bind()
+{
+    QOpenGLFunctions* gl = QOpenGLContext::currentContext()->functions();
+    gl->glBindTexture(GL_TEXTURE_2D, awaitUpload());
+    updateBindOptions(!m_bindOptionsApplied);
+    m_bindOptionsApplied = true;
+}
+
+class PboUploadThread : public QThread
+{
+public:
+    explicit PboUploadThread(PboTextureUploader* uploader) : m_uploader(uploader)
+    {
+        setObjectName(QStringLiteral("QsgPboUploads"));
+    }
+
+protected:
+    void run() override
+    {
+        m_uploader->uploadLoop();
+    }
+
+private:
+    PboTextureUploader* m_uploader;
+};
+
+PboTextureUploader::PboTextureUploader() :
+    m_renderThread(nullptr), m_gl(nullptr), m_maxTextureSize(0), m_pixelBuffers(false), m_pixelBuffer(0),
+    m_quit(false), m_active(false), m_failed(false)
+{
+    if (!qGuiApp || QThread::currentThread() != qGuiApp->thread())
+        return;
+
+    m_surface = std::make_unique<QOffscreenSurface>();
+    m_surface->setFormat(QSurfaceFormat::defaultFormat());
+    m_surface->create();
+    if (!m_surface->isValid())
+        m_surface.reset();
+}
+
+PboTextureUploader::~PboTextureUploader()
+{
+    stopUploading();
+}
+
+bool PboTextureUploader::initialize(QOpenGLContext* gl)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_gl == gl && m_active)
+            return true;
+        // Don't retry on every upload, the next attempt waits for invalidate()
+        if (m_failed)
+            return false;
+    }
+
+    invalidate();
+    if (!gl || !m_surface)
+        return false;
+
+    m_gl = gl;
+    m_renderThread = QThread::currentThread();
+    gl->functions()->glGetIntegerv(GL_MAX_TEXTURE_SIZE, &m_maxTextureSize);
+
+    // Pixel buffer objects came with OpenGL ES 3.0 and desktop OpenGL 2.1, mapping them with 3.0
+    const QPair<int, int> version = gl->format().version();
+    m_pixelBuffers = version >= qMakePair(3, 0);
+
+    m_uploadContext = std::make_unique<QOpenGLContext>();
+    m_uploadContext->setFormat(gl->format());
+    m_uploadContext->setShareContext(gl);
+    if (!m_uploadContext->create() || !m_uploadContext->shareContext()) {
+        qWarning() << "Failed to create upload context, uploading on the render thread instead";
+        m_uploadContext.reset();
+        QMutexLocker locker(&m_mutex);
+        m_failed = true;
+        return false;
+    }
+
+    {
+        QMutexLocker locker(&m_mutex);
+        m_quit = false;
+        m_active = true;
+    }
+
+    m_thread = std::make_unique<PboUploadThread>(this);
+    m_uploadContext->moveToThread(m_thread.get());
+    m_thread->start();
+    return true;
+}
+
+void PboTextureUploader::stopUploading()
+{
+    if (!m_thread)
+        return;
+
+    {
+        QMutexLocker locker(&m_mutex);
+        m_quit = true;
+        m_active = false;
+        m_wakeup.wakeAll();
+    }
+
+    m_thread->wait();
+    m_thread.reset();
+    m_uploadContext.reset();
+}
+
+void PboTextureUploader::invalidate()
+{
+    stopUploading();
+
+    // Textures belong to the share group going away, jobs nobody picked up fail
+    QMutexLocker locker(&m_mutex);
+    for (const Job& job : m_jobs)
+        job.upload->fail();
+    m_jobs.clear();
+    m_releasedTextures.clear();
+    m_gl = nullptr;
+    m_failed = false;
+}
+
+bool PboTextureUploader::isActive() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_active;
+}
+
+QSGTexture* PboTextureUploader::createTexture(const QImage& image, const uint flags)
+{
+    if (image.isNull() || (flags & QSGRenderContext::CreateTexture_Mipmap))
+        return nullptr;
+    if ((flags & QSGRenderContext::CreateTexture_Atlas) && image.width() <= atlasSizeLimit && image.height() <= atlasSizeLimit)
+        return nullptr;
+
+    const bool alpha = image.hasAlphaChannel() && (flags & QSGRenderContext::CreateTexture_Alpha);
+    QSize size = image.size();
+    if (size.width() > m_maxTextureSize || size.height() > m_maxTextureSize)
+        size = size.scaled(qMin(size.width(), m_maxTextureSize), qMin(size.height(), m_maxTextureSize), Qt::KeepAspectRatio);
+
+    std::shared_ptr<PboUpload> upload = std::make_shared<PboUpload>();
+
+    {
+        QMutexLocker locker(&m_mutex);
+        if (!m_active)
+            return nullptr;
+
+        // Downscaling and format conversion happen on the upload thread as well
+        QImage::Format format = alpha ? QImage::Format_RGBA8888_Premultiplied : QImage::Format_RGBX8888;
+        m_jobs.push_back(Job { image, size, format, upload });
+        m_wakeup.wakeAll();
+    }
+
+    return new PboTexture(this, upload, size, alpha);
+}
+
+void PboTextureUploader::releaseTexture(const GLuint texture)
+{
+    QMutexLocker locker(&m_mutex);
+    if (!m_active)
+        return;
+
+    m_releasedTextures.push_back(texture);
+    m_wakeup.wakeAll();
+}
+
+void PboTextureUploader::uploadLoop()
+{
+    if (!m_uploadContext->makeCurrent(m_surface.get())) {
+        qWarning() << "Failed to make upload context current, uploading on the render thread instead";
+        QMutexLocker locker(&m_mutex);
+        m_active = false;
+        m_failed = true;
+        for (const Job& job : m_jobs)
+            job.upload->fail();
+        m_jobs.clear();
+        m_uploadContext->moveToThread(m_renderThread);
+        return;
+    }
+
+    QOpenGLFunctions* functions = m_uploadContext->functions();
+    if (m_pixelBuffers)
+        functions->glGenBuffers(1, &m_pixelBuffer);
+
+    while (true) {
+        Job job;
+        std::vector<GLuint> released;
+
+        {
+            QMutexLocker locker(&m_mutex);
+            while (!m_quit && m_jobs.empty() && m_releasedTextures.empty())
+                m_wakeup.wait(&m_mutex);
+            if (m_quit)
+                break;
+
+            released.swap(m_releasedTextures);
+            if (!m_jobs.empty()) {
+                job = m_jobs.front();
+                m_jobs.pop_front();
+            }
+        }
+
+        if (!released.empty())
+            functions->glDeleteTextures((GLsizei)released.size(), released.data());
+
+        if (!job.upload || job.upload->isCancelled())
+            continue;
+
+        const GLuint texture = upload(job);
+
+        // The render thread's context may only sample the texture once the GPU got past the upload.
+        // With a fence the render thread waits for that on the GPU side, otherwise it's waited for here.
+        std::shared_ptr<GpuFence> fence = texture ? GpuFence::create() : nullptr;
+        if (fence)
+            functions->glFlush();
+        else
+            functions->glFinish();
+
+        if (!job.upload->complete(texture, fence) && texture)
+            functions->glDeleteTextures(1, &texture);
+    }
+
+    if (m_pixelBuffer) {
+        functions->glDeleteBuffers(1, &m_pixelBuffer);
+        m_pixelBuffer = 0;
+    }
+
+    // Hand the context back for it to be destroyed on the thread that owns the uploader
+    m_uploadContext->doneCurrent();
+    m_uploadContext->moveToThread(m_renderThread);
+}
+
+GLuint PboTextureUploader::upload(const Job& job)
+{
+    QOpenGLFunctions* functions = m_uploadContext->functions();
+
+    // GL_RGBA in unsigned bytes is the one format every OpenGL version takes
+    QImage image = job.image;
+    if (image.size() != job.size)
+        image = image.scaled(job.size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    if (image.format() != job.format)
+        image = image.convertToFormat(job.format);
+
+    GLuint texture = 0;
+    functions->glGenTextures(1, &texture);
+    functions->glBindTexture(GL_TEXTURE_2D, texture);
+    functions->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    functions->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    functions->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    functions->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    functions->glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    // Rows of 4 byte pixels are tightly packed, the whole image is one copy into the pixel buffer
+    bool uploaded = false;
+    if (m_pixelBuffer) {
+        QOpenGLExtraFunctions* extra = m_uploadContext->extraFunctions();
+        const GLsizeiptr bytes = (GLsizeiptr)image.sizeInBytes();
+
+        // Orphaning the previous storage lets the driver carry on with the last upload in the meantime
+        extra->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pixelBuffer);
+        extra->glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+        void* mapped = extra->glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if (mapped) {
+            streamCopy(static_cast<uint8_t*>(mapped), image.constBits(), (size_t)bytes);
+            uploaded = extra->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            if (uploaded) {
+                functions->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image.width(), image.height(), 0,
+                                        GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+            }
+        }
+        extra->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    if (!uploaded) {
+        functions->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image.width(), image.height(), 0,
+                                GL_RGBA, GL_UNSIGNED_BYTE, image.constBits());
+    }
+
+    functions->glBindTexture(GL_TEXTURE_2D, 0);
+
+    if (functions->glGetError() != GL_NO_ERROR) {
+        qWarning() << "Failed to upload texture of size" << image.size();
+        functions->glDeleteTextures(1, &texture);
+        return 0;
+    }
+
+    return texture;
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PBOTEXTUREUPLOADER_H
+#define PBOTEXTUREUPLOADER_H
+
+#include <QImage>
+#include <QMutex>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QSGTexture>
+#include <QThread>
+#include <QWaitCondition>
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "gpufence.h"
+
+// Outcome of one upload done on the uploader's context, shared between the texture and the upload thread
+class PboUpload
+{
+public:
+    enum Status {
+        Pending = 0,
+        Completed,
+        Failed,
+        Cancelled
+    };
+
+    PboUpload();
+
+    // Upload thread side. Returns false for a cancelled upload, whose texture is the caller's to delete then.
+    bool complete(const GLuint texture, std::shared_ptr<GpuFence> fence);
+    void fail();
+    bool isCancelled() const;
+
+    // Texture side
+    void cancel();
+    Status wait() const;
+    GLuint texture() const;
+    std::shared_ptr<GpuFence> fence() const;
+
+private:
+    mutable QMutex m_mutex;
+    mutable QWaitCondition m_condition;
+    Status m_status;
+    GLuint m_texture;
+    std::shared_ptr<GpuFence> m_fence;
+};
+
+class PboTextureUploader;
+
+class PboTexture : public QSGTexture
+{
+    Q_OBJECT
+
+public:
+    ~PboTexture();
+
+    int textureId() const override;
+    QSize textureSize() const override;
+    bool hasAlphaChannel() const override;
+    bool hasMipmaps() const override;
+    void bind() override;
+
+private:
+    PboTexture(PboTextureUploader* uploader, std::shared_ptr<PboUpload> upload, const QSize& size, const bool hasAlphaChannel);
+
+    // Waits for the upload thread, then has the GPU wait for the upload to land
+    GLuint awaitUpload() const;
+
+    PboTextureUploader* m_uploader;
+    std::shared_ptr<PboUpload> m_upload;
+    const QSize m_size;
+    const bool m_hasAlphaChannel;
+    mutable GLuint m_texture;
+    mutable bool m_fenceWaited;
+    bool m_bindOptionsApplied;
+
+    friend class PboTextureUploader;
+};
+
+// Uploads images through pixel buffer objects on a context of its own, sharing with the render thread's,
+// for when gralloc buffers aren't available. Textures are handed over to the render thread behind a fence.
+// Without PBOs (OpenGL ES 2) the upload thread still takes the glTexImage2D() off the render thread.
+class PboTextureUploader
+{
+public:
+    // GUI thread, offscreen surfaces can't be created elsewhere on all platforms
+    PboTextureUploader();
+    ~PboTextureUploader();
+
+    // Render thread, with the context the textures are used in current. Returns false if uploads can't be done,
+    // a failure sticks until invalidate().
+    bool initialize(QOpenGLContext* gl);
+    void invalidate();
+    bool isActive() const;
+
+    // Null for images Qt is better off with, like small ones going into its atlas
+    QSGTexture* createTexture(const QImage& image, const uint flags);
+
+private:
+    struct Job {
+        QImage image;
+        QSize size;
+        QImage::Format format = QImage::Format_Invalid;
+        std::shared_ptr<PboUpload> upload;
+    };
+
+    void uploadLoop();
+    GLuint upload(const Job& job);
+    void stopUploading();
+    // Textures going away without the render thread's context current are deleted by the upload thread
+    void releaseTexture(const GLuint texture);
+
+    std::unique_ptr<QOffscreenSurface> m_surface;
+    std::unique_ptr<QOpenGLContext> m_uploadContext;
+    std::unique_ptr<QThread> m_thread;
+    QThread* m_renderThread;
+    QOpenGLContext* m_gl;
+    int m_maxTextureSize;
+    bool m_pixelBuffers;
+    GLuint m_pixelBuffer;
+
+    mutable QMutex m_mutex;
+    QWaitCondition m_wakeup;
+    std::deque<Job> m_jobs;
+    std::vector<GLuint> m_releasedTextures;
+    bool m_quit;
+    bool m_active;
+    bool m_failed;
+
+    friend class PboUploadThread;
+    friend class PboTexture;
+};
+
+#endif
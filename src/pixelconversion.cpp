@@ -0,0 +1,385 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pixelconversion.h"
+
+#include <cstring>
+#include <utility>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HALIUMQSG_X86_KERNELS 1
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(__aarch64__)
+#include <arm_neon.h>
+#define HALIUMQSG_NEON_KERNELS 1
+#endif
+
+typedef void (*ConvertRowFunction)(uint8_t* dst, const uint8_t* src, const int count);
+
+// Every kernel family is instantiated for each combination of the PixelConversion flags,
+// indexed by the flags' value.
+#define CONVERSION_KERNELS(kernel) { \
+    kernel<false, false, false, false>, kernel<true, false, false, false>, \
+    kernel<false, true, false, false>, kernel<true, true, false, false>, \
+    kernel<false, false, true, false>, kernel<true, false, true, false>, \
+    kernel<false, true, true, false>, kernel<true, true, true, false>, \
+    kernel<false, false, false, true>, kernel<true, false, false, true>, \
+    kernel<false, true, false, true>, kernel<true, true, false, true>, \
+    kernel<false, false, true, true>, kernel<true, false, true, true>, \
+    kernel<false, true, true, true>, kernel<true, true, true, true> }
+
+static inline unsigned int normalizedConversion(unsigned int conversion)
+{
+    // Opaque pixels don't need premultiplication, and expanded RGB888 pixels are always opaque
+    if (conversion & PixelConversion_ExpandRGB888)
+        conversion |= PixelConversion_ForceOpaque;
+    if (conversion & PixelConversion_ForceOpaque)
+        conversion &= ~PixelConversion_Premultiply;
+    return conversion & (PixelConversion_Invalid - 1);
+}
+
+static inline uint8_t premultiplyChannel(const uint32_t channel, const uint32_t alpha)
+{
+    // Same rounding as qPremultiply()
+    const uint32_t t = channel * alpha;
+    return (t + (t >> 8) + 0x80) >> 8;
+}
+
+template <bool swap, bool opaque, bool premultiply, bool expand>
+static void convertRowScalar(uint8_t* dst, const uint8_t* src, const int count)
+{
+    const int srcBytesPerPixel = expand ? 3 : 4;
+
+    for (int i = 0; i < count; i++, src += srcBytesPerPixel, dst += 4) {
+        uint8_t c0 = src[0];
+        uint8_t c1 = src[1];
+        uint8_t c2 = src[2];
+        uint8_t a = (expand || opaque) ? 0xff : src[3];
+
+        if (swap)
+            std::swap(c0, c2);
+
+        if (premultiply) {
+            c0 = premultiplyChannel(c0, a);
+            c1 = premultiplyChannel(c1, a);
+            c2 = premultiplyChannel(c2, a);
+        }
+
+        dst[0] = c0;
+        dst[1] = c1;
+        dst[2] = c2;
+        dst[3] = a;
+    }
+}
+
+#ifdef HALIUMQSG_X86_KERNELS
+
+template <bool swap, bool opaque, bool premultiply>
+TARGET_SSE2 static inline __m128i convertPixelsSse2(__m128i px)
+{
+    if (swap) {
+        const __m128i ag = _mm_and_si128(px, _mm_set1_epi32((int)0xff00ff00));
+        const __m128i rb = _mm_and_si128(px, _mm_set1_epi32(0x00ff00ff));
+        px = _mm_or_si128(ag, _mm_or_si128(_mm_srli_epi32(rb, 16), _mm_slli_epi32(rb, 16)));
+    }
+
+    if (opaque)
+        px = _mm_or_si128(px, _mm_set1_epi32((int)0xff000000));
+
+    if (premultiply) {
+        // Multiplying the alpha lane by 255 leaves it untouched with qPremultiply()'s rounding
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i colorLanes = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+        const __m128i alphaLanes = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+        const __m128i half = _mm_set1_epi16(0x80);
+
+        __m128i lo = _mm_unpacklo_epi8(px, zero);
+        __m128i hi = _mm_unpackhi_epi8(px, zero);
+        __m128i alphaLo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xff), 0xff);
+        __m128i alphaHi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xff), 0xff);
+        alphaLo = _mm_or_si128(_mm_and_si128(alphaLo, colorLanes), alphaLanes);
+        alphaHi = _mm_or_si128(_mm_and_si128(alphaHi, colorLanes), alphaLanes);
+
+        lo = _mm_mullo_epi16(lo, alphaLo);
+        hi = _mm_mullo_epi16(hi, alphaHi);
+        lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), half), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), half), 8);
+        px = _mm_packus_epi16(lo, hi);
+    }
+
+    return px;
+}
+
+template <bool swap, bool opaque, bool premultiply, bool expand>
+TARGET_SSE2 static void convertRowSse2(uint8_t* dst, const uint8_t* src, const int count)
+{
+    int i = 0;
+
+    if (!expand) {
+        for (; i + 4 <= count; i += 4) {
+            const __m128i px = _mm_loadu_si128((const __m128i*)(src + i * 4));
+            _mm_storeu_si128((__m128i*)(dst + i * 4), convertPixelsSse2<swap, opaque, premultiply>(px));
+        }
+    }
+
+    const int srcBytesPerPixel = expand ? 3 : 4;
+    convertRowScalar<swap, opaque, premultiply, expand>(dst + i * 4, src + i * srcBytesPerPixel, count - i);
+}
+
+template <bool swap, bool opaque, bool premultiply, bool expand>
+TARGET_SSSE3 static void convertRowSsse3(uint8_t* dst, const uint8_t* src, const int count)
+{
+    if (!expand) {
+        convertRowSse2<swap, opaque, premultiply, expand>(dst, src, count);
+        return;
+    }
+
+    const __m128i shuffle = swap ?
+        _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1) :
+        _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+
+    // Four pixels are consumed per iteration but sixteen bytes loaded, stop early enough not to read past the row
+    int i = 0;
+    for (; i + 6 <= count; i += 4) {
+        const __m128i px = _mm_loadu_si128((const __m128i*)(src + i * 3));
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(_mm_shuffle_epi8(px, shuffle), alpha));
+    }
+
+    convertRowScalar<swap, opaque, premultiply, expand>(dst + i * 4, src + i * 3, count - i);
+}
+
+template <bool swap, bool opaque, bool premultiply>
+TARGET_AVX2 static inline __m256i convertPixelsAvx2(__m256i px)
+{
+    if (swap) {
+        const __m256i ag = _mm256_and_si256(px, _mm256_set1_epi32((int)0xff00ff00));
+        const __m256i rb = _mm256_and_si256(px, _mm256_set1_epi32(0x00ff00ff));
+        px = _mm256_or_si256(ag, _mm256_or_si256(_mm256_srli_epi32(rb, 16), _mm256_slli_epi32(rb, 16)));
+    }
+
+    if (opaque)
+        px = _mm256_or_si256(px, _mm256_set1_epi32((int)0xff000000));
+
+    if (premultiply) {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i colorLanes = _mm256_set_epi16(0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1);
+        const __m256i alphaLanes = _mm256_set_epi16(255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0);
+        const __m256i half = _mm256_set1_epi16(0x80);
+
+        __m256i lo = _mm256_unpacklo_epi8(px, zero);
+        __m256i hi = _mm256_unpackhi_epi8(px, zero);
+        __m256i alphaLo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(lo, 0xff), 0xff);
+        __m256i alphaHi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(hi, 0xff), 0xff);
+        alphaLo = _mm256_or_si256(_mm256_and_si256(alphaLo, colorLanes), alphaLanes);
+        alphaHi = _mm256_or_si256(_mm256_and_si256(alphaHi, colorLanes), alphaLanes);
+
+        lo = _mm256_mullo_epi16(lo, alphaLo);
+        hi = _mm256_mullo_epi16(hi, alphaHi);
+        lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), half), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), half), 8);
+        px = _mm256_packus_epi16(lo, hi);
+    }
+
+    return px;
+}
+
+template <bool swap, bool opaque, bool premultiply, bool expand>
+TARGET_AVX2 static void convertRowAvx2(uint8_t* dst, const uint8_t* src, const int count)
+{
+    if (expand) {
+        convertRowSsse3<swap, opaque, premultiply, expand>(dst, src, count);
+        return;
+    }
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256i px = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), convertPixelsAvx2<swap, opaque, premultiply>(px));
+    }
+
+    convertRowSse2<swap, opaque, premultiply, expand>(dst + i * 4, src + i * 4, count - i);
+}
+
+#endif
+
+#ifdef HALIUMQSG_NEON_KERNELS
+
+static inline uint8x16_t premultiplyNeon(const uint8x16_t channel, const uint8x16_t alpha)
+{
+    // vraddhn computes (a + b + 0x80) >> 8, matching qPremultiply()'s rounding
+    const uint16x8_t lo = vmull_u8(vget_low_u8(channel), vget_low_u8(alpha));
+    const uint16x8_t hi = vmull_u8(vget_high_u8(channel), vget_high_u8(alpha));
+    return vcombine_u8(vraddhn_u16(lo, vshrq_n_u16(lo, 8)), vraddhn_u16(hi, vshrq_n_u16(hi, 8)));
+}
+
+template <bool swap, bool opaque, bool premultiply, bool expand>
+static void convertRowNeon(uint8_t* dst, const uint8_t* src, const int count)
+{
+    const int srcBytesPerPixel = expand ? 3 : 4;
+
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x4_t px;
+
+        if (expand) {
+            const uint8x16x3_t rgb = vld3q_u8(src + i * 3);
+            px.val[0] = rgb.val[0];
+            px.val[1] = rgb.val[1];
+            px.val[2] = rgb.val[2];
+            px.val[3] = vdupq_n_u8(0xff);
+        } else {
+            px = vld4q_u8(src + i * 4);
+        }
+
+        if (swap) {
+            const uint8x16_t tmp = px.val[0];
+            px.val[0] = px.val[2];
+            px.val[2] = tmp;
+        }
+
+        if (opaque)
+            px.val[3] = vdupq_n_u8(0xff);
+
+        if (premultiply) {
+            px.val[0] = premultiplyNeon(px.val[0], px.val[3]);
+            px.val[1] = premultiplyNeon(px.val[1], px.val[3]);
+            px.val[2] = premultiplyNeon(px.val[2], px.val[3]);
+        }
+
+        vst4q_u8(dst + i * 4, px);
+    }
+
+    convertRowScalar<swap, opaque, premultiply, expand>(dst + i * 4, src + i * srcBytesPerPixel, count - i);
+}
+
+#endif
+
+struct KernelTable {
+    ConvertRowFunction kernels[PixelConversion_Invalid];
+    const char* backend;
+};
+
+// Kernel families built for this architecture, best first
+static const char* const backendNames[] = {
+#if defined(HALIUMQSG_X86_KERNELS)
+    "avx2", "ssse3", "sse2",
+#elif defined(HALIUMQSG_NEON_KERNELS)
+    "neon",
+#endif
+    "scalar"
+};
+
+static const ConvertRowFunction* backendKernels(const char* backend)
+{
+    static const ConvertRowFunction scalarKernels[] = CONVERSION_KERNELS(convertRowScalar);
+    if (strcmp(backend, "scalar") == 0)
+        return scalarKernels;
+
+#if defined(HALIUMQSG_X86_KERNELS)
+    static const ConvertRowFunction sse2Kernels[] = CONVERSION_KERNELS(convertRowSse2);
+    static const ConvertRowFunction ssse3Kernels[] = CONVERSION_KERNELS(convertRowSsse3);
+    static const ConvertRowFunction avx2Kernels[] = CONVERSION_KERNELS(convertRowAvx2);
+
+    __builtin_cpu_init();
+    if (strcmp(backend, "avx2") == 0)
+        return __builtin_cpu_supports("avx2") ? avx2Kernels : nullptr;
+    if (strcmp(backend, "ssse3") == 0)
+        return __builtin_cpu_supports("ssse3") ? ssse3Kernels : nullptr;
+    if (strcmp(backend, "sse2") == 0)
+        return __builtin_cpu_supports("sse2") ? sse2Kernels : nullptr;
+#elif defined(HALIUMQSG_NEON_KERNELS)
+    static const ConvertRowFunction neonKernels[] = CONVERSION_KERNELS(convertRowNeon);
+    if (strcmp(backend, "neon") == 0)
+        return neonKernels;
+#endif
+
+    return nullptr;
+}
+
+static KernelTable buildKernelTable()
+{
+    KernelTable table;
+
+    for (const char* backend : backendNames) {
+        const ConvertRowFunction* kernels = backendKernels(backend);
+        if (kernels) {
+            memcpy(table.kernels, kernels, sizeof(table.kernels));
+            table.backend = backend;
+            break;
+        }
+    }
+    return table;
+}
+
+static const KernelTable& kernelTable()
+{
+    static const KernelTable table = buildKernelTable();
+    return table;
+}
+
+void convertPixels(uint8_t* dst, const uint8_t* src, const int count, const unsigned int conversion)
+{
+    const unsigned int normalized = normalizedConversion(conversion);
+    if (normalized == PixelConversion_None) {
+        if (dst != src)
+            memcpy(dst, src, count * 4);
+        return;
+    }
+
+    kernelTable().kernels[normalized](dst, src, count);
+}
+
+void convertPixelsScalar(uint8_t* dst, const uint8_t* src, const int count, const unsigned int conversion)
+{
+    backendKernels("scalar")[normalizedConversion(conversion)](dst, src, count);
+}
+
+bool convertPixelsWithBackend(const char* backend, uint8_t* dst, const uint8_t* src, const int count, const unsigned int conversion)
+{
+    const ConvertRowFunction* kernels = backendKernels(backend);
+    if (!kernels)
+        return false;
+
+    kernels[normalizedConversion(conversion)](dst, src, count);
+    return true;
+}
+
+void lookupPixels(uint8_t* dst, const uint8_t* src, const int count, const uint32_t* table)
+{
+    // A gather per pixel either way, let the compiler unroll it
+    for (int i = 0; i < count; i++, dst += 4) {
+        memcpy(dst, &table[src[i]], 4);
+    }
+}
+
+const char* pixelConversionBackend()
+{
+    return kernelTable().backend;
+}
+
+std::vector<const char*> pixelConversionBackends()
+{
+    std::vector<const char*> backends;
+    for (const char* backend : backendNames) {
+        if (backendKernels(backend))
+            backends.push_back(backend);
+    }
+    return backends;
+}
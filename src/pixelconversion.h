@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIXELCONVERSION_H
+#define PIXELCONVERSION_H
+
+#include <cstdint>
+#include <vector>
+
+// CPU counterparts of the color conversion shaders, applied while copying into gralloc memory.
+// Destination pixels are always 4 bytes wide, byte 3 being alpha.
+enum PixelConversion {
+    PixelConversion_None = 0x0,
+    PixelConversion_SwapRedBlue = 0x1,
+    PixelConversion_ForceOpaque = 0x2,
+    PixelConversion_Premultiply = 0x4,
+    PixelConversion_ExpandRGB888 = 0x8,
+
+    PixelConversion_Invalid = 0x10
+};
+
+// Converts a row of pixels. dst may equal src unless expanding 3 byte source pixels.
+void convertPixels(uint8_t* dst, const uint8_t* src, const int count, const unsigned int conversion);
+
+// Plain C++ implementation the SIMD kernels are measured and verified against
+void convertPixelsScalar(uint8_t* dst, const uint8_t* src, const int count, const unsigned int conversion);
+
+// Converts with the named backend's kernels regardless of the runtime selection.
+// Returns false if the backend isn't built for this architecture or the CPU lacks it.
+bool convertPixelsWithBackend(const char* backend, uint8_t* dst, const uint8_t* src, const int count, const unsigned int conversion);
+
+// Expands 8 bit indices through a 256 entry table of ready to use destination pixels, which covers
+// palette, grayscale and alpha-only images. Table entries hold the 4 destination bytes in memory order.
+void lookupPixels(uint8_t* dst, const uint8_t* src, const int count, const uint32_t* table);
+
+// Name of the instruction set the kernels were selected for at runtime
+const char* pixelConversionBackend();
+
+// All backends usable on this CPU, best first and ending with "scalar"
+std::vector<const char*> pixelConversionBackends();
+
+#endif
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "programbinarycache.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QOpenGLFunctions>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#undef None
+#include <deviceinfo/deviceinfo.h>
+
+#ifndef GL_PROGRAM_BINARY_LENGTH
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#endif
+#ifndef GL_NUM_PROGRAM_BINARY_FORMATS
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#endif
+
+static const quint32 cacheMagic = 0x48515350; // "HQSP"
+// Bump when the entry layout changes
+static const quint32 cacheVersion = 1;
+
+ProgramBinaryCache::ProgramBinaryCache(QOpenGLContext* gl) :
+    m_gl(gl), m_getProgramBinary(nullptr), m_programBinary(nullptr), m_enabled(false)
+{
+    if (!m_gl)
+        return;
+
+    DeviceInfo deviceInfo(DeviceInfo::None);
+    if (deviceInfo.get("HaliumQsgShaderCache", "true") == "false")
+        return;
+
+    const QString cacheRoot = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation);
+    if (cacheRoot.isEmpty())
+        return;
+    m_directory = cacheRoot + QStringLiteral("/haliumqsgcontext/programs");
+
+    // Core in OpenGL ES 3, an extension before that
+    QOpenGLFunctions* functions = m_gl->functions();
+    const bool es3 = m_gl->isOpenGLES() && m_gl->format().majorVersion() >= 3;
+    if (es3) {
+        m_getProgramBinary = (GetProgramBinaryFunction)m_gl->getProcAddress("glGetProgramBinary");
+        m_programBinary = (ProgramBinaryFunction)m_gl->getProcAddress("glProgramBinary");
+    } else if (m_gl->hasExtension("GL_OES_get_program_binary")) {
+        m_getProgramBinary = (GetProgramBinaryFunction)m_gl->getProcAddress("glGetProgramBinaryOES");
+        m_programBinary = (ProgramBinaryFunction)m_gl->getProcAddress("glProgramBinaryOES");
+    }
+
+    GLint formats = 0;
+    if (m_getProgramBinary && m_programBinary)
+        functions->glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    if (formats <= 0)
+        return;
+
+    // Binaries are only good for the exact driver build that produced them
+    m_driverKey = QByteArray(reinterpret_cast<const char*>(functions->glGetString(GL_VENDOR))) + '\n' +
+                  QByteArray(reinterpret_cast<const char*>(functions->glGetString(GL_RENDERER))) + '\n' +
+                  QByteArray(reinterpret_cast<const char*>(functions->glGetString(GL_VERSION)));
+    m_enabled = true;
+}
+
+bool ProgramBinaryCache::isEnabled() const
+{
+    return m_enabled;
+}
+
+QByteArray ProgramBinaryCache::programKey(const QByteArray& vertexSource, const QByteArray& fragmentSource,
+                                          const QByteArray& attributeBindings) const
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(m_driverKey);
+    hash.addData("\0", 1);
+    hash.addData(vertexSource);
+    hash.addData("\0", 1);
+    hash.addData(fragmentSource);
+    hash.addData("\0", 1);
+    hash.addData(attributeBindings);
+    return hash.result().toHex();
+}
+
+QString ProgramBinaryCache::entryPath(const QByteArray& key) const
+{
+    return m_directory + QLatin1Char('/') + QString::fromLatin1(key);
+}
+
+bool ProgramBinaryCache::load(QOpenGLShaderProgram* program, const QByteArray& key)
+{
+    if (!m_enabled || !program)
+        return false;
+
+    QFile file(entryPath(key));
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    quint32 magic = 0;
+    quint32 version = 0;
+    QByteArray driverKey;
+    quint32 binaryFormat = 0;
+    QByteArray binary;
+    QByteArray checksum;
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream >> magic >> version >> driverKey >> binaryFormat >> binary >> checksum;
+
+    const bool valid = stream.status() == QDataStream::Ok && magic == cacheMagic && version == cacheVersion &&
+                       driverKey == m_driverKey && !binary.isEmpty() &&
+                       QCryptographicHash::hash(binary, QCryptographicHash::Md5) == checksum;
+    if (!valid) {
+        qWarning() << "Discarding invalid program binary" << file.fileName();
+        file.remove();
+        return false;
+    }
+    file.close();
+
+    if (!program->create())
+        return false;
+
+    // Drivers are free to reject binaries, e.g. after an update that kept the version string
+    QOpenGLFunctions* functions = m_gl->functions();
+    m_programBinary(program->programId(), binaryFormat, binary.constData(), binary.size());
+
+    GLint linked = 0;
+    functions->glGetProgramiv(program->programId(), GL_LINK_STATUS, &linked);
+    if (!linked) {
+        qWarning() << "Driver rejected program binary" << file.fileName();
+        file.remove();
+        return false;
+    }
+
+    // Without any shaders added, Qt takes over the link status of the program as it is
+    return program->link();
+}
+
+void ProgramBinaryCache::store(QOpenGLShaderProgram* program, const QByteArray& key)
+{
+    if (!m_enabled || !program || !program->isLinked())
+        return;
+
+    QOpenGLFunctions* functions = m_gl->functions();
+    GLint length = 0;
+    functions->glGetProgramiv(program->programId(), GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+
+    QByteArray binary(length, Qt::Uninitialized);
+    GLsizei written = 0;
+    GLenum binaryFormat = 0;
+    m_getProgramBinary(program->programId(), length, &written, &binaryFormat, binary.data());
+    if (written <= 0)
+        return;
+    binary.resize(written);
+
+    if (!QDir().mkpath(m_directory))
+        return;
+
+    // Written to a temporary file first, so other apps starting up concurrently never see half an entry
+    QSaveFile file(entryPath(key));
+    if (!file.open(QIODevice::WriteOnly))
+        return;
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << cacheMagic << cacheVersion << m_driverKey << (quint32)binaryFormat << binary
+           << QCryptographicHash::hash(binary, QCryptographicHash::Md5);
+
+    if (stream.status() != QDataStream::Ok || !file.commit())
+        qWarning() << "Failed to store program binary" << file.fileName();
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROGRAMBINARYCACHE_H
+#define PROGRAMBINARYCACHE_H
+
+#include <QByteArray>
+#include <QOpenGLContext>
+#include <QOpenGLShaderProgram>
+#include <QString>
+
+// Keeps linked conversion programs on disk, shared by all apps of a user since the programs don't
+// differ between them. Entries are keyed by the GL driver and the program sources, entries that
+// don't validate or fail to load are removed and rebuilt by the caller.
+class ProgramBinaryCache
+{
+public:
+    explicit ProgramBinaryCache(QOpenGLContext* gl);
+
+    bool isEnabled() const;
+
+    // Key for a program built from the given sources, attribute bindings included
+    QByteArray programKey(const QByteArray& vertexSource, const QByteArray& fragmentSource,
+                          const QByteArray& attributeBindings) const;
+
+    // Turns the program into a linked one from the cached binary, false if there's none usable
+    bool load(QOpenGLShaderProgram* program, const QByteArray& key);
+    void store(QOpenGLShaderProgram* program, const QByteArray& key);
+
+private:
+    typedef void (QOPENGLF_APIENTRYP GetProgramBinaryFunction)(GLuint program, GLsizei bufSize, GLsizei* length,
+                                                             GLenum* binaryFormat, void* binary);
+    typedef void (QOPENGLF_APIENTRYP ProgramBinaryFunction)(GLuint program, GLenum binaryFormat,
+                                                          const void* binary, GLint length);
+
+    QString entryPath(const QByteArray& key) const;
+
+    QOpenGLContext* m_gl;
+    QByteArray m_driverKey;
+    QString m_directory;
+    GetProgramBinaryFunction m_getProgramBinary;
+    ProgramBinaryFunction m_programBinary;
+    bool m_enabled;
+};
+
+#endif
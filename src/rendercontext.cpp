@@ -29,110 +29,10 @@
 #include <QtQuick/private/qsgrenderloop_p.h>
 
 #include <dlfcn.h>
-#include <hybris/common/dlfcn.h>
 
 // Clashes with deviceinfo
 #undef None
 
-static const GLchar* COLOR_CONVERSION_VERTEX = {
-    "#version 100\n"
-    "attribute highp vec3 vertexCoord;\n"
-    "attribute highp vec2 textureCoord;\n"
-    "varying highp vec2 uv;\n"
-    "\n"
-    "void main() {\n"
-    "    uv = textureCoord.xy;\n"
-    "    gl_Position = vec4(vertexCoord,1.0);\n"
-    "}\n"
-};
-
-static const GLchar* PASSTHROUGH_SHADER = {
-    "#version 100\n"
-    "precision mediump float;\n"
-    "uniform sampler2D textureSampler;\n"
-    "uniform bool hasAlpha;\n"
-    "varying highp vec2 uv;\n"
-    "\n"
-    "void main() {\n"
-    "    vec3 color = texture2D(textureSampler, uv).rgb;\n"
-    "    float alpha = hasAlpha ? texture2D(textureSampler, uv).a : 1.0;\n"
-    "    gl_FragColor = vec4(color, alpha);\n"
-    "}\n"
-};
-
-static const GLchar* FLIP_COLOR_CHANNELS_SHADER = {
-    "#version 100\n"
-    "precision mediump float;\n"
-    "uniform sampler2D textureSampler;\n"
-    "varying highp vec2 uv;\n"
-    "\n"
-    "void main() {\n"
-    "    gl_FragColor = vec4(texture2D(textureSampler, uv).bgr, 1.0);\n"
-    "}\n"
-};
-
-static const GLchar* FLIP_COLOR_CHANNELS_WITH_ALPHA_SHADER = {
-    "#version 100\n"
-    "precision mediump float;\n"
-    "uniform sampler2D textureSampler;\n"
-    "varying highp vec2 uv;\n"
-    "\n"
-    "void main() {\n"
-    "    gl_FragColor = texture2D(textureSampler, uv).bgra;\n"
-    "}\n"
-};
-
-static const GLchar* RGB32_TO_RGBA8888_SHADER = {
-    "#version 100\n"
-    "precision mediump float;\n"
-    "uniform sampler2D textureSampler;\n"
-    "uniform bool hasAlpha;\n"
-    "varying highp vec2 uv;\n"
-    "\n"
-    "void main() {\n"
-    "    vec4 sampledColor = texture2D(textureSampler, uv);\n"
-    "    vec3 color = sampledColor.bgr;\n"
-    "    float alpha = hasAlpha ? sampledColor.a : 1.0;\n"
-    "    if (hasAlpha) {\n"
-    "        color = vec3(color.r * alpha, color.g * alpha, color.b * alpha);\n"
-    "    }\n"
-    "    gl_FragColor = vec4(color, alpha);\n"
-    "}\n"
-};
-
-static const GLchar* RGB32_TO_RGBA8888_PREMULT_SHADER = {
-    "#version 100\n"
-    "precision mediump float;\n"
-    "uniform sampler2D textureSampler;\n"
-    "uniform bool hasAlpha;\n"
-    "varying highp vec2 uv;\n"
-    "\n"
-    "void main() {\n"
-    "    vec4 sampledColor = texture2D(textureSampler, uv);\n"
-    "    vec3 color = sampledColor.bgr;\n"
-    "    float alpha = hasAlpha ? sampledColor.a : 1.0;\n"
-    "    if (hasAlpha) {\n"
-    "        if (alpha == 0.0) { color = vec3(0.0, 0.0, 0.0); }"
-    "        else { }\n"
-    "    }\n"
-    "    gl_FragColor = vec4(color, alpha);\n"
-    "}\n"
-};
-
-static const GLchar* RED_AND_BLUE_SWAP_SHADER = {
-    "#version 100\n"
-    "precision mediump float;\n"
-    "uniform sampler2D textureSampler;\n"
-    "uniform bool hasAlpha;\n"
-    "varying highp vec2 uv;\n"
-    "\n"
-    "void main() {\n"
-    "    vec3 color = texture2D(textureSampler, uv).bgr;\n"
-    "    float alpha = hasAlpha ? texture2D(textureSampler, uv).a : 1.0;\n"
-    "    gl_FragColor = vec4(color, alpha);\n"
-    "}\n"
-};
-
 
 RenderContext::RenderContext(QSGContext* context) : QSGDefaultRenderContext(context),
     m_logging(false), m_quirks(RenderContext::NoQuirk), m_libuiFound(false), m_deviceInfo(DeviceInfo::None),
@@ -145,6 +45,45 @@ RenderContext::RenderContext(QSGContext* context) : QSGDefaultRenderContext(cont
     if (m_deviceInfo.get("HaliumQsgUseRtScheduling", "false") == "true") {
         m_quirks |= RenderContext::UseRtScheduling;
     }
+    if (m_deviceInfo.get("HaliumQsgUseAtlas", "true") == "false") {
+        m_quirks |= RenderContext::DisableAtlas;
+    }
+    // Tiles keep the full resolution image in memory, only worth it for producers asking for them
+    if (m_deviceInfo.get("HaliumQsgUseTiledTextures", "false") != "true") {
+        m_quirks |= RenderContext::DisableTiling;
+    }
+    if (m_deviceInfo.get("HaliumQsgUsePboUploads", "true") == "false") {
+        m_quirks |= RenderContext::DisablePboUploads;
+    }
+
+    // Formats to swizzle on the CPU instead of in a conversion shader
+    const QByteArray cpuConversionFormats = qEnvironmentVariableIsSet("HALIUMQSG_CPU_CONVERSION") ?
+        qgetenv("HALIUMQSG_CPU_CONVERSION") :
+        QByteArray::fromStdString(m_deviceInfo.get("HaliumQsgCpuConversion", "none"));
+    m_textureCreator->setCpuConversionFormats(cpuConversionFormats);
+
+    // Show unfinished textures as transparent until their upload is done rather than stalling frames
+    const bool nonBlockingUploads = qEnvironmentVariableIsSet("HALIUMQSG_NONBLOCKING_UPLOADS") ?
+        qgetenv("HALIUMQSG_NONBLOCKING_UPLOADS") == "1" :
+        m_deviceInfo.get("HaliumQsgNonBlockingUploads", "false") == "true";
+    m_textureCreator->setNonBlockingUploads(nonBlockingUploads);
+
+    // Downscaling filter for images exceeding the maximum texture size, "box", "bilinear" or "lanczos"
+    const QByteArray resampleFilter = qEnvironmentVariableIsSet("HALIUMQSG_RESAMPLE_FILTER") ?
+        qgetenv("HALIUMQSG_RESAMPLE_FILTER") :
+        QByteArray::fromStdString(m_deviceInfo.get("HaliumQsgResampleFilter", "lanczos"));
+    m_textureCreator->setResampleFilter(Resampler::filterFromName(resampleFilter.constData()));
+
+    // Sample channel reordered textures through the GLES 3 texture swizzle instead of converting them into an FBO
+    m_textureCreator->setTextureSwizzle(m_deviceInfo.get("HaliumQsgTextureSwizzle", "true") == "true");
+
+    // Build conversion shaders on a shared context of their own instead of stalling the first frames
+    const bool backgroundShaderBuild = m_deviceInfo.get("HaliumQsgBackgroundShaderBuild", "true") == "true";
+    m_shaderLibrary = std::make_unique<ColorShaderLibrary>(backgroundShaderBuild);
+
+    // Without gralloc, uploads still leave the render thread through a shared context of their own
+    if (!(m_quirks & RenderContext::DisablePboUploads))
+        m_pboUploader = std::make_unique<PboTextureUploader>();
 }
 
 void RenderContext::messageReceived(const QOpenGLDebugMessage &debugMessage)
@@ -199,21 +138,10 @@ bool RenderContext::init() const
     }
 #endif
 
-    // Check whether the prerequisite library can be dlopened
-    {
-#ifdef __LP64__
-        const char* ldpath = "/system/lib64/libui_compat_layer.so";
-#else
-        const char* ldpath = "/system/lib/libui_compat_layer.so";
-#endif
-        void* handle = hybris_dlopen(ldpath, RTLD_LAZY);
-        if (!handle)
-            return false;
-        else
-            m_libuiFound = true;
-
-        hybris_dlclose(handle);
-    }
+    // Check whether the buffer allocator's prerequisites are there, libui_compat_layer for gralloc
+    if (!GrallocBufferPool::shared()->allocator()->isAvailable())
+        return false;
+    m_libuiFound = true;
 
     return true;
 }
@@ -223,6 +151,7 @@ QSGTexture* RenderContext::createTexture(const QImage &image, uint flags) const
     QSGTexture* texture = nullptr;
     int numChannels = 0;
     ColorShader shader = ColorShader_None;
+    std::shared_ptr<const ShaderCache> cachedShaders;
 
     // Asynchronously upload textures whenever possible to go easy on the render thread
     const bool async = (openglContext() && openglContext()->thread() == QThread::currentThread()) ||
@@ -241,30 +170,118 @@ QSGTexture* RenderContext::createTexture(const QImage &image, uint flags) const
     if (!m_colorShadersBuilt)
         goto default_method;
 
-    // We don't support texture atlases, so defer to Qt's internal implementation
-    if (flags & QSGRenderContext::CreateTexture_Atlas)
-        goto default_method;
+    // Small images are packed into atlas pages, larger ones get a buffer of their own below
+    if ((flags & QSGRenderContext::CreateTexture_Atlas) && !(flags & QSGRenderContext::CreateTexture_Mipmap)) {
+        if (m_quirks & RenderContext::DisableAtlas)
+            goto default_method;
 
-    // Same for mipmaps, use Qt's implementation
-    if (flags & QSGRenderContext::CreateTexture_Mipmap)
-        goto default_method;
+        texture = m_textureCreator->createAtlasTexture(image, m_maxTextureSize, alpha, async, openglContext());
+        if (texture)
+            return texture;
+    }
 
-    if (GrallocTextureCreator::convertFormat(image, numChannels, shader, alpha) < 0 || numChannels == 0)
+    if (GrallocTextureCreator::convertFormat(GrallocTextureCreator::uploadFormat(image.format()), numChannels, shader, alpha) < 0 || numChannels == 0)
         goto default_method;
 
-    if ((m_quirks & RenderContext::DisableConversionShaders) && (shader != ColorShader_None))
+    if ((m_quirks & RenderContext::DisableConversionShaders) && (shader != ColorShader_None) &&
+            !m_textureCreator->cpuConversionEnabled(GrallocTextureCreator::uploadFormat(image.format())))
         goto default_method;
 
-    texture = m_textureCreator->createTexture(image, m_cachedShaders, m_maxTextureSize, flags, async, openglContext());
+    // Textures whose shader isn't ready yet take the CPU conversion or Qt's path in the meantime
+    if (!(m_quirks & RenderContext::DisableConversionShaders)) {
+        if (shader != ColorShader_None)
+            m_shaderLibrary->request(shader);
+        if (flags & QSGRenderContext::CreateTexture_Mipmap)
+            m_shaderLibrary->request(ColorShader_Passthrough);
+    }
+    cachedShaders = m_shaderLibrary->collect();
+
+    // Oversized images keep their full resolution around as tiles, next to the downscaled texture
+    if (!(m_quirks & RenderContext::DisableTiling) && (image.width() > m_maxTextureSize || image.height() > m_maxTextureSize))
+        texture = m_textureCreator->createTiledTexture(image, *cachedShaders, m_maxTextureSize, flags, async, openglContext());
+    else
+        texture = m_textureCreator->createTexture(image, *cachedShaders, m_maxTextureSize, flags, async, openglContext());
     if (texture)
         return texture;
 
 default_method:
+    if (m_pboUploader && openglContext() && openglContext()->thread() == QThread::currentThread() &&
+            m_pboUploader->initialize(openglContext())) {
+        texture = m_pboUploader->createTexture(image, flags);
+        if (texture)
+            return texture;
+    }
+
     if (m_logging)
         qDebug() << "Falling back to Qt for texture uploads";
     return QSGDefaultRenderContext::createTexture(image, flags);
 }
 
+QSGTexture* RenderContext::createTexture(std::shared_ptr<const EncodedImage> encoded, uint flags) const
+{
+    QSGTexture* texture = nullptr;
+    int numChannels = 0;
+    ColorShader shader = ColorShader_None;
+    std::shared_ptr<const ShaderCache> cachedShaders;
+    const QImage::Format format = GrallocTextureCreator::uploadFormat(encoded->format());
+    const bool alpha = encoded->hasAlphaChannel() && (flags & QQuickWindow::TextureHasAlphaChannel);
+    const bool async = openglContext() && openglContext()->thread() == QThread::currentThread();
+
+    if (!m_initialized)
+        m_initialized = init();
+
+    if (m_initialized && !m_colorShadersBuilt)
+        m_colorShadersBuilt = compileColorShaders();
+
+    // Oversized images need the tiles and images without a known format the conversions only a decoded QImage gets
+    if (!m_initialized || !m_colorShadersBuilt || !encoded->isValid() ||
+            encoded->size().width() > m_maxTextureSize || encoded->size().height() > m_maxTextureSize ||
+            GrallocTextureCreator::convertFormat(format, numChannels, shader, alpha) < 0 || numChannels == 0 ||
+            ((m_quirks & RenderContext::DisableConversionShaders) && shader != ColorShader_None &&
+             !m_textureCreator->cpuConversionEnabled(format)))
+        goto decode_now;
+
+    if (!(m_quirks & RenderContext::DisableConversionShaders)) {
+        if (shader != ColorShader_None)
+            m_shaderLibrary->request(shader);
+        if (flags & QSGRenderContext::CreateTexture_Mipmap)
+            m_shaderLibrary->request(ColorShader_Passthrough);
+    }
+    cachedShaders = m_shaderLibrary->collect();
+
+    texture = m_textureCreator->createEncodedTexture(encoded, *cachedShaders, m_maxTextureSize, flags, async, openglContext());
+    if (texture)
+        return texture;
+
+decode_now:
+    if (m_logging)
+        qDebug() << "Decoding image before uploading it";
+    return createTexture(encoded->decode(), flags);
+}
+
+void RenderContext::invalidate()
+{
+    // Atlas pages and conversion programs belong to the context going away
+    m_textureCreator->invalidate(openglContext());
+    m_shaderLibrary->invalidate();
+    if (m_pboUploader)
+        m_pboUploader->invalidate();
+    m_colorShadersBuilt = false;
+
+    QSGDefaultRenderContext::invalidate();
+}
+
+void RenderContext::renderNextFrame(QSGRenderer* renderer, uint fboId)
+{
+    // Textures created or updated while syncing get their color conversions done in one go
+    m_textureCreator->flushConversions(openglContext());
+
+    QSGDefaultRenderContext::renderNextFrame(renderer, fboId);
+
+    // Buffers sampled by this frame can be written again once the GPU got past this point
+    m_textureCreator->frameRendered();
+}
+
 bool RenderContext::compileColorShaders() const
 {
     if (!openglContext())
@@ -278,73 +295,11 @@ bool RenderContext::compileColorShaders() const
     if (m_logging)
         qDebug() << "Max texture size:" << m_maxTextureSize;
 
-    m_cachedShaders.clear();
-    m_cachedShaders[ColorShader_None] = std::make_shared<ShaderBundle>(nullptr, 0, 0, 0, 0);
-
     // When conversion shaders are disabled the application might still use EGLImage or the default
     if (m_quirks & RenderContext::DisableConversionShaders)
         return true;
 
-    for (int i = (int)ColorShader::ColorShader_First; i < ColorShader::ColorShader_Count; i++) {
-        auto program = std::make_shared<QOpenGLShaderProgram>();
-        bool success = false;
-
-        success = program->addCacheableShaderFromSourceCode(QOpenGLShader::Vertex, COLOR_CONVERSION_VERTEX);
-
-        if (!success) {
-            qWarning() << "Failed to compile vertex shader hence using defaults. Reason:";
-            qWarning() << program->log();
-            return false;
-        }
-
-        switch (i) {
-        case ColorShader_Passthrough:
-            success = program->addCacheableShaderFromSourceCode(QOpenGLShader::Fragment, PASSTHROUGH_SHADER);
-            break;
-        case ColorShader_FlipColorChannels:
-            success = program->addCacheableShaderFromSourceCode(QOpenGLShader::Fragment, FLIP_COLOR_CHANNELS_SHADER);
-            break;
-        case ColorShader_FlipColorChannelsWithAlpha:
-            success = program->addCacheableShaderFromSourceCode(QOpenGLShader::Fragment, FLIP_COLOR_CHANNELS_WITH_ALPHA_SHADER);
-            break;
-        case ColorShader_RGB32ToRGBX8888:
-            success = program->addCacheableShaderFromSourceCode(QOpenGLShader::Fragment, RGB32_TO_RGBA8888_SHADER);
-            break;
-        case ColorShader_RGB32ToRGBX8888_Premult:
-            success = program->addCacheableShaderFromSourceCode(QOpenGLShader::Fragment, RGB32_TO_RGBA8888_PREMULT_SHADER);
-            break;
-        case ColorShader_RedAndBlueSwap:
-            success = program->addCacheableShaderFromSourceCode(QOpenGLShader::Fragment, RED_AND_BLUE_SWAP_SHADER);
-            break;
-        default:
-            qWarning() << "No color shader type" << i;
-            break;
-        }
-
-        if (!success) {
-            qWarning() << "Failed to compile fragment shader" << i << "hence using defaults. Reason:";
-            qWarning() << program->log();
-            return false;
-        }
-
-        gl->glBindAttribLocation(program->programId(), 0, "vertexCoord");                                                 
-        gl->glBindAttribLocation(program->programId(), 1, "textureCoord");                                                 
-
-        success = program->link();
-        if (!success) {
-            qWarning() << "Failed to link shader" << i << "hence using defaults. Reason:";
-            qWarning() << program->log();
-            return false;
-        }
-
-        auto bundle = std::make_shared<ShaderBundle>(
-            program,
-            0,
-            1,
-            gl->glGetUniformLocation(program->programId(), "textureSampler"),
-            gl->glGetUniformLocation(program->programId(), "hasAlpha")
-        );
-        m_cachedShaders[(ColorShader)i] = bundle;
-    }
+    // Variants are built as formats need them, or all of them ahead of time on a background context
+    m_shaderLibrary->initialize(openglContext());
     return true;
 }
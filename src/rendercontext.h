@@ -25,7 +25,11 @@
 #undef None
 #include <deviceinfo/deviceinfo.h>
 
+#include "colorshaderlibrary.h"
 #include "gralloctexture.h"
+#include "pbotextureuploader.h"
+
+#include <memory>
 
 class RenderContext : public QSGDefaultRenderContext
 {
@@ -33,12 +37,19 @@ public:
     explicit RenderContext(QSGContext* context);
 
     QSGTexture* createTexture(const QImage &image, uint flags = QSGRenderContext::CreateTexture_Alpha) const override;
+    // Decodes the image along with its upload, falling back to decoding it right away where that isn't possible
+    QSGTexture* createTexture(std::shared_ptr<const EncodedImage> encoded, uint flags = QSGRenderContext::CreateTexture_Alpha) const;
+    void invalidate() override;
+    void renderNextFrame(QSGRenderer* renderer, uint fboId) override;
 
 private:
     enum Quirk {
         NoQuirk = 0x0,
         DisableConversionShaders = 0x1,
-        UseRtScheduling = 0x2
+        UseRtScheduling = 0x2,
+        DisableAtlas = 0x4,
+        DisableTiling = 0x8,
+        DisablePboUploads = 0x10
     };
     Q_DECLARE_FLAGS(Quirks, Quirk)
 
@@ -49,12 +60,13 @@ private:
 
     bool mutable m_logging;
     QOpenGLDebugLogger mutable m_glLogger;
-    ShaderCache mutable m_cachedShaders;
     GLint mutable m_maxTextureSize;
     bool mutable m_libuiFound;
     RenderContext::Quirks mutable m_quirks;
     DeviceInfo m_deviceInfo;
     mutable GrallocTextureCreator* m_textureCreator;
+    std::unique_ptr<ColorShaderLibrary> m_shaderLibrary;
+    std::unique_ptr<PboTextureUploader> m_pboUploader;
     mutable bool m_initialized;
     mutable bool m_colorShadersBuilt;
 };
@@ -0,0 +1,332 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "resampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HALIUMQSG_X86_KERNELS 1
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(__aarch64__)
+#include <arm_neon.h>
+#define HALIUMQSG_NEON_KERNELS 1
+#endif
+
+// Weights are fixed point with this many fractional bits, which keeps them within 16 bits
+static const int precisionBits = 14;
+
+typedef void (*VerticalRowFunction)(uint8_t* dst, const uint8_t* const* rows, const int16_t* weights,
+                                    const int taps, const int bytes);
+
+static double boxFilter(const double x)
+{
+    return (x >= -0.5 && x < 0.5) ? 1.0 : 0.0;
+}
+
+static double bilinearFilter(double x)
+{
+    x = std::fabs(x);
+    return x < 1.0 ? 1.0 - x : 0.0;
+}
+
+static double sinc(const double x)
+{
+    if (x == 0.0)
+        return 1.0;
+    const double px = M_PI * x;
+    return std::sin(px) / px;
+}
+
+static double lanczosFilter(const double x)
+{
+    return (x > -3.0 && x < 3.0) ? sinc(x) * sinc(x / 3.0) : 0.0;
+}
+
+static inline uint8_t clampChannel(const int32_t value)
+{
+    return (uint8_t)std::min<int32_t>(255, std::max<int32_t>(0, value >> precisionBits));
+}
+
+static void verticalRowScalar(uint8_t* dst, const uint8_t* const* rows, const int16_t* weights,
+                              const int taps, const int bytes)
+{
+    for (int i = 0; i < bytes; i++) {
+        int32_t sum = 1 << (precisionBits - 1);
+        for (int k = 0; k < taps; k++)
+            sum += rows[k][i] * weights[k];
+        dst[i] = clampChannel(sum);
+    }
+}
+
+#ifdef HALIUMQSG_X86_KERNELS
+
+TARGET_SSE2
+static void verticalRowSse2(uint8_t* dst, const uint8_t* const* rows, const int16_t* weights,
+                            const int taps, const int bytes)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rounding = _mm_set1_epi32(1 << (precisionBits - 1));
+
+    int i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        __m128i lo = rounding;
+        __m128i hi = rounding;
+        for (int k = 0; k < taps; k++) {
+            // Channels widened to 16 bits, multiplied into full 32 bit products
+            const __m128i pixels = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(rows[k] + i)), zero);
+            const __m128i weight = _mm_set1_epi16(weights[k]);
+            const __m128i productLo = _mm_mullo_epi16(pixels, weight);
+            const __m128i productHi = _mm_mulhi_epi16(pixels, weight);
+            lo = _mm_add_epi32(lo, _mm_unpacklo_epi16(productLo, productHi));
+            hi = _mm_add_epi32(hi, _mm_unpackhi_epi16(productLo, productHi));
+        }
+
+        const __m128i packed = _mm_packs_epi32(_mm_srai_epi32(lo, precisionBits), _mm_srai_epi32(hi, precisionBits));
+        _mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(packed, packed));
+    }
+
+    for (; i < bytes; i++) {
+        int32_t sum = 1 << (precisionBits - 1);
+        for (int k = 0; k < taps; k++)
+            sum += rows[k][i] * weights[k];
+        dst[i] = clampChannel(sum);
+    }
+}
+
+#endif
+
+#ifdef HALIUMQSG_NEON_KERNELS
+
+static void verticalRowNeon(uint8_t* dst, const uint8_t* const* rows, const int16_t* weights,
+                            const int taps, const int bytes)
+{
+    const int32x4_t rounding = vdupq_n_s32(1 << (precisionBits - 1));
+
+    int i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        int32x4_t lo = rounding;
+        int32x4_t hi = rounding;
+        for (int k = 0; k < taps; k++) {
+            const int16x8_t pixels = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(rows[k] + i)));
+            lo = vmlal_n_s16(lo, vget_low_s16(pixels), weights[k]);
+            hi = vmlal_n_s16(hi, vget_high_s16(pixels), weights[k]);
+        }
+
+        const int16x8_t narrowed = vcombine_s16(vqshrn_n_s32(lo, precisionBits), vqshrn_n_s32(hi, precisionBits));
+        vst1_u8(dst + i, vqmovun_s16(narrowed));
+    }
+
+    for (; i < bytes; i++) {
+        int32_t sum = 1 << (precisionBits - 1);
+        for (int k = 0; k < taps; k++)
+            sum += rows[k][i] * weights[k];
+        dst[i] = clampChannel(sum);
+    }
+}
+
+#endif
+
+struct VerticalKernel {
+    VerticalRowFunction function;
+    const char* backend;
+};
+
+static VerticalKernel selectVerticalKernel()
+{
+#if defined(HALIUMQSG_X86_KERNELS)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        return { verticalRowSse2, "sse2" };
+#elif defined(HALIUMQSG_NEON_KERNELS)
+    return { verticalRowNeon, "neon" };
+#endif
+    return { verticalRowScalar, "scalar" };
+}
+
+static const VerticalKernel& verticalKernel()
+{
+    static const VerticalKernel kernel = selectVerticalKernel();
+    return kernel;
+}
+
+// Negative lobes can leave a color channel above its alpha, which premultiplied pixels must never have
+static void clampToAlpha(uint8_t* pixels, const int width)
+{
+    for (int x = 0; x < width; x++, pixels += 4) {
+        const uint8_t alpha = pixels[3];
+        pixels[0] = std::min(pixels[0], alpha);
+        pixels[1] = std::min(pixels[1], alpha);
+        pixels[2] = std::min(pixels[2], alpha);
+    }
+}
+
+template<int bytesPerPixel>
+static void horizontalRow(uint8_t* dst, const uint8_t* src, const int targetWidth, const int* first,
+                          const int* count, const int16_t* weights, const int maxTaps)
+{
+    for (int x = 0; x < targetWidth; x++, dst += bytesPerPixel) {
+        const uint8_t* pixel = src + first[x] * bytesPerPixel;
+        const int16_t* weight = weights + x * maxTaps;
+
+        int32_t sum[bytesPerPixel];
+        for (int c = 0; c < bytesPerPixel; c++)
+            sum[c] = 1 << (precisionBits - 1);
+
+        for (int i = 0; i < count[x]; i++, pixel += bytesPerPixel) {
+            for (int c = 0; c < bytesPerPixel; c++)
+                sum[c] += pixel[c] * weight[i];
+        }
+
+        for (int c = 0; c < bytesPerPixel; c++)
+            dst[c] = clampChannel(sum[c]);
+    }
+}
+
+Resampler::Resampler(const int sourceWidth, const int sourceHeight, const int targetWidth, const int targetHeight,
+                     const int bytesPerPixel, const ResampleFilter filter, const bool premultiplied) :
+    m_targetWidth(targetWidth), m_targetHeight(targetHeight),
+    m_bytesPerPixel(bytesPerPixel), m_clampToAlpha(premultiplied && bytesPerPixel == 4 && filter == ResampleFilter_Lanczos),
+    m_horizontal(contributions(sourceWidth, targetWidth, filter)),
+    m_vertical(contributions(sourceHeight, targetHeight, filter))
+{
+}
+
+bool Resampler::supportsBytesPerPixel(const int bytesPerPixel)
+{
+    return bytesPerPixel == 3 || bytesPerPixel == 4;
+}
+
+ResampleFilter Resampler::filterFromName(const char* name)
+{
+    if (name && strcmp(name, "box") == 0)
+        return ResampleFilter_Box;
+    if (name && strcmp(name, "bilinear") == 0)
+        return ResampleFilter_Bilinear;
+    return ResampleFilter_Lanczos;
+}
+
+const char* Resampler::backend()
+{
+    return verticalKernel().backend;
+}
+
+Resampler::Contributions Resampler::contributions(const int sourceSize, const int targetSize, const ResampleFilter filter)
+{
+    double (*function)(double) = lanczosFilter;
+    double support = 3.0;
+    switch (filter) {
+    case ResampleFilter_Box:
+        function = boxFilter;
+        support = 0.5;
+        break;
+    case ResampleFilter_Bilinear:
+        function = bilinearFilter;
+        support = 1.0;
+        break;
+    default:
+        break;
+    }
+
+    // Downscaling widens the filter to cover every source pixel that falls into an output pixel
+    const double scale = (double)sourceSize / targetSize;
+    const double filterScale = std::max(scale, 1.0);
+    support *= filterScale;
+
+    Contributions result;
+    result.maxTaps = (int)std::ceil(support) * 2 + 1;
+    result.first.resize(targetSize);
+    result.count.resize(targetSize);
+    result.weights.assign((size_t)targetSize * result.maxTaps, 0);
+
+    std::vector<double> weights(result.maxTaps);
+    for (int i = 0; i < targetSize; i++) {
+        const double center = (i + 0.5) * scale;
+        const int first = std::max(0, (int)(center - support + 0.5));
+        const int last = std::min(sourceSize, (int)(center + support + 0.5));
+        const int count = std::min(last - first, result.maxTaps);
+
+        double total = 0.0;
+        for (int j = 0; j < count; j++) {
+            weights[j] = function((first + j - center + 0.5) / filterScale);
+            total += weights[j];
+        }
+
+        // Normalized, so that flat areas stay exactly as they are
+        int16_t* fixed = &result.weights[(size_t)i * result.maxTaps];
+        for (int j = 0; j < count; j++)
+            fixed[j] = (int16_t)std::lround((total != 0.0 ? weights[j] / total : 0.0) * (1 << precisionBits));
+
+        result.first[i] = first;
+        result.count[i] = count;
+    }
+
+    return result;
+}
+
+void Resampler::resampleHorizontally(uint8_t* dst, const uint8_t* src) const
+{
+    if (m_bytesPerPixel == 4) {
+        horizontalRow<4>(dst, src, m_targetWidth, m_horizontal.first.data(), m_horizontal.count.data(),
+                         m_horizontal.weights.data(), m_horizontal.maxTaps);
+    } else {
+        horizontalRow<3>(dst, src, m_targetWidth, m_horizontal.first.data(), m_horizontal.count.data(),
+                         m_horizontal.weights.data(), m_horizontal.maxTaps);
+    }
+}
+
+void Resampler::resampleRows(const uint8_t* src, const int srcStride, const int firstRow, const int rowCount,
+                             const std::function<void(int row, const uint8_t* pixels)>& emitRow) const
+{
+    if (rowCount <= 0 || !supportsBytesPerPixel(m_bytesPerPixel))
+        return;
+
+    const int rowBytes = m_targetWidth * m_bytesPerPixel;
+    const int slots = m_vertical.maxTaps;
+    const VerticalRowFunction verticalRow = verticalKernel().function;
+
+    // Horizontally resampled source rows, each in slot (row % slots) for as long as the vertical filter spans it
+    std::vector<uint8_t> ring((size_t)slots * rowBytes);
+    std::vector<uint8_t> output(rowBytes);
+    std::vector<const uint8_t*> rows(slots);
+    int nextSourceRow = 0;
+    bool started = false;
+
+    for (int y = firstRow; y < firstRow + rowCount && y < m_targetHeight; y++) {
+        const int first = m_vertical.first[y];
+        const int count = m_vertical.count[y];
+
+        if (!started || nextSourceRow < first) {
+            nextSourceRow = first;
+            started = true;
+        }
+        for (; nextSourceRow < first + count; nextSourceRow++) {
+            resampleHorizontally(&ring[(size_t)(nextSourceRow % slots) * rowBytes],
+                                 src + (size_t)srcStride * nextSourceRow);
+        }
+
+        for (int k = 0; k < count; k++)
+            rows[k] = &ring[(size_t)((first + k) % slots) * rowBytes];
+
+        verticalRow(output.data(), rows.data(), &m_vertical.weights[(size_t)y * m_vertical.maxTaps], count, rowBytes);
+        if (m_clampToAlpha)
+            clampToAlpha(output.data(), m_targetWidth);
+        emitRow(y, output.data());
+    }
+}
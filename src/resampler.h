@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+enum ResampleFilter {
+    ResampleFilter_Box = 0,
+    ResampleFilter_Bilinear,
+    ResampleFilter_Lanczos
+};
+
+// Separable resampler for pixels of 8 bit channels, 3 or 4 bytes each, as used for images exceeding
+// the maximum texture size. Weights for both axes are worked out once, after which any band of output
+// rows can be produced on its own, so that bands can be spread across threads. Each band only keeps
+// the few horizontally resampled source rows its vertical filter spans around, never a whole image.
+// Pixels with alpha have to be premultiplied, with alpha as their last byte, for the filters to mix them right.
+class Resampler
+{
+public:
+    Resampler(const int sourceWidth, const int sourceHeight, const int targetWidth, const int targetHeight,
+              const int bytesPerPixel, const ResampleFilter filter, const bool premultiplied = false);
+
+    static bool supportsBytesPerPixel(const int bytesPerPixel);
+    // "box", "bilinear" or "lanczos", falls back to the latter
+    static ResampleFilter filterFromName(const char* name);
+
+    // Resamples output rows [firstRow, firstRow + rowCount), handing each one to emitRow as soon as it's done.
+    // The row passed on is only valid during the call.
+    void resampleRows(const uint8_t* src, const int srcStride, const int firstRow, const int rowCount,
+                      const std::function<void(int row, const uint8_t* pixels)>& emitRow) const;
+
+    // Name of the instruction set the vertical pass was selected for at runtime
+    static const char* backend();
+
+private:
+    // Source range and fixed point weights of every output pixel along one axis
+    struct Contributions {
+        std::vector<int> first;
+        std::vector<int> count;
+        std::vector<int16_t> weights;
+        int maxTaps = 0;
+    };
+
+    static Contributions contributions(const int sourceSize, const int targetSize, const ResampleFilter filter);
+    void resampleHorizontally(uint8_t* dst, const uint8_t* src) const;
+
+    const int m_targetWidth;
+    const int m_targetHeight;
+    const int m_bytesPerPixel;
+    const bool m_clampToAlpha;
+    Contributions m_horizontal;
+    Contributions m_vertical;
+};
+
+#endif
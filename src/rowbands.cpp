@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rowbands.h"
+
+#include <QRunnable>
+#include <QSemaphore>
+
+// Splitting only pays off once a band is well beyond the cost of waking up a thread
+static const size_t minBandBytes = 1024 * 1024;
+
+class RowBandRunnable : public QRunnable
+{
+public:
+    RowBandRunnable(const std::function<void(int, int)>& func, const int firstRow, const int rowCount, QSemaphore* done) :
+        m_func(func), m_firstRow(firstRow), m_rowCount(rowCount), m_done(done) {}
+
+    void run() override
+    {
+        m_func(m_firstRow, m_rowCount);
+        m_done->release();
+    }
+
+private:
+    const std::function<void(int, int)>& m_func;
+    const int m_firstRow;
+    const int m_rowCount;
+    QSemaphore* m_done;
+};
+
+void forEachRowBand(QThreadPool* pool, const int rows, const size_t bytesPerRow,
+                    const std::function<void(int firstRow, int rowCount)>& func)
+{
+    if (rows <= 0)
+        return;
+
+    const int maxBands = pool ? pool->maxThreadCount() + 1 : 1;
+    const int bands = qBound<int>(1, (bytesPerRow * rows) / minBandBytes, qMin(maxBands, rows));
+
+    if (bands == 1) {
+        func(0, rows);
+        return;
+    }
+
+    const int rowsPerBand = (rows + bands - 1) / bands;
+    QSemaphore done;
+    int started = 0;
+
+    for (int firstRow = rowsPerBand; firstRow < rows; firstRow += rowsPerBand) {
+        const int rowCount = qMin(rowsPerBand, rows - firstRow);
+        RowBandRunnable* runnable = new RowBandRunnable(func, firstRow, rowCount, &done);
+
+        if (pool->tryStart(runnable)) {
+            started++;
+        } else {
+            delete runnable;
+            func(firstRow, rowCount);
+        }
+    }
+
+    func(0, qMin(rowsPerBand, rows));
+    done.acquire(started);
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ROWBANDS_H
+#define ROWBANDS_H
+
+#include <QThreadPool>
+
+#include <functional>
+
+// Splits an image's rows into bands and processes them concurrently on idle threads of the pool.
+// The calling thread works on a band itself and returns once all bands are done. Bands that
+// can't be handed to an idle thread run on the calling thread, so this never waits for a busy pool.
+void forEachRowBand(QThreadPool* pool, const int rows, const size_t bytesPerRow,
+                    const std::function<void(int firstRow, int rowCount)>& func);
+
+#endif
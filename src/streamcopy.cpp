@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "streamcopy.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HALIUMQSG_X86_STREAMING 1
+#elif defined(__aarch64__) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HALIUMQSG_NEON_STREAMING 1
+#endif
+
+static const size_t cacheLineSize = 64;
+
+// Below this a row isn't worth the alignment fixups, plain stores combine just as well
+static const size_t streamingThreshold = 256;
+
+#if defined(HALIUMQSG_X86_STREAMING)
+
+__attribute__((target("sse2")))
+static void streamCopyLines(uint8_t* dst, const uint8_t* src, const size_t lines)
+{
+    for (size_t i = 0; i < lines; i++, dst += cacheLineSize, src += cacheLineSize) {
+        const __m128i a = _mm_loadu_si128((const __m128i*)(src + 0));
+        const __m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+        const __m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+        const __m128i d = _mm_loadu_si128((const __m128i*)(src + 48));
+        _mm_stream_si128((__m128i*)(dst + 0), a);
+        _mm_stream_si128((__m128i*)(dst + 16), b);
+        _mm_stream_si128((__m128i*)(dst + 32), c);
+        _mm_stream_si128((__m128i*)(dst + 48), d);
+    }
+}
+
+__attribute__((target("sse2")))
+static inline void streamFence()
+{
+    _mm_sfence();
+}
+
+#elif defined(HALIUMQSG_NEON_STREAMING)
+
+static void streamCopyLines(uint8_t* dst, const uint8_t* src, const size_t lines)
+{
+    for (size_t i = 0; i < lines; i++, dst += cacheLineSize, src += cacheLineSize) {
+        const uint8x16_t a = vld1q_u8(src + 0);
+        const uint8x16_t b = vld1q_u8(src + 16);
+        const uint8x16_t c = vld1q_u8(src + 32);
+        const uint8x16_t d = vld1q_u8(src + 48);
+#if defined(__aarch64__)
+        // Non-temporal store pairs, the closest thing to x86 streaming stores
+        __asm__ volatile(
+            "stnp %q0, %q1, [%4]\n"
+            "stnp %q2, %q3, [%4, #32]\n"
+            :: "w"(a), "w"(b), "w"(c), "w"(d), "r"(dst) : "memory");
+#else
+        vst1q_u8(dst + 0, a);
+        vst1q_u8(dst + 16, b);
+        vst1q_u8(dst + 32, c);
+        vst1q_u8(dst + 48, d);
+#endif
+    }
+}
+
+static inline void streamFence()
+{
+#if defined(__aarch64__)
+    __asm__ volatile("dmb ishst" ::: "memory");
+#endif
+}
+
+#else
+
+static void streamCopyLines(uint8_t* dst, const uint8_t* src, const size_t lines)
+{
+    memcpy(dst, src, lines * cacheLineSize);
+}
+
+static inline void streamFence()
+{
+}
+
+#endif
+
+static void streamCopyRow(uint8_t* dst, const uint8_t* src, size_t bytes)
+{
+    if (bytes < streamingThreshold) {
+        memcpy(dst, src, bytes);
+        return;
+    }
+
+    // Bring the destination up to a cache line boundary
+    const size_t head = (cacheLineSize - ((uintptr_t)dst & (cacheLineSize - 1))) & (cacheLineSize - 1);
+    if (head) {
+        memcpy(dst, src, head);
+        dst += head;
+        src += head;
+        bytes -= head;
+    }
+
+    const size_t lines = bytes / cacheLineSize;
+    streamCopyLines(dst, src, lines);
+    dst += lines * cacheLineSize;
+    src += lines * cacheLineSize;
+    bytes -= lines * cacheLineSize;
+
+    if (bytes)
+        memcpy(dst, src, bytes);
+}
+
+void streamCopy(uint8_t* dst, const uint8_t* src, const size_t bytes)
+{
+    streamCopyRow(dst, src, bytes);
+    streamFence();
+}
+
+void streamCopyPlane(uint8_t* dst, const int dstStride, const uint8_t* src, const int srcStride,
+                     const int rowBytes, const int rows)
+{
+    // Tightly packed planes are one long row
+    if (dstStride == srcStride && srcStride == rowBytes) {
+        streamCopy(dst, src, (size_t)rowBytes * rows);
+        return;
+    }
+
+    for (int i = 0; i < rows; i++) {
+        streamCopyRow(dst + (size_t)dstStride * i, src + (size_t)srcStride * i, rowBytes);
+    }
+    streamFence();
+}
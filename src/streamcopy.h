@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMCOPY_H
+#define STREAMCOPY_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Copy routines for destinations in uncached or write-combined memory, as is the case for
+// most gralloc heaps. The destination is written in full, cache line aligned chunks using
+// non-temporal stores so that no cache line is ever read back or left half filled.
+void streamCopy(uint8_t* dst, const uint8_t* src, const size_t bytes);
+
+// Stride aware 2D copy of rows rowBytes wide
+void streamCopyPlane(uint8_t* dst, const int dstStride, const uint8_t* src, const int srcStride,
+                     const int rowBytes, const int rows);
+
+#endif
@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "texturecache.h"
+
+#include <QByteArray>
+#include <QHash>
+#include <QMutexLocker>
+
+#undef None
+#include <deviceinfo/deviceinfo.h>
+
+TextureCache::TextureCache(const size_t byteLimit, const bool hashContents) :
+    m_bytes(0), m_byteLimit(byteLimit), m_hashContents(hashContents),
+    m_hits(0), m_misses(0), m_bytesSaved(0)
+{
+}
+
+std::shared_ptr<TextureCache> TextureCache::shared()
+{
+    // Intentionally leaked for the same reason as the buffer pool, it holds on to gralloc buffers.
+    static std::shared_ptr<TextureCache>* cache = []() {
+        DeviceInfo deviceInfo(DeviceInfo::None);
+        bool ok = false;
+        size_t limitMiB = QByteArray::fromStdString(deviceInfo.get("HaliumQsgTextureCacheSize", "16")).toULong(&ok);
+        if (!ok)
+            limitMiB = 16;
+
+        const bool hashContents = deviceInfo.get("HaliumQsgTextureCacheHashContents", "false") == "true";
+        return new std::shared_ptr<TextureCache>(std::make_shared<TextureCache>(limitMiB * 1024 * 1024, hashContents));
+    }();
+    return *cache;
+}
+
+quint64 TextureCache::hashContents(const QImage& image)
+{
+    // Two independently seeded 32 bit hashes make collisions unlikely enough for a cache of this size.
+    // Only the visible part of each scanline is hashed, padding may contain anything.
+    const size_t rowBytes = ((size_t)image.width() * image.depth() + 7) / 8;
+    uint lo = qHash((int)image.format(), 0x9e3779b9);
+    uint hi = qHash((int)image.format(), 0x85ebca6b);
+
+    for (int i = 0; i < image.height(); i++) {
+        const uchar* line = image.constScanLine(i);
+        lo = qHashBits(line, rowBytes, lo);
+        hi = qHashBits(line, rowBytes, hi);
+    }
+
+    const QVector<QRgb> colorTable = image.colorTable();
+    if (!colorTable.isEmpty()) {
+        lo = qHashBits(colorTable.constData(), colorTable.size() * sizeof(QRgb), lo);
+        hi = qHashBits(colorTable.constData(), colorTable.size() * sizeof(QRgb), hi);
+    }
+
+    return ((quint64)hi << 32) | lo;
+}
+
+bool TextureCache::hashesContents() const
+{
+    return m_hashContents && m_byteLimit > 0;
+}
+
+std::shared_ptr<GrallocBuffer> TextureCache::hit(EntryIterator entry, int& textureSize)
+{
+    // Move to the front of the LRU list, iterators stay valid
+    m_entries.splice(m_entries.begin(), m_entries, entry);
+
+    m_hits++;
+    m_bytesSaved += entry->textureSize;
+    textureSize = entry->textureSize;
+    return entry->buffer;
+}
+
+std::shared_ptr<GrallocBuffer> TextureCache::findImage(const qint64 cacheKey, const UploadParameters& parameters, int& textureSize)
+{
+    QMutexLocker locker(&m_mutex);
+
+    auto it = m_byImage.find(Key(cacheKey, parameters));
+    if (it != m_byImage.end())
+        return hit(it->second, textureSize);
+
+    // Identical contents might still be found by the uploader, only count the miss there
+    if (!hashesContents())
+        m_misses++;
+
+    return nullptr;
+}
+
+std::shared_ptr<GrallocBuffer> TextureCache::findContents(const qint64 cacheKey, const quint64 contentHash,
+                                                          const UploadParameters& parameters, int& textureSize)
+{
+    QMutexLocker locker(&m_mutex);
+
+    auto it = m_byContents.find(Key(contentHash, parameters));
+    if (it == m_byContents.end()) {
+        m_misses++;
+        return nullptr;
+    }
+
+    // Let the next request for this very QImage be answered without hashing
+    rekeyImage(it->second, Key(cacheKey, parameters));
+    return hit(it->second, textureSize);
+}
+
+void TextureCache::rekeyImage(EntryIterator entry, const Key& imageKey)
+{
+    auto existing = m_byImage.find(imageKey);
+    if (existing != m_byImage.end() && existing->second != entry)
+        erase(existing->second);
+
+    auto previous = m_byImage.find(entry->imageKey);
+    if (previous != m_byImage.end() && previous->second == entry)
+        m_byImage.erase(previous);
+
+    entry->imageKey = imageKey;
+    m_byImage[imageKey] = entry;
+}
+
+void TextureCache::insert(const qint64 cacheKey, const quint64 contentHash, const UploadParameters& parameters,
+                          std::shared_ptr<GrallocBuffer> buffer, const int textureSize)
+{
+    if (!buffer || buffer->byteCount > m_byteLimit)
+        return;
+
+    QMutexLocker locker(&m_mutex);
+
+    const Key imageKey(cacheKey, parameters);
+    const Key contentKey(contentHash, parameters);
+
+    // Concurrent uploads of the same image race to insert, the last one wins
+    auto existing = m_byImage.find(imageKey);
+    if (existing != m_byImage.end())
+        erase(existing->second);
+
+    if (hashesContents()) {
+        existing = m_byContents.find(contentKey);
+        if (existing != m_byContents.end())
+            erase(existing->second);
+    }
+
+    m_entries.push_front({ imageKey, contentKey, hashesContents(), buffer, textureSize });
+    m_byImage[imageKey] = m_entries.begin();
+    if (hashesContents())
+        m_byContents[contentKey] = m_entries.begin();
+    m_bytes += buffer->byteCount;
+
+    while (m_bytes > m_byteLimit && !m_entries.empty()) {
+        erase(std::prev(m_entries.end()));
+    }
+}
+
+void TextureCache::erase(EntryIterator entry)
+{
+    auto byImage = m_byImage.find(entry->imageKey);
+    if (byImage != m_byImage.end() && byImage->second == entry)
+        m_byImage.erase(byImage);
+
+    auto byContents = m_byContents.find(entry->contentKey);
+    if (entry->hasContentKey && byContents != m_byContents.end() && byContents->second == entry)
+        m_byContents.erase(byContents);
+
+    m_bytes -= entry->buffer->byteCount;
+    m_entries.erase(entry);
+}
+
+void TextureCache::clear()
+{
+    QMutexLocker locker(&m_mutex);
+    m_byImage.clear();
+    m_byContents.clear();
+    m_entries.clear();
+    m_bytes = 0;
+}
+
+TextureCache::Stats TextureCache::stats() const
+{
+    QMutexLocker locker(&m_mutex);
+
+    Stats stats;
+    stats.hits = m_hits;
+    stats.misses = m_misses;
+    stats.bytesSaved = m_bytesSaved;
+    stats.entries = m_entries.size();
+    stats.bytes = m_bytes;
+    return stats;
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TEXTURECACHE_H
+#define TEXTURECACHE_H
+
+#include <QImage>
+#include <QMutex>
+
+#include <list>
+#include <map>
+#include <memory>
+#include <tuple>
+
+#include "bufferpool.h"
+
+// Everything besides the source pixels that determines the contents of an uploaded buffer
+struct UploadParameters {
+    int width = 0;
+    int height = 0;
+    int format = 0;
+    unsigned int conversion = 0;
+    bool alpha = false;
+
+    bool operator<(const UploadParameters& other) const {
+        return std::tie(width, height, format, conversion, alpha) <
+               std::tie(other.width, other.height, other.format, other.conversion, other.alpha);
+    }
+};
+
+// Finished uploads by QImage::cacheKey() and, optionally, by a hash of their contents.
+// Textures created from identical images share the cached buffer instead of uploading again.
+class TextureCache
+{
+public:
+    struct Stats {
+        quint64 hits = 0;
+        quint64 misses = 0;
+        quint64 bytesSaved = 0;
+        size_t entries = 0;
+        size_t bytes = 0;
+    };
+
+    TextureCache(const size_t byteLimit, const bool hashContents);
+
+    // Process-wide cache, configured through device properties
+    static std::shared_ptr<TextureCache> shared();
+    static quint64 hashContents(const QImage& image);
+
+    bool hashesContents() const;
+
+    std::shared_ptr<GrallocBuffer> findImage(const qint64 cacheKey, const UploadParameters& parameters, int& textureSize);
+    std::shared_ptr<GrallocBuffer> findContents(const qint64 cacheKey, const quint64 contentHash,
+                                                const UploadParameters& parameters, int& textureSize);
+    void insert(const qint64 cacheKey, const quint64 contentHash, const UploadParameters& parameters,
+                std::shared_ptr<GrallocBuffer> buffer, const int textureSize);
+
+    void clear();
+    Stats stats() const;
+
+private:
+    typedef std::pair<quint64, UploadParameters> Key;
+
+    struct Entry {
+        Key imageKey;
+        Key contentKey;
+        bool hasContentKey;
+        std::shared_ptr<GrallocBuffer> buffer;
+        int textureSize;
+    };
+    typedef std::list<Entry>::iterator EntryIterator;
+
+    std::shared_ptr<GrallocBuffer> hit(EntryIterator entry, int& textureSize);
+    void rekeyImage(EntryIterator entry, const Key& imageKey);
+    void erase(EntryIterator entry);
+
+    mutable QMutex m_mutex;
+    std::list<Entry> m_entries;
+    std::map<Key, EntryIterator> m_byImage;
+    std::map<Key, EntryIterator> m_byContents;
+    size_t m_bytes;
+    size_t m_byteLimit;
+    bool m_hashContents;
+
+    quint64 m_hits;
+    quint64 m_misses;
+    quint64 m_bytesSaved;
+};
+
+#endif
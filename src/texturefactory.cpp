@@ -2,55 +2,58 @@
 
 #include <QQuickWindow>
 
-TextureFactory::TextureFactory(const QImage& image) : QQuickTextureFactory(), m_image(image)
+#include <private/qquickwindow_p.h>
+
+TextureFactory::TextureFactory(const QImage& image) : QQuickTextureFactory(),
+    m_image(std::make_shared<UploadedImage>(image)), m_hasAlphaChannel(image.hasAlphaChannel())
+{
+}
+
+TextureFactory::TextureFactory(std::shared_ptr<const EncodedImage> encoded) : QQuickTextureFactory(),
+    m_hasAlphaChannel(encoded->hasAlphaChannel()), m_encoded(encoded)
 {
 }
 
 QSGTexture* TextureFactory::createTexture(QQuickWindow *window) const
 {
     QQuickWindow::CreateTextureOptions flags = 0;
-    if (m_image.hasAlphaChannel())
+    if (m_hasAlphaChannel)
         flags |= QQuickWindow::TextureHasAlphaChannel;
 
-    auto texture = window->createTextureFromImage(m_image, flags);
+    // Encoded images go to our render context directly, the window only takes QImages
+    if (m_encoded) {
+        RenderContext* renderContext = dynamic_cast<RenderContext*>(QQuickWindowPrivate::get(window)->context);
+        if (renderContext)
+            return renderContext->createTexture(m_encoded, uint(flags));
+        return window->createTextureFromImage(m_encoded->decode(), flags);
+    }
+
+    // Once uploaded, the pixels only live on in the texture's buffer. Textures for other windows
+    // or after the scene graph got invalidated are created from what is read back from there.
+    auto texture = window->createTextureFromImage(m_image->image(), flags);
+    GrallocTexture* grallocTexture = qobject_cast<GrallocTexture*>(texture);
+    if (grallocTexture && !m_image->isUploaded())
+        grallocTexture->keepUploadedImage(m_image);
     return texture;
 }
 
 int TextureFactory::textureByteCount() const
 {
-    return m_image.bytesPerLine() * m_image.height();
+    if (m_encoded)
+        return m_encoded->byteCount();
+    return m_image->byteCount();
 }
 
 QSize TextureFactory::textureSize() const
 {
-    return m_image.size();
+    if (m_encoded)
+        return m_encoded->size();
+    return m_image->size();
 }
 
 QImage TextureFactory::image() const
 {
-    return m_image;
-
-#if 0 // TODO
-    auto texture = static_cast<GrallocTexture*>(m_texture);
-    if (!texture) {
-        return m_image;
-    }
-
-    struct graphic_buffer* handle = texture->buffer();
-    void* vmemAddr = nullptr;
-    graphic_buffer_lock(handle, GRALLOC_USAGE_SW_READ_RARELY | GRALLOC_USAGE_SW_WRITE_NEVER, &vmemAddr);
-
-    if (!vmemAddr) {
-        return m_image;
-    }
-
-    const int width = graphic_buffer_get_width(handle);
-    const int height = graphic_buffer_get_height(handle);
-    const auto format = m_texture->hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32;
-
-    const auto ret = QImage((const uchar*) vmemAddr, width, height, format).copy();
-    graphic_buffer_unlock(handle);
-
-    return ret;
-#endif
+    if (m_encoded)
+        return m_encoded->decode();
+    return m_image->image();
 }
@@ -8,6 +8,7 @@
 #include <memory>
 
 #include "rendercontext.h"
+#include "encodedimage.h"
 #include "gralloctexture.h"
 
 class TextureFactory : public QQuickTextureFactory
@@ -16,6 +17,8 @@ class TextureFactory : public QQuickTextureFactory
 
 public:
     TextureFactory(const QImage& image);
+    // Leaves decoding to the upload of the texture
+    TextureFactory(std::shared_ptr<const EncodedImage> encoded);
 
     virtual QSGTexture* createTexture(QQuickWindow *window) const override;
     virtual int textureByteCount() const override;
@@ -24,7 +27,9 @@ public:
 
 private:
     RenderContext* m_renderContext;
-    QImage m_image;
+    std::shared_ptr<UploadedImage> m_image;
+    bool m_hasAlphaChannel;
+    std::shared_ptr<const EncodedImage> m_encoded;
 };
 
 #endif
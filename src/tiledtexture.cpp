@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tiledtexture.h"
+
+#include <QDebug>
+#include <QThread>
+
+#include <QtQuick/private/qsgcontext_p.h>
+
+// Resident tiles reach this far beyond the visible region, in tiles
+static const qreal residentMargin = 0.5;
+
+static void releaseImage(void* info)
+{
+    delete static_cast<QImage*>(info);
+}
+
+TiledTexture::TiledTexture(GrallocTextureCreator* creator, GrallocTexture* overview, const QImage& image,
+                           const ShaderCache& cachedShaders, const int tileSize, const uint flags, QOpenGLContext* gl) :
+    QSGTexture(), m_creator(creator), m_overview(overview), m_image(image), m_cachedShaders(cachedShaders),
+    m_tileSize(tileSize), m_flags(flags & ~QSGRenderContext::CreateTexture_Mipmap), m_gl(gl)
+{
+    for (int y = 0; y < image.height(); y += tileSize) {
+        for (int x = 0; x < image.width(); x += tileSize)
+            m_tileRects.push_back(QRect(x, y, qMin(tileSize, image.width() - x), qMin(tileSize, image.height() - y)));
+    }
+    m_tiles.resize(m_tileRects.size(), nullptr);
+}
+
+TiledTexture::~TiledTexture()
+{
+    for (GrallocTexture* tile : m_tiles)
+        delete tile;
+    delete m_overview;
+}
+
+int TiledTexture::textureId() const
+{
+    return m_overview->textureId();
+}
+
+QSize TiledTexture::textureSize() const
+{
+    return m_overview->textureSize();
+}
+
+bool TiledTexture::hasAlphaChannel() const
+{
+    return m_overview->hasAlphaChannel();
+}
+
+bool TiledTexture::hasMipmaps() const
+{
+    return m_overview->hasMipmaps();
+}
+
+void TiledTexture::bind()
+{
+    // Sampling options are set on this texture by the material, the overview is what gets bound
+    m_overview->setFiltering(filtering());
+    m_overview->setMipmapFiltering(mipmapFiltering());
+    m_overview->setHorizontalWrapMode(horizontalWrapMode());
+    m_overview->setVerticalWrapMode(verticalWrapMode());
+    m_overview->bind();
+}
+
+QSize TiledTexture::imageSize() const
+{
+    return m_image.size();
+}
+
+int TiledTexture::tileCount() const
+{
+    return (int)m_tileRects.size();
+}
+
+QRect TiledTexture::tileRect(const int index) const
+{
+    if (index < 0 || index >= tileCount())
+        return QRect();
+    return m_tileRects[index];
+}
+
+QSGTexture* TiledTexture::tileTexture(const int index) const
+{
+    if (index < 0 || index >= tileCount())
+        return nullptr;
+    return m_tiles[index];
+}
+
+QImage TiledTexture::tileImage(const QRect& rect) const
+{
+    // Pixels smaller than a byte can't be addressed in place
+    if (m_image.depth() < 8)
+        return m_image.copy(rect);
+
+    const uchar* bits = m_image.constScanLine(rect.y()) + (size_t)rect.x() * (m_image.depth() / 8);
+    QImage tile(bits, rect.width(), rect.height(), m_image.bytesPerLine(), m_image.format(),
+                &releaseImage, new QImage(m_image));
+    if (m_image.format() == QImage::Format_Indexed8)
+        tile.setColorTable(m_image.colorTable());
+    return tile;
+}
+
+void TiledTexture::setVisibleRect(const QRectF& rect)
+{
+    QRectF resident;
+    if (!rect.isEmpty()) {
+        const qreal margin = m_tileSize * residentMargin;
+        resident = rect.adjusted(-margin, -margin, margin, margin);
+    }
+
+    // Tiles coming into view are uploaded concurrently by the uploader threads
+    const bool async = m_gl && m_gl->thread() == QThread::currentThread();
+    for (size_t i = 0; i < m_tileRects.size(); i++) {
+        const bool wanted = resident.intersects(QRectF(m_tileRects[i]));
+        if (wanted && !m_tiles[i]) {
+            m_tiles[i] = m_creator->createTexture(tileImage(m_tileRects[i]), m_cachedShaders, m_tileSize, m_flags, async, m_gl);
+            if (!m_tiles[i])
+                qWarning() << "Failed to create tile" << m_tileRects[i];
+        } else if (!wanted && m_tiles[i]) {
+            delete m_tiles[i];
+            m_tiles[i] = nullptr;
+        }
+    }
+}
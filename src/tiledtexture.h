@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TILEDTEXTURE_H
+#define TILEDTEXTURE_H
+
+#include <QImage>
+#include <QRect>
+#include <QRectF>
+#include <QSGTexture>
+
+#include <QOpenGLContext>
+
+#include <vector>
+
+#include "gralloctexture.h"
+
+// Image larger than the GL_MAX_TEXTURE_SIZE, split into tiles of at most that size.
+// To the scene graph it is the downscaled overview texture, as a node can only sample a single texture.
+// The full resolution tiles are there for nodes that draw one quad per tile, reachable through the
+// invokable methods without linking against the plugin. Only the tiles near the visible region set
+// are kept resident. Render thread only, like the rest of the texture.
+class TiledTexture : public QSGTexture
+{
+    Q_OBJECT
+
+public:
+    ~TiledTexture();
+
+    int textureId() const override;
+    QSize textureSize() const override;
+    bool hasAlphaChannel() const override;
+    bool hasMipmaps() const override;
+    void bind() override;
+
+    Q_INVOKABLE QSize imageSize() const;
+    Q_INVOKABLE int tileCount() const;
+    // In image coordinates
+    Q_INVOKABLE QRect tileRect(const int index) const;
+    // Null while the tile isn't resident. Only valid until the next setVisibleRect() call.
+    Q_INVOKABLE QSGTexture* tileTexture(const int index) const;
+
+    // Uploads the tiles intersecting the rect, given in image coordinates, plus a margin around it.
+    // Tiles further away are released. An empty rect releases all of them.
+    Q_INVOKABLE void setVisibleRect(const QRectF& rect);
+
+private:
+    TiledTexture(GrallocTextureCreator* creator, GrallocTexture* overview, const QImage& image,
+                 const ShaderCache& cachedShaders, const int tileSize, const uint flags, QOpenGLContext* gl);
+
+    // Shares the pixels of the image, which it keeps alive for as long as it's around
+    QImage tileImage(const QRect& rect) const;
+
+    GrallocTextureCreator* m_creator;
+    GrallocTexture* m_overview;
+    const QImage m_image;
+    ShaderCache m_cachedShaders;
+    const int m_tileSize;
+    const uint m_flags;
+    QOpenGLContext* m_gl;
+
+    std::vector<QRect> m_tileRects;
+    std::vector<GrallocTexture*> m_tiles;
+
+    friend class GrallocTextureCreator;
+};
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "uploadcompletion.h"
+
+#include <QMutexLocker>
+
+UploadCompletion::UploadCompletion() : m_status(Pending), m_textureSize(0)
+{
+}
+
+bool UploadCompletion::finish(const Status status, std::shared_ptr<GrallocBuffer> buffer, const int textureSize)
+{
+    std::function<void()> callback;
+
+    {
+        QMutexLocker locker(&m_mutex);
+
+        // First one to finish wins, a late result after cancellation returns its buffer to the pool
+        if (m_status.load(std::memory_order_relaxed) != Pending)
+            return false;
+
+        m_buffer = std::move(buffer);
+        m_textureSize = textureSize;
+        m_status.store(status, std::memory_order_release);
+        m_condition.wakeAll();
+        callback.swap(m_finishedCallback);
+    }
+
+    if (callback)
+        callback();
+    return true;
+}
+
+void UploadCompletion::setFinishedCallback(std::function<void()> callback)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_status.load(std::memory_order_relaxed) == Pending)
+        m_finishedCallback = std::move(callback);
+}
+
+bool UploadCompletion::complete(std::shared_ptr<GrallocBuffer> buffer, const int textureSize)
+{
+    if (!buffer)
+        return finish(Failed, nullptr, 0);
+    return finish(Completed, std::move(buffer), textureSize);
+}
+
+void UploadCompletion::fail()
+{
+    finish(Failed, nullptr, 0);
+}
+
+bool UploadCompletion::isCancelled() const
+{
+    return status() == Cancelled;
+}
+
+void UploadCompletion::cancel()
+{
+    finish(Cancelled, nullptr, 0);
+}
+
+UploadCompletion::Status UploadCompletion::status() const
+{
+    return static_cast<Status>(m_status.load(std::memory_order_acquire));
+}
+
+UploadCompletion::Status UploadCompletion::wait() const
+{
+    const Status current = status();
+    if (current != Pending)
+        return current;
+
+    QMutexLocker locker(&m_mutex);
+    while (m_status.load(std::memory_order_relaxed) == Pending) {
+        m_condition.wait(&m_mutex);
+    }
+    return static_cast<Status>(m_status.load(std::memory_order_relaxed));
+}
+
+std::shared_ptr<GrallocBuffer> UploadCompletion::buffer() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_buffer;
+}
+
+int UploadCompletion::textureSize() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_textureSize;
+}
+
+void UploadCompletion::releaseBuffer()
+{
+    QMutexLocker locker(&m_mutex);
+    m_buffer.reset();
+}
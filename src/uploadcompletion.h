@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UPLOADCOMPLETION_H
+#define UPLOADCOMPLETION_H
+
+#include <QMutex>
+#include <QWaitCondition>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+
+#include "bufferpool.h"
+
+// Outcome of a single upload, shared between the texture and the job producing its pixels.
+// The job completes it directly, so finishing an upload costs the same no matter how many
+// other uploads are in flight. Polling the status is lock-free, waiting only locks when
+// the upload is still pending.
+class UploadCompletion
+{
+public:
+    enum Status {
+        Pending = 0,
+        Completed,
+        Failed,
+        Cancelled
+    };
+
+    UploadCompletion();
+
+    // Upload job side. Results arriving for a cancelled upload are dropped, returns false then.
+    bool complete(std::shared_ptr<GrallocBuffer> buffer, const int textureSize);
+    void fail();
+    bool isCancelled() const;
+
+    // Texture side. Cancelling lets a job that hasn't started yet skip its work.
+    void cancel();
+    Status status() const;
+    Status wait() const;
+
+    // Invoked on the finishing thread once the upload is no longer pending. Not invoked at all
+    // when set after the fact, the caller can simply check the status then.
+    void setFinishedCallback(std::function<void()> callback);
+
+    // Only meaningful once completed
+    std::shared_ptr<GrallocBuffer> buffer() const;
+    int textureSize() const;
+    // Lets go of the buffer once the texture no longer needs it, the status stays as it is
+    void releaseBuffer();
+
+private:
+    bool finish(const Status status, std::shared_ptr<GrallocBuffer> buffer, const int textureSize);
+
+    std::atomic<int> m_status;
+    mutable QMutex m_mutex;
+    mutable QWaitCondition m_condition;
+    std::shared_ptr<GrallocBuffer> m_buffer;
+    int m_textureSize;
+    std::function<void()> m_finishedCallback;
+};
+
+#endif
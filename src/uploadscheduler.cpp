@@ -0,0 +1,303 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "uploadscheduler.h"
+
+#include <QMutexLocker>
+
+#undef None
+#include <deviceinfo/deviceinfo.h>
+
+#include <algorithm>
+
+#include <sys/sysinfo.h>
+
+class UploadWorker : public QThread
+{
+public:
+    UploadWorker(UploadScheduler* scheduler, const int index) : m_scheduler(scheduler), m_index(index)
+    {
+        setObjectName(QStringLiteral("QsgUpload%1").arg(index));
+    }
+
+protected:
+    void run() override
+    {
+        m_scheduler->workerLoop(m_index);
+    }
+
+private:
+    UploadScheduler* m_scheduler;
+    const int m_index;
+};
+
+UploadScheduler::UploadScheduler(const int threadCount, const size_t maxQueuedJobs) :
+    m_nextWorker(0), m_maxQueuedJobs(maxQueuedJobs), m_quit(false), m_queued(0), m_maxQueued(0),
+    m_submitted(0), m_coalesced(0), m_cancelled(0), m_rejected(0), m_stolen(0), m_ranByWaiter(0),
+    m_started(0), m_totalWaitUs(0), m_maxWaitUs(0)
+{
+    m_clock.start();
+
+    for (int i = 0; i < threadCount; i++) {
+        m_workers.emplace_back(new Worker);
+    }
+    for (int i = 0; i < threadCount; i++) {
+        m_workers[i]->thread = new UploadWorker(this, i);
+        m_workers[i]->thread->start();
+    }
+}
+
+UploadScheduler::~UploadScheduler()
+{
+    {
+        QMutexLocker locker(&m_sleepMutex);
+        m_quit = true;
+        m_wakeup.wakeAll();
+    }
+
+    for (const auto& worker : m_workers) {
+        worker->thread->wait();
+        delete worker->thread;
+    }
+}
+
+std::shared_ptr<UploadScheduler> UploadScheduler::shared()
+{
+    // Intentionally leaked like the buffer pool, uploads may still be in flight at exit
+    static std::shared_ptr<UploadScheduler>* scheduler = []() {
+        DeviceInfo deviceInfo(DeviceInfo::None);
+        bool ok = false;
+        size_t maxQueuedJobs = QByteArray::fromStdString(deviceInfo.get("HaliumQsgUploadQueueSize", "256")).toULong(&ok);
+        if (!ok || maxQueuedJobs == 0)
+            maxQueuedJobs = 256;
+
+        // Leave room for the render and main threads to be scheduled often.
+        // Runs 2 uploader threads at minimum.
+        const int threadCount = std::max<int>(2, get_nprocs_conf() - 2);
+        return new std::shared_ptr<UploadScheduler>(std::make_shared<UploadScheduler>(threadCount, maxQueuedJobs));
+    }();
+    return *scheduler;
+}
+
+bool UploadScheduler::submit(const Key& key, const Priority priority, std::shared_ptr<UploadCompletion> completion, JobFunction func)
+{
+    const bool coalescable = (key.first != 0);
+    std::shared_ptr<Job> job;
+
+    m_submitted++;
+
+    {
+        QMutexLocker locker(&m_jobsMutex);
+
+        // Piggyback on an identical upload that is queued or running already
+        if (coalescable) {
+            auto it = m_jobsByKey.find(key);
+            if (it != m_jobsByKey.end()) {
+                it->second->completions.push_back(completion);
+                m_jobsByCompletion[completion.get()] = it->second;
+                m_coalesced++;
+                return true;
+            }
+        }
+
+        if (m_queued.load() >= m_maxQueuedJobs) {
+            m_rejected++;
+            return false;
+        }
+
+        job = std::make_shared<Job>();
+        job->key = key;
+        job->priority = priority;
+        job->func = std::move(func);
+        job->completions.push_back(completion);
+        job->queuedAt = m_clock.nsecsElapsed() / 1000;
+
+        if (coalescable)
+            m_jobsByKey[key] = job;
+        m_jobsByCompletion[completion.get()] = job;
+
+        const size_t queued = ++m_queued;
+        size_t maxQueued = m_maxQueued.load();
+        while (queued > maxQueued && !m_maxQueued.compare_exchange_weak(maxQueued, queued)) {}
+    }
+
+    // Spread jobs across the workers, whoever is idle steals them anyway
+    Worker* worker = m_workers[m_nextWorker++ % m_workers.size()].get();
+    {
+        QMutexLocker locker(&worker->mutex);
+        worker->queues[priority].push_back(job);
+    }
+
+    QMutexLocker locker(&m_sleepMutex);
+    m_wakeup.wakeOne();
+    return true;
+}
+
+bool UploadScheduler::runQueued(const UploadCompletion* completion)
+{
+    std::shared_ptr<Job> job;
+
+    {
+        QMutexLocker locker(&m_jobsMutex);
+        auto it = m_jobsByCompletion.find(completion);
+        if (it == m_jobsByCompletion.end())
+            return false;
+        job = it->second;
+    }
+
+    // Already running on an uploader thread
+    if (!claim(job))
+        return false;
+
+    m_ranByWaiter++;
+    runJob(job);
+    return true;
+}
+
+bool UploadScheduler::claim(const std::shared_ptr<Job>& job)
+{
+    if (job->claimed.exchange(true))
+        return false;
+
+    m_queued--;
+    return true;
+}
+
+std::shared_ptr<UploadScheduler::Job> UploadScheduler::popJob(Worker* worker, const Priority priority)
+{
+    QMutexLocker locker(&worker->mutex);
+    auto& queue = worker->queues[priority];
+
+    while (!queue.empty()) {
+        std::shared_ptr<Job> job = std::move(queue.front());
+        queue.pop_front();
+
+        // Jobs run by a waiting thread in the meantime are simply dropped from the queue
+        if (claim(job))
+            return job;
+    }
+    return nullptr;
+}
+
+std::shared_ptr<UploadScheduler::Job> UploadScheduler::takeJob(const int index)
+{
+    const int workerCount = m_workers.size();
+
+    // Higher priority jobs anywhere win over lower priority ones in our own queue
+    for (int priority = Priority_High; priority < Priority_Count; priority++) {
+        for (int i = 0; i < workerCount; i++) {
+            Worker* worker = m_workers[(index + i) % workerCount].get();
+            std::shared_ptr<Job> job = popJob(worker, (Priority)priority);
+            if (job) {
+                if (i != 0)
+                    m_stolen++;
+                return job;
+            }
+        }
+    }
+    return nullptr;
+}
+
+void UploadScheduler::workerLoop(const int index)
+{
+    while (!m_quit) {
+        std::shared_ptr<Job> job = takeJob(index);
+        if (job) {
+            runJob(job);
+            continue;
+        }
+
+        QMutexLocker locker(&m_sleepMutex);
+        if (!m_quit && m_queued.load() == 0)
+            m_wakeup.wait(&m_sleepMutex, 1000);
+    }
+}
+
+void UploadScheduler::runJob(const std::shared_ptr<Job>& job)
+{
+    const qint64 waitedUs = m_clock.nsecsElapsed() / 1000 - job->queuedAt;
+    m_started++;
+    m_totalWaitUs += waitedUs;
+    qint64 maxWaitUs = m_maxWaitUs.load();
+    while (waitedUs > maxWaitUs && !m_maxWaitUs.compare_exchange_weak(maxWaitUs, waitedUs)) {}
+
+    // Skip uploads every requester has lost interest in before the copy started
+    {
+        QMutexLocker locker(&m_jobsMutex);
+        bool cancelled = true;
+        for (const auto& completion : job->completions) {
+            cancelled = cancelled && completion->isCancelled();
+        }
+
+        if (cancelled) {
+            forget(job);
+            m_cancelled++;
+            return;
+        }
+    }
+
+    UploadCompletion result;
+    job->func(&result);
+
+    std::vector<std::shared_ptr<UploadCompletion>> completions;
+    {
+        QMutexLocker locker(&m_jobsMutex);
+        forget(job);
+        completions.swap(job->completions);
+    }
+
+    const bool completed = (result.status() == UploadCompletion::Completed);
+    const std::shared_ptr<GrallocBuffer> buffer = completed ? result.buffer() : nullptr;
+    const int textureSize = completed ? result.textureSize() : 0;
+
+    for (const auto& completion : completions) {
+        if (completed)
+            completion->complete(buffer, textureSize);
+        else
+            completion->fail();
+    }
+}
+
+void UploadScheduler::forget(const std::shared_ptr<Job>& job)
+{
+    auto it = m_jobsByKey.find(job->key);
+    if (it != m_jobsByKey.end() && it->second == job)
+        m_jobsByKey.erase(it);
+
+    for (const auto& completion : job->completions) {
+        auto byCompletion = m_jobsByCompletion.find(completion.get());
+        if (byCompletion != m_jobsByCompletion.end() && byCompletion->second == job)
+            m_jobsByCompletion.erase(byCompletion);
+    }
+}
+
+UploadScheduler::Stats UploadScheduler::stats() const
+{
+    Stats stats;
+    stats.submitted = m_submitted;
+    stats.coalesced = m_coalesced;
+    stats.cancelled = m_cancelled;
+    stats.rejected = m_rejected;
+    stats.stolen = m_stolen;
+    stats.ranByWaiter = m_ranByWaiter;
+    stats.queueDepth = m_queued;
+    stats.maxQueueDepth = m_maxQueued;
+
+    const quint64 started = m_started;
+    stats.averageWaitUs = started ? (m_totalWaitUs / (qint64)started) : 0;
+    stats.maxWaitUs = m_maxWaitUs;
+    return stats;
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UPLOADSCHEDULER_H
+#define UPLOADSCHEDULER_H
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "texturecache.h"
+#include "uploadcompletion.h"
+
+// Runs upload jobs on a fixed set of uploader threads. Every thread has its own queues,
+// one per priority, and idle threads steal from the others. Requests for an upload that is
+// already queued or running are attached to it instead of being uploaded twice.
+class UploadScheduler
+{
+public:
+    enum Priority {
+        Priority_High = 0,      // Small images, likely needed by the next frame
+        Priority_Normal,
+        Priority_Low,           // Oversized images that need downscaling first
+
+        Priority_Count
+    };
+
+    // The job writes its result into the completion it is handed, which is then
+    // passed on to every request attached to the job.
+    typedef std::function<void(UploadCompletion* result)> JobFunction;
+
+    // Identifies identical uploads, same as the texture cache does. Zero cache keys never coalesce.
+    typedef std::pair<quint64, UploadParameters> Key;
+
+    struct Stats {
+        quint64 submitted = 0;
+        quint64 coalesced = 0;
+        quint64 cancelled = 0;
+        quint64 rejected = 0;
+        quint64 stolen = 0;
+        quint64 ranByWaiter = 0;
+        size_t queueDepth = 0;
+        size_t maxQueueDepth = 0;
+        qint64 averageWaitUs = 0;
+        qint64 maxWaitUs = 0;
+    };
+
+    UploadScheduler(const int threadCount, const size_t maxQueuedJobs);
+    ~UploadScheduler();
+
+    // Process-wide scheduler, sized to leave room for the render and main threads
+    static std::shared_ptr<UploadScheduler> shared();
+
+    // Queues an upload completing the given completion. Returns false if the queue is full,
+    // in which case nothing was queued and the caller is expected to run the job itself.
+    bool submit(const Key& key, const Priority priority, std::shared_ptr<UploadCompletion> completion, JobFunction func);
+
+    // Runs the job completing the given completion on the calling thread if no uploader
+    // thread picked it up yet. Keeps a thread about to wait for an upload from waiting
+    // behind unrelated jobs.
+    bool runQueued(const UploadCompletion* completion);
+
+    Stats stats() const;
+
+private:
+    struct Job {
+        Key key;
+        Priority priority;
+        JobFunction func;
+        std::vector<std::shared_ptr<UploadCompletion>> completions;
+        qint64 queuedAt = 0;
+        std::atomic<bool> claimed { false };
+    };
+
+    struct Worker {
+        QThread* thread = nullptr;
+        QMutex mutex;
+        std::deque<std::shared_ptr<Job>> queues[Priority_Count];
+    };
+
+    void workerLoop(const int index);
+    std::shared_ptr<Job> takeJob(const int index);
+    std::shared_ptr<Job> popJob(Worker* worker, const Priority priority);
+    bool claim(const std::shared_ptr<Job>& job);
+    void runJob(const std::shared_ptr<Job>& job);
+    void forget(const std::shared_ptr<Job>& job);
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::atomic<unsigned int> m_nextWorker;
+    const size_t m_maxQueuedJobs;
+
+    // Guards both indices and the completions attached to jobs
+    mutable QMutex m_jobsMutex;
+    std::map<Key, std::shared_ptr<Job>> m_jobsByKey;
+    std::map<const UploadCompletion*, std::shared_ptr<Job>> m_jobsByCompletion;
+
+    QMutex m_sleepMutex;
+    QWaitCondition m_wakeup;
+    std::atomic<bool> m_quit;
+    QElapsedTimer m_clock;
+
+    std::atomic<size_t> m_queued;
+    std::atomic<size_t> m_maxQueued;
+    std::atomic<quint64> m_submitted;
+    std::atomic<quint64> m_coalesced;
+    std::atomic<quint64> m_cancelled;
+    std::atomic<quint64> m_rejected;
+    std::atomic<quint64> m_stolen;
+    std::atomic<quint64> m_ranByWaiter;
+    std::atomic<quint64> m_started;
+    std::atomic<qint64> m_totalWaitUs;
+    std::atomic<qint64> m_maxWaitUs;
+
+    friend class UploadWorker;
+};
+
+#endif
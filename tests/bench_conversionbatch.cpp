@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "colorshaderlibrary.h"
+#include "gralloctexture.h"
+#include "testcontext.h"
+
+#include <QColor>
+#include <QElapsedTimer>
+#include <QtTest>
+
+#include <vector>
+
+// Textures converted per case, split into rounds of the batch size
+static const int texturesPerCase = 300;
+
+// Render thread time per texture of converting a frame's worth of shader-converted textures in one flush,
+// including the GPU finishing the conversion passes. Large batches amortize program binds and state restores.
+class BenchConversionBatch : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void flush_data();
+    void flush();
+
+private:
+    TestContext m_context;
+    std::unique_ptr<ColorShaderLibrary> m_shaders;
+    std::unique_ptr<GrallocTextureCreator> m_creator;
+};
+
+void BenchConversionBatch::initTestCase()
+{
+    if (!m_context.create())
+        QSKIP("No OpenGL context available");
+    if (!m_context.grallocSupported())
+        QSKIP("No EGL context or buffer allocator for gralloc textures");
+
+    // RGB32 takes a conversion pass as long as neither the CPU nor the texture swizzle does the reorder
+    m_shaders = std::make_unique<ColorShaderLibrary>(false);
+    m_shaders->initialize(m_context.context());
+    m_shaders->request(ColorShader_RGB32ToRGBX8888);
+    QCOMPARE(m_shaders->status(ColorShader_RGB32ToRGBX8888), ColorShaderLibrary::Status_Ready);
+
+    m_creator = std::make_unique<GrallocTextureCreator>();
+    m_creator->setTextureSwizzle(false);
+}
+
+void BenchConversionBatch::cleanupTestCase()
+{
+    if (m_creator)
+        m_creator->invalidate(m_context.context());
+    if (m_shaders)
+        m_shaders->invalidate();
+}
+
+void BenchConversionBatch::flush_data()
+{
+    QTest::addColumn<int>("batchSize");
+    QTest::addColumn<int>("imageSize");
+
+    for (const int imageSize : { 64, 512 }) {
+        for (const int batchSize : { 1, 10, 100 }) {
+            QTest::newRow(qPrintable(QStringLiteral("%1 px/batch of %2").arg(imageSize).arg(batchSize)))
+                << batchSize << imageSize;
+        }
+    }
+}
+
+void BenchConversionBatch::flush()
+{
+    QFETCH(int, batchSize);
+    QFETCH(int, imageSize);
+
+    QOpenGLContext* gl = m_context.context();
+    const std::shared_ptr<const ShaderCache> shaders = m_shaders->collect();
+
+    // Uploads of the same images are shared through the texture cache after the first round, conversions never are
+    std::vector<QImage> images;
+    for (int i = 0; i < batchSize; i++) {
+        QImage image(imageSize, imageSize, QImage::Format_RGB32);
+        image.fill(QColor::fromHsv(i * 359 / batchSize, 255, 255));
+        images.push_back(image);
+    }
+
+    qint64 elapsed = 0;
+    const int rounds = qMax(1, texturesPerCase / batchSize);
+    for (int round = 0; round < rounds; round++) {
+        std::vector<QSGTexture*> textures;
+        for (const QImage& image : images) {
+            QSGTexture* texture = m_creator->createTexture(image, *shaders, 4096, 0, false, gl);
+            QVERIFY(texture);
+            textures.push_back(texture);
+        }
+
+        QElapsedTimer timer;
+        timer.start();
+        m_creator->flushConversions(gl);
+        gl->functions()->glFinish();
+        elapsed += timer.nsecsElapsed();
+
+        m_creator->frameRendered();
+        QVERIFY(textures.front()->textureId() != 0);
+        qDeleteAll(textures);
+    }
+
+    QTest::setBenchmarkResult(elapsed / 1e6 / (rounds * batchSize), QTest::WalltimeMilliseconds);
+}
+
+QTEST_MAIN(BenchConversionBatch)
+
+#include "bench_conversionbatch.moc"
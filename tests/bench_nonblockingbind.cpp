@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gralloctexture.h"
+#include "testcontext.h"
+
+#include <QColor>
+#include <QElapsedTimer>
+#include <QQuickWindow>
+#include <QtTest>
+
+#include <vector>
+
+static const int frames = 60;
+static const qint64 frameNsecs = 16666667;
+
+// Oversized images, slow to upload since they get downscaled on the way
+static const int textureCount = 4;
+static const QSize imageSize(6000, 4000);
+static const int maxTextureSize = 2048;
+
+// Longest time the render thread spent binding textures in any frame while their uploads were running,
+// with binds blocking on the uploads and with placeholders standing in until the uploads are done
+class BenchNonBlockingBind : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+
+    void worstFrame_data();
+    void worstFrame();
+
+private:
+    TestContext m_context;
+    std::vector<QImage> m_images;
+};
+
+void BenchNonBlockingBind::initTestCase()
+{
+    if (!m_context.create())
+        QSKIP("No OpenGL context available");
+    if (!m_context.grallocSupported())
+        QSKIP("No EGL context or buffer allocator for gralloc textures");
+
+    for (int i = 0; i < textureCount; i++) {
+        QImage image(imageSize, QImage::Format_ARGB32_Premultiplied);
+        image.fill(QColor::fromHsv(i * 359 / textureCount, 255, 255, 200));
+        m_images.push_back(image);
+    }
+}
+
+void BenchNonBlockingBind::worstFrame_data()
+{
+    QTest::addColumn<bool>("nonBlocking");
+
+    QTest::newRow("blocking") << false;
+    QTest::newRow("placeholder") << true;
+}
+
+void BenchNonBlockingBind::worstFrame()
+{
+    QFETCH(bool, nonBlocking);
+
+    QOpenGLContext* gl = m_context.context();
+    GrallocTextureCreator creator;
+    creator.setNonBlockingUploads(nonBlocking);
+
+    // Copies, so that nothing is shared through the texture cache with the previous run
+    std::vector<GrallocTexture*> textures;
+    for (const QImage& image : m_images) {
+        GrallocTexture* texture = creator.createTexture(image.copy(), ShaderCache(), maxTextureSize,
+                                                        QQuickWindow::TextureHasAlphaChannel, true, gl);
+        QVERIFY(texture);
+        textures.push_back(texture);
+    }
+
+    qint64 worst = 0;
+    for (int frame = 0; frame < frames; frame++) {
+        QElapsedTimer timer;
+        timer.start();
+        for (GrallocTexture* texture : textures) {
+            texture->updateTexture();
+            texture->bind();
+        }
+        gl->functions()->glFinish();
+        const qint64 elapsed = timer.nsecsElapsed();
+        worst = qMax(worst, elapsed);
+
+        creator.frameRendered();
+        if (elapsed < frameNsecs)
+            QThread::usleep((frameNsecs - elapsed) / 1000);
+    }
+
+    for (QSGTexture* texture : textures)
+        delete texture;
+    creator.invalidate(gl);
+
+    QTest::setBenchmarkResult(worst / 1e6, QTest::WalltimeMilliseconds);
+}
+
+QTEST_MAIN(BenchNonBlockingBind)
+
+#include "bench_nonblockingbind.moc"
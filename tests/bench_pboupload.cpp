@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pbotextureuploader.h"
+#include "testcontext.h"
+
+#include <QColor>
+#include <QElapsedTimer>
+#include <QtTest>
+
+#include <vector>
+
+static const int textureCount = 8;
+
+enum UploadMethod {
+    // What Qt's own render context does without gralloc: convert and glTexImage2D() on the render thread
+    UploadMethod_TexImage,
+    UploadMethod_Pbo
+};
+
+Q_DECLARE_METATYPE(UploadMethod)
+
+// Render thread time spent in the frame requesting a batch of textures, without gralloc buffers.
+// Also logs the time until all of them were bound and drawn from. Runs on llvmpipe without a display
+// server through QT_QPA_PLATFORM=minimalegl and EGL_PLATFORM=surfaceless, or under xvfb-run.
+class BenchPboUpload : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+
+    void requestFrame_data();
+    void requestFrame();
+
+private:
+    TestContext m_context;
+};
+
+void BenchPboUpload::initTestCase()
+{
+    if (!m_context.create())
+        QSKIP("No OpenGL context available");
+}
+
+void BenchPboUpload::requestFrame_data()
+{
+    QTest::addColumn<UploadMethod>("method");
+    QTest::addColumn<int>("imageSize");
+
+    for (const int imageSize : { 512, 2048 }) {
+        QTest::newRow(qPrintable(QStringLiteral("teximage/%1").arg(imageSize))) << UploadMethod_TexImage << imageSize;
+        QTest::newRow(qPrintable(QStringLiteral("pbo/%1").arg(imageSize))) << UploadMethod_Pbo << imageSize;
+    }
+}
+
+// Milliseconds on the render thread
+void BenchPboUpload::requestFrame()
+{
+    QFETCH(UploadMethod, method);
+    QFETCH(int, imageSize);
+
+    QOpenGLContext* gl = m_context.context();
+    QOpenGLFunctions* functions = gl->functions();
+
+    std::vector<QImage> images;
+    for (int i = 0; i < textureCount; i++) {
+        QImage image(imageSize, imageSize, QImage::Format_RGB32);
+        image.fill(QColor::fromHsv(i * 359 / textureCount, 255, 255));
+        images.push_back(image);
+    }
+
+    PboTextureUploader uploader;
+    if (method == UploadMethod_Pbo)
+        QVERIFY(uploader.initialize(gl));
+
+    std::vector<QSGTexture*> textures;
+    std::vector<GLuint> plainTextures;
+
+    QElapsedTimer total;
+    total.start();
+
+    QElapsedTimer frame;
+    frame.start();
+    for (const QImage& image : images) {
+        if (method == UploadMethod_Pbo) {
+            QSGTexture* texture = uploader.createTexture(image, 0);
+            QVERIFY(texture);
+            textures.push_back(texture);
+        } else {
+            const QImage converted = image.convertToFormat(QImage::Format_RGBA8888_Premultiplied);
+            GLuint texture = 0;
+            functions->glGenTextures(1, &texture);
+            functions->glBindTexture(GL_TEXTURE_2D, texture);
+            functions->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, converted.width(), converted.height(), 0,
+                                    GL_RGBA, GL_UNSIGNED_BYTE, converted.constBits());
+            plainTextures.push_back(texture);
+        }
+    }
+    const qint64 requestNsecs = frame.nsecsElapsed();
+
+    // The frame drawing them, waiting for whatever upload isn't done yet
+    for (QSGTexture* texture : textures)
+        texture->bind();
+    functions->glFinish();
+    qInfo() << "All textures usable after" << total.nsecsElapsed() / 1e6 << "ms";
+    QCOMPARE(functions->glGetError(), GLenum(GL_NO_ERROR));
+
+    qDeleteAll(textures);
+    functions->glDeleteTextures(plainTextures.size(), plainTextures.data());
+    uploader.invalidate();
+
+    QTest::setBenchmarkResult(requestNsecs / 1e6, QTest::WalltimeMilliseconds);
+}
+
+QTEST_MAIN(BenchPboUpload)
+
+#include "bench_pboupload.moc"
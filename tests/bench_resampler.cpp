@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "resampler.h"
+#include "rowbands.h"
+
+#include <QElapsedTimer>
+#include <QImage>
+#include <QTransform>
+#include <QtTest>
+
+#include <cstring>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+static const qint64 measureNsecs = 1000 * 1000 * 1000;
+
+enum ScaleMethod {
+    // What the upload job did before the resampler, with and without filtering
+    ScaleMethod_Transformed,
+    ScaleMethod_TransformedSmooth,
+    ScaleMethod_Box,
+    ScaleMethod_Bilinear,
+    ScaleMethod_Lanczos
+};
+
+Q_DECLARE_METATYPE(ScaleMethod)
+
+static QImage sourceImage(const QSize& size)
+{
+    QImage image(size, QImage::Format_ARGB32_Premultiplied);
+    for (int y = 0; y < size.height(); y++) {
+        QRgb* line = reinterpret_cast<QRgb*>(image.scanLine(y));
+        for (int x = 0; x < size.width(); x++)
+            line[x] = qPremultiply(qRgba(x & 0xff, y & 0xff, (x ^ y) & 0xff, (x + y) & 0xff));
+    }
+    return image;
+}
+
+// Scales the image into dst, standing in for a locked gralloc buffer, the way the upload job would.
+// Bands spread across the pool unless it's null.
+static void scaleInto(uint8_t* dst, const QImage& image, const QSize& target, const ScaleMethod method, QThreadPool* pool)
+{
+    const int dstStride = target.width() * 4;
+
+    if (method == ScaleMethod_Transformed || method == ScaleMethod_TransformedSmooth) {
+        const QImage scaled = image.transformed(QTransform::fromScale((qreal)target.width() / image.width(),
+                                                                      (qreal)target.height() / image.height()),
+                                                method == ScaleMethod_TransformedSmooth ? Qt::SmoothTransformation : Qt::FastTransformation);
+        const int rows = qMin(scaled.height(), target.height());
+        const int rowBytes = qMin(scaled.width(), target.width()) * 4;
+        for (int y = 0; y < rows; y++)
+            memcpy(dst + (size_t)dstStride * y, scaled.constScanLine(y), rowBytes);
+        return;
+    }
+
+    const ResampleFilter filter = method == ScaleMethod_Box ? ResampleFilter_Box :
+                                  method == ScaleMethod_Bilinear ? ResampleFilter_Bilinear : ResampleFilter_Lanczos;
+    const Resampler resampler(image.width(), image.height(), target.width(), target.height(), 4, filter, true);
+    const size_t bandBytesPerRow = (size_t)image.bytesPerLine() * image.height() / target.height();
+    forEachRowBand(pool, target.height(), bandBytesPerRow, [&](int firstRow, int rowCount) {
+        resampler.resampleRows(image.constBits(), image.bytesPerLine(), firstRow, rowCount, [&](int row, const uint8_t* pixels) {
+            memcpy(dst + (size_t)dstStride * row, pixels, dstStride);
+        });
+    });
+}
+
+static long statusKiB(const char* field)
+{
+    FILE* file = fopen("/proc/self/status", "r");
+    if (!file)
+        return -1;
+
+    char line[256];
+    long value = -1;
+    const size_t length = strlen(field);
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, field, length) == 0 && line[length] == ':') {
+            value = atol(line + length + 1);
+            break;
+        }
+    }
+    fclose(file);
+    return value;
+}
+
+// Downscales oversized images into a buffer of the maximum texture size, comparing the resampler
+// with QImage::transformed() for throughput and for the memory allocated on the way
+class BenchResampler : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void throughput_data();
+    void throughput();
+    void peakMemory_data();
+    void peakMemory();
+
+private:
+    void addRows(const bool threaded);
+};
+
+void BenchResampler::addRows(const bool threaded)
+{
+    QTest::addColumn<QSize>("source");
+    QTest::addColumn<QSize>("target");
+    QTest::addColumn<ScaleMethod>("method");
+    QTest::addColumn<bool>("threaded");
+
+    const char* methods[] = { "transformed", "transformed-smooth", "box", "bilinear", "lanczos" };
+    const QSize sizes[][2] = {
+        { QSize(2500, 2500), QSize(2048, 2048) },
+        { QSize(6000, 4000), QSize(2048, 1365) }
+    };
+
+    for (const auto& size : sizes) {
+        for (int method = ScaleMethod_Transformed; method <= ScaleMethod_Lanczos; method++) {
+            const QString name = QStringLiteral("%1x%2/%3").arg(size[0].width()).arg(size[0].height()).arg(QLatin1String(methods[method]));
+            QTest::newRow(qPrintable(name)) << size[0] << size[1] << (ScaleMethod)method << false;
+            if (threaded && method >= ScaleMethod_Box)
+                QTest::newRow(qPrintable(name + QStringLiteral("/bands"))) << size[0] << size[1] << (ScaleMethod)method << true;
+        }
+    }
+}
+
+void BenchResampler::throughput_data()
+{
+    addRows(true);
+}
+
+// Milliseconds per image
+void BenchResampler::throughput()
+{
+    QFETCH(QSize, source);
+    QFETCH(QSize, target);
+    QFETCH(ScaleMethod, method);
+    QFETCH(bool, threaded);
+
+    const QImage image = sourceImage(source);
+    std::vector<uint8_t> dst((size_t)target.width() * target.height() * 4);
+    QThreadPool* pool = threaded ? QThreadPool::globalInstance() : nullptr;
+
+    scaleInto(dst.data(), image, target, method, pool);
+
+    QElapsedTimer timer;
+    int iterations = 0;
+    timer.start();
+    do {
+        scaleInto(dst.data(), image, target, method, pool);
+        iterations++;
+    } while (timer.nsecsElapsed() < measureNsecs);
+
+    QTest::setBenchmarkResult(timer.nsecsElapsed() / 1e6 / iterations, QTest::WalltimeMilliseconds);
+}
+
+void BenchResampler::peakMemory_data()
+{
+    addRows(false);
+}
+
+// Peak resident memory gained while scaling one image, beyond the source and destination.
+// Measured in a child process with its high water mark reset to what it inherited.
+void BenchResampler::peakMemory()
+{
+    QFETCH(QSize, source);
+    QFETCH(QSize, target);
+    QFETCH(ScaleMethod, method);
+
+    const QImage image = sourceImage(source);
+    std::vector<uint8_t> dst((size_t)target.width() * target.height() * 4, 0);
+
+    int fds[2];
+    QVERIFY(pipe(fds) == 0);
+
+    const pid_t child = fork();
+    QVERIFY(child >= 0);
+    if (child == 0) {
+        FILE* clearRefs = fopen("/proc/self/clear_refs", "w");
+        if (clearRefs) {
+            fputs("5", clearRefs);
+            fclose(clearRefs);
+        }
+
+        const long before = statusKiB("VmHWM");
+        scaleInto(dst.data(), image, target, method, nullptr);
+        const long peak = statusKiB("VmHWM") - before;
+        const ssize_t written = write(fds[1], &peak, sizeof(peak));
+        _exit(written == sizeof(peak) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    long peakKiB = -1;
+    const ssize_t received = read(fds[0], &peakKiB, sizeof(peakKiB));
+    close(fds[0]);
+    int status = 0;
+    waitpid(child, &status, 0);
+
+    QCOMPARE(received, ssize_t(sizeof(peakKiB)));
+    QVERIFY(peakKiB >= 0);
+    QTest::setBenchmarkResult(peakKiB * 1024.0, QTest::BytesAllocated);
+}
+
+QTEST_MAIN(BenchResampler)
+
+#include "bench_resampler.moc"
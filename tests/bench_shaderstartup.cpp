@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "colorshaderlibrary.h"
+#include "gralloctexture.h"
+#include "programbinarycache.h"
+#include "testcontext.h"
+
+#include <QElapsedTimer>
+#include <QTemporaryDir>
+#include <QtTest>
+
+static const int runs = 5;
+
+// Time from a fresh context to the conversion programs being ready, with an empty program cache and with
+// one filled by an earlier run. The context is OpenGL ES like on devices, whose binaries the cache keeps.
+// Run with MESA_SHADER_CACHE_DISABLE=true on Mesa, its own shader cache would warm up the cold case otherwise.
+class BenchShaderStartup : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+
+    void startup_data();
+    void startup();
+
+private:
+    // Nanoseconds until the programs or the first converted texture were ready, -1 on failure
+    qint64 run(const bool firstTexture);
+
+    QSurfaceFormat m_format;
+    bool m_binariesSupported = false;
+    bool m_grallocSupported = false;
+};
+
+void BenchShaderStartup::initTestCase()
+{
+    m_format = QSurfaceFormat::defaultFormat();
+    m_format.setRenderableType(QSurfaceFormat::OpenGLES);
+
+    TestContext context;
+    if (!context.create(m_format))
+        QSKIP("No OpenGL ES context available");
+
+    m_binariesSupported = ProgramBinaryCache(context.context()).isEnabled();
+    m_grallocSupported = context.grallocSupported();
+}
+
+void BenchShaderStartup::startup_data()
+{
+    QTest::addColumn<bool>("warm");
+    QTest::addColumn<bool>("firstTexture");
+
+    QTest::newRow("cold/all programs") << false << false;
+    QTest::newRow("warm/all programs") << true << false;
+    QTest::newRow("cold/first texture") << false << true;
+    QTest::newRow("warm/first texture") << true << true;
+}
+
+qint64 BenchShaderStartup::run(const bool firstTexture)
+{
+    TestContext context;
+    if (!context.create(m_format))
+        return -1;
+
+    QOpenGLContext* gl = context.context();
+    QElapsedTimer timer;
+    timer.start();
+
+    ColorShaderLibrary library(false);
+    library.initialize(gl);
+    bool ready = true;
+
+    if (firstTexture) {
+        library.request(ColorShader_RGB32ToRGBX8888);
+        ready = library.status(ColorShader_RGB32ToRGBX8888) == ColorShaderLibrary::Status_Ready;
+
+        GrallocTextureCreator creator;
+        creator.setTextureSwizzle(false);
+        QImage image(64, 64, QImage::Format_RGB32);
+        image.fill(Qt::red);
+        QSGTexture* texture = creator.createTexture(image, *library.collect(), 4096, 0, false, gl);
+        creator.flushConversions(gl);
+        gl->functions()->glFinish();
+        ready = ready && texture && texture->textureId() != 0;
+
+        delete texture;
+        creator.invalidate(gl);
+    } else {
+        for (int shader = ColorShader_First; shader <= ColorShader_Last; shader++) {
+            library.request((ColorShader)shader);
+            ready = ready && library.status((ColorShader)shader) == ColorShaderLibrary::Status_Ready;
+        }
+        gl->functions()->glFinish();
+    }
+
+    const qint64 elapsed = timer.nsecsElapsed();
+    library.invalidate();
+    return ready ? elapsed : -1;
+}
+
+// Milliseconds per startup
+void BenchShaderStartup::startup()
+{
+    QFETCH(bool, warm);
+    QFETCH(bool, firstTexture);
+
+    if (warm && !m_binariesSupported)
+        QSKIP("The driver doesn't hand out program binaries");
+    if (firstTexture && !m_grallocSupported)
+        QSKIP("No EGL context or buffer allocator for gralloc textures");
+
+    qint64 total = 0;
+    for (int i = 0; i < runs; i++) {
+        // Every run gets a cache of its own, filled first by an untimed run for the warm case
+        QTemporaryDir cacheHome;
+        QVERIFY(cacheHome.isValid());
+        qputenv("XDG_CACHE_HOME", QFile::encodeName(cacheHome.path()));
+
+        if (warm)
+            QVERIFY(run(firstTexture) >= 0);
+
+        const qint64 elapsed = run(firstTexture);
+        QVERIFY(elapsed >= 0);
+        total += elapsed;
+    }
+
+    QTest::setBenchmarkResult(total / 1e6 / runs, QTest::WalltimeMilliseconds);
+}
+
+QTEST_MAIN(BenchShaderStartup)
+
+#include "bench_shaderstartup.moc"
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rowbands.h"
+#include "streamcopy.h"
+
+#include <QElapsedTimer>
+#include <QtTest>
+
+#include <cstring>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// How long each case copies for, long enough to average out page faults and frequency changes
+static const qint64 measureNsecs = 250 * 1000 * 1000;
+
+enum CopyMethod {
+    CopyMethod_Memcpy,
+    CopyMethod_Stream,
+    CopyMethod_StreamBands
+};
+
+Q_DECLARE_METATYPE(CopyMethod)
+
+// Shared memory mapping standing in for a locked gralloc buffer, as the dma-buf allocator creates them
+class MappedBuffer
+{
+public:
+    explicit MappedBuffer(const size_t size) : m_size(size)
+    {
+        m_fd = memfd_create("haliumqsg-bench", MFD_CLOEXEC);
+        if (m_fd >= 0 && ftruncate(m_fd, size) == 0)
+            m_data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    }
+    ~MappedBuffer()
+    {
+        if (m_data != MAP_FAILED)
+            munmap(m_data, m_size);
+        if (m_fd >= 0)
+            close(m_fd);
+    }
+
+    uint8_t* data() const { return m_data != MAP_FAILED ? static_cast<uint8_t*>(m_data) : nullptr; }
+
+private:
+    size_t m_size;
+    int m_fd = -1;
+    void* m_data = MAP_FAILED;
+};
+
+// Copies a 32 bit image into gralloc-like memory, reporting the throughput in bytes of image per second
+class BenchStreamCopy : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void copy_data();
+    void copy();
+};
+
+void BenchStreamCopy::copy_data()
+{
+    QTest::addColumn<QSize>("size");
+    QTest::addColumn<int>("dstStride");
+    QTest::addColumn<CopyMethod>("method");
+
+    const QSize sizes[] = { QSize(256, 256), QSize(1000, 1000), QSize(1920, 1080), QSize(4096, 4096) };
+    const char* methods[] = { "memcpy", "stream", "stream-bands" };
+
+    for (const QSize& size : sizes) {
+        // Tight, padded to 16 pixels as the dma-buf allocator does, and an odd pitch
+        const int rowBytes = size.width() * 4;
+        const int strides[] = { rowBytes, (size.width() + 15) / 16 * 16 * 4 + 64, rowBytes + 4 * 3 };
+        for (const int stride : strides) {
+            for (int method = CopyMethod_Memcpy; method <= CopyMethod_StreamBands; method++) {
+                QTest::newRow(qPrintable(QStringLiteral("%1x%2/stride %3/%4")
+                                         .arg(size.width()).arg(size.height()).arg(stride).arg(QLatin1String(methods[method]))))
+                    << size << stride << (CopyMethod)method;
+            }
+        }
+    }
+}
+
+void BenchStreamCopy::copy()
+{
+    QFETCH(QSize, size);
+    QFETCH(int, dstStride);
+    QFETCH(CopyMethod, method);
+
+    const int rowBytes = size.width() * 4;
+    std::vector<uint8_t> src((size_t)rowBytes * size.height(), 0x5a);
+    MappedBuffer dst((size_t)dstStride * size.height());
+    QVERIFY(dst.data());
+
+    const auto copyImage = [&]() {
+        switch (method) {
+        case CopyMethod_Memcpy:
+            for (int y = 0; y < size.height(); y++)
+                memcpy(dst.data() + (size_t)dstStride * y, src.data() + (size_t)rowBytes * y, rowBytes);
+            break;
+        case CopyMethod_Stream:
+            streamCopyPlane(dst.data(), dstStride, src.data(), rowBytes, rowBytes, size.height());
+            break;
+        case CopyMethod_StreamBands:
+            forEachRowBand(QThreadPool::globalInstance(), size.height(), rowBytes, [&](int firstRow, int rowCount) {
+                streamCopyPlane(dst.data() + (size_t)dstStride * firstRow, dstStride,
+                                src.data() + (size_t)rowBytes * firstRow, rowBytes, rowBytes, rowCount);
+            });
+            break;
+        }
+    };
+
+    // The first copy faults the mapping in, as happens once per buffer before the pool recycles it
+    copyImage();
+
+    QElapsedTimer timer;
+    qint64 iterations = 0;
+    timer.start();
+    do {
+        copyImage();
+        iterations++;
+    } while (timer.nsecsElapsed() < measureNsecs);
+
+    QTest::setBenchmarkResult(double(rowBytes) * size.height() * iterations * 1e9 / timer.nsecsElapsed(), QTest::BytesPerSecond);
+    QCOMPARE(dst.data()[(size_t)dstStride * (size.height() - 1) + rowBytes - 1], uint8_t(0x5a));
+}
+
+QTEST_MAIN(BenchStreamCopy)
+
+#include "bench_streamcopy.moc"
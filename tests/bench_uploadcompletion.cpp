@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "uploadcompletion.h"
+#include "uploadscheduler.h"
+
+#include <QElapsedTimer>
+#include <QtTest>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+static const int uploaderThreads = 2;
+
+enum CompletionMethod {
+    CompletionMethod_Complete,
+    CompletionMethod_Cancel,
+    // What textures did before completions: one signal every texture in flight is connected to
+    CompletionMethod_Broadcast
+};
+
+Q_DECLARE_METATYPE(CompletionMethod)
+
+class Broadcaster : public QObject
+{
+    Q_OBJECT
+
+Q_SIGNALS:
+    void uploadComplete(const QObject* texture);
+};
+
+class BroadcastReceiver : public QObject
+{
+    Q_OBJECT
+
+public:
+    std::atomic<bool> done { false };
+
+public Q_SLOTS:
+    void onUploadComplete(const QObject* texture)
+    {
+        if (texture != this)
+            return;
+        done = true;
+    }
+};
+
+// Cost per upload of finishing a burst of uploads that are in flight at the same time, as when a grid view
+// fills up. Completing an upload has to cost the same no matter how many others are waiting.
+class BenchUploadCompletion : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void burst_data();
+    void burst();
+};
+
+void BenchUploadCompletion::burst_data()
+{
+    QTest::addColumn<int>("uploads");
+    QTest::addColumn<CompletionMethod>("method");
+
+    const char* methods[] = { "complete", "cancel", "broadcast" };
+    for (int method = CompletionMethod_Complete; method <= CompletionMethod_Broadcast; method++) {
+        for (const int uploads : { 1, 10, 100, 1000 }) {
+            QTest::newRow(qPrintable(QStringLiteral("%1/%2").arg(QLatin1String(methods[method])).arg(uploads)))
+                << uploads << (CompletionMethod)method;
+        }
+    }
+}
+
+// Milliseconds per upload, from submitting the burst until every texture saw its result
+void BenchUploadCompletion::burst()
+{
+    QFETCH(int, uploads);
+    QFETCH(CompletionMethod, method);
+
+    UploadScheduler scheduler(uploaderThreads, uploads * 2);
+    Broadcaster broadcaster;
+    std::vector<std::unique_ptr<BroadcastReceiver>> receivers;
+    if (method == CompletionMethod_Broadcast) {
+        for (int i = 0; i < uploads; i++) {
+            receivers.push_back(std::make_unique<BroadcastReceiver>());
+            QObject::connect(&broadcaster, &Broadcaster::uploadComplete,
+                             receivers.back().get(), &BroadcastReceiver::onUploadComplete, Qt::DirectConnection);
+        }
+    }
+
+    const int rounds = qMax(1, 10000 / uploads);
+    qint64 elapsed = 0;
+
+    for (int round = 0; round < rounds; round++) {
+        std::vector<std::shared_ptr<UploadCompletion>> completions;
+        for (int i = 0; i < uploads; i++)
+            completions.push_back(std::make_shared<UploadCompletion>());
+        for (auto& receiver : receivers)
+            receiver->done = false;
+
+        QElapsedTimer timer;
+        timer.start();
+
+        for (int i = 0; i < uploads; i++) {
+            const BroadcastReceiver* receiver = receivers.empty() ? nullptr : receivers[i].get();
+            const UploadScheduler::Key key { quint64(round) * uploads + i + 1, UploadParameters() };
+            const bool queued = scheduler.submit(key, UploadScheduler::Priority_Normal, completions[i],
+                                                 [&, receiver](UploadCompletion* result) {
+                if (receiver)
+                    Q_EMIT broadcaster.uploadComplete(receiver);
+                result->complete(nullptr, 0);
+            });
+            QVERIFY(queued);
+            if (method == CompletionMethod_Cancel)
+                completions[i]->cancel();
+        }
+
+        for (int i = 0; i < uploads; i++) {
+            const UploadCompletion::Status expected = method == CompletionMethod_Cancel ?
+                UploadCompletion::Cancelled : UploadCompletion::Completed;
+            QCOMPARE(completions[i]->wait(), expected);
+            if (!receivers.empty()) {
+                while (!receivers[i]->done)
+                    QThread::yieldCurrentThread();
+            }
+        }
+
+        elapsed += timer.nsecsElapsed();
+
+        // Cancelled jobs still leave the queues, just without running
+        QTRY_COMPARE(scheduler.stats().queueDepth, size_t(0));
+    }
+
+    QTest::setBenchmarkResult(elapsed / 1e6 / (rounds * uploads), QTest::WalltimeMilliseconds);
+}
+
+QTEST_MAIN(BenchUploadCompletion)
+
+#include "bench_uploadcompletion.moc"
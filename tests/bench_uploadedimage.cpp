@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gralloctexture.h"
+#include "testcontext.h"
+
+#include <QColor>
+#include <QQuickWindow>
+#include <QtTest>
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+// A grid of photos, as an image-heavy scene would show
+static const int imageCount = 40;
+static const QSize imageSize(1024, 768);
+
+static QImage photo(const int index)
+{
+    QImage image(imageSize, QImage::Format_ARGB32_Premultiplied);
+    image.fill(QColor::fromHsv(index * 359 / imageCount, 200, 255));
+    return image;
+}
+
+// Anonymous resident memory, where QImages live. Dma-buf buffers are shared memory, gralloc buffers not
+// counted towards the process at all, neither shows up here.
+static qint64 residentAnonymousBytes()
+{
+    FILE* file = fopen("/proc/self/status", "r");
+    if (!file)
+        return -1;
+
+    char line[256];
+    qint64 kib = -1;
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, "RssAnon:", 8) == 0) {
+            kib = atoll(line + 8);
+            break;
+        }
+    }
+    fclose(file);
+    return kib * 1024;
+}
+
+// Resident system memory of a scene's images once their textures are uploaded and rendered,
+// with the source images kept around as texture factories used to and with them handed to the buffers
+class BenchUploadedImage : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+
+    void residentMemory_data();
+    void residentMemory();
+
+private:
+    TestContext m_context;
+};
+
+void BenchUploadedImage::initTestCase()
+{
+    if (!m_context.create())
+        QSKIP("No OpenGL context available");
+    if (!m_context.grallocSupported())
+        QSKIP("No EGL context or buffer allocator for gralloc textures");
+}
+
+void BenchUploadedImage::residentMemory_data()
+{
+    QTest::addColumn<bool>("dropSource");
+
+    QTest::newRow("keep source") << false;
+    QTest::newRow("drop source") << true;
+}
+
+// Bytes of anonymous memory the scene's images take up
+void BenchUploadedImage::residentMemory()
+{
+    QFETCH(bool, dropSource);
+
+    QOpenGLContext* gl = m_context.context();
+    GrallocTextureCreator creator;
+    std::vector<std::shared_ptr<UploadedImage>> images;
+    std::vector<GrallocTexture*> textures;
+
+    const qint64 before = residentAnonymousBytes();
+    QVERIFY(before >= 0);
+
+    for (int i = 0; i < imageCount; i++) {
+        auto image = std::make_shared<UploadedImage>(photo(i));
+        GrallocTexture* texture = creator.createTexture(image->image(), ShaderCache(), 4096,
+                                                        QQuickWindow::TextureHasAlphaChannel, false, gl);
+        QVERIFY(texture);
+        if (dropSource)
+            QVERIFY(texture->keepUploadedImage(image));
+
+        // Textures adopt their upload when first bound, handing the buffer to the image
+        texture->bind();
+        images.push_back(image);
+        textures.push_back(texture);
+    }
+    gl->functions()->glFinish();
+
+    const qint64 resident = residentAnonymousBytes() - before;
+
+    qint64 reported = 0;
+    for (const auto& image : images) {
+        QCOMPARE(image->isUploaded(), dropSource);
+        reported += image->byteCount();
+    }
+    qInfo() << "Reported texture bytes:" << reported << "resident anonymous bytes:" << resident;
+
+    // Images read back from their buffers have to be what went in
+    QCOMPARE(images.front()->image().convertToFormat(QImage::Format_ARGB32_Premultiplied), photo(0));
+
+    for (QSGTexture* texture : textures)
+        delete texture;
+    creator.invalidate(gl);
+
+    QTest::setBenchmarkResult(resident, QTest::BytesAllocated);
+}
+
+QTEST_MAIN(BenchUploadedImage)
+
+#include "bench_uploadedimage.moc"
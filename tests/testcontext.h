@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TESTCONTEXT_H
+#define TESTCONTEXT_H
+
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+
+#include <memory>
+
+#include "bufferpool.h"
+
+// GL context made current on the calling thread, for the tests and benchmarks that need one.
+// Gralloc textures additionally need EGL and an available buffer allocator, e.g. on llvmpipe:
+// xvfb-run -a env QT_QPA_PLATFORM=xcb QT_XCB_GL_INTEGRATION=xcb_egl LIBGL_ALWAYS_SOFTWARE=1 <test>
+// with /dev/udmabuf access and a Mesa able to import dma-bufs into llvmpipe.
+class TestContext
+{
+public:
+    bool create(const QSurfaceFormat& format = QSurfaceFormat::defaultFormat())
+    {
+        m_surface = std::make_unique<QOffscreenSurface>();
+        m_surface->setFormat(format);
+        m_surface->create();
+        m_context = std::make_unique<QOpenGLContext>();
+        m_context->setFormat(format);
+        return m_context->create() && m_context->makeCurrent(m_surface.get());
+    }
+
+    // Whether textures can be created from gralloc buffers
+    bool grallocSupported() const
+    {
+        return eglGetCurrentContext() != EGL_NO_CONTEXT && GrallocBufferPool::shared()->allocator()->isAvailable();
+    }
+
+    QOpenGLContext* context() const { return m_context.get(); }
+    QOffscreenSurface* surface() const { return m_surface.get(); }
+
+private:
+    std::unique_ptr<QOffscreenSurface> m_surface;
+    std::unique_ptr<QOpenGLContext> m_context;
+};
+
+#endif
@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dmabufallocator.h"
+#include "halformats.h"
+
+#include <QtTest>
+
+#include <GLES2/gl2.h>
+
+#include <cstring>
+#include <vector>
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+static bool hasExtension(const char* extensions, const char* name)
+{
+    return extensions && strstr(extensions, name) != nullptr;
+}
+
+// Test pattern byte for a pixel and channel in buffer memory order
+static uint8_t patternByte(const int x, const int y, const int channel)
+{
+    return (x * 37 + y * 11 + channel * 71) & 0xff;
+}
+
+// Imports buffers the way the texture upload path does and samples them back through GL. Runs headless
+// on Mesa's surfaceless platform, e.g. llvmpipe with LIBGL_ALWAYS_SOFTWARE=1, given /dev/udmabuf access.
+class TestDmaBufAllocator : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void formats();
+    void import_data();
+    void import();
+
+private:
+    DmaBufBufferAllocator m_allocator;
+    EGLDisplay m_display = EGL_NO_DISPLAY;
+    EGLContext m_context = EGL_NO_CONTEXT;
+    EGLSurface m_surface = EGL_NO_SURFACE;
+};
+
+void TestDmaBufAllocator::initTestCase()
+{
+    if (!m_allocator.isAvailable())
+        QSKIP("No memfd or /dev/udmabuf access");
+
+    const char* clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    if (hasExtension(clientExtensions, "EGL_MESA_platform_surfaceless")) {
+        const auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if (getPlatformDisplay)
+            m_display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    }
+    if (m_display == EGL_NO_DISPLAY)
+        m_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (m_display == EGL_NO_DISPLAY || !eglInitialize(m_display, nullptr, nullptr))
+        QSKIP("No EGL display");
+    if (!hasExtension(eglQueryString(m_display, EGL_EXTENSIONS), "EGL_EXT_image_dma_buf_import"))
+        QSKIP("EGL lacks EGL_EXT_image_dma_buf_import");
+
+    const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+        EGL_NONE
+    };
+    const EGLint contextAttribs[] = { EGL_CONTEXT_CLIENT_VERSION, 2, EGL_NONE };
+    const EGLint surfaceAttribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+
+    EGLConfig config = nullptr;
+    EGLint numConfigs = 0;
+    eglBindAPI(EGL_OPENGL_ES_API);
+    if (!eglChooseConfig(m_display, configAttribs, &config, 1, &numConfigs) || numConfigs < 1)
+        QSKIP("No GLES2 config");
+
+    m_context = eglCreateContext(m_display, config, EGL_NO_CONTEXT, contextAttribs);
+    m_surface = eglCreatePbufferSurface(m_display, config, surfaceAttribs);
+    if (m_context == EGL_NO_CONTEXT || !eglMakeCurrent(m_display, m_surface, m_surface, m_context))
+        QSKIP("Failed to make a GLES2 context current");
+    if (!hasExtension((const char*)glGetString(GL_EXTENSIONS), "GL_OES_EGL_image"))
+        QSKIP("GLES lacks GL_OES_EGL_image");
+}
+
+void TestDmaBufAllocator::cleanupTestCase()
+{
+    if (m_display == EGL_NO_DISPLAY)
+        return;
+
+    eglMakeCurrent(m_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (m_surface != EGL_NO_SURFACE)
+        eglDestroySurface(m_display, m_surface);
+    if (m_context != EGL_NO_CONTEXT)
+        eglDestroyContext(m_display, m_context);
+    eglTerminate(m_display);
+}
+
+void TestDmaBufAllocator::formats()
+{
+    // Every HAL format the descriptor table hands out needs a DRM equivalent
+    for (const int format : { HAL_PIXEL_FORMAT_RGBA_8888, HAL_PIXEL_FORMAT_RGBX_8888, HAL_PIXEL_FORMAT_BGRA_8888,
+                              HAL_PIXEL_FORMAT_RGB_888, HAL_PIXEL_FORMAT_RGB_565 })
+        QVERIFY(DmaBufBufferAllocator::drmFormat(format) != 0);
+    QCOMPARE(DmaBufBufferAllocator::drmFormat(0), 0u);
+}
+
+void TestDmaBufAllocator::import_data()
+{
+    // Bytes in memory for each of red, green, blue and alpha as GL reads them back, -1 for opaque
+    QTest::addColumn<int>("format");
+    QTest::addColumn<QVector<int>>("channels");
+
+    QTest::newRow("RGBA_8888") << int(HAL_PIXEL_FORMAT_RGBA_8888) << QVector<int>{ 0, 1, 2, 3 };
+    QTest::newRow("RGBX_8888") << int(HAL_PIXEL_FORMAT_RGBX_8888) << QVector<int>{ 0, 1, 2, -1 };
+    QTest::newRow("BGRA_8888") << int(HAL_PIXEL_FORMAT_BGRA_8888) << QVector<int>{ 2, 1, 0, 3 };
+}
+
+void TestDmaBufAllocator::import()
+{
+    QFETCH(int, format);
+    QFETCH(QVector<int>, channels);
+
+    // An odd width leaves padding at the end of each row
+    BufferDescriptor descriptor;
+    descriptor.width = 37;
+    descriptor.height = 19;
+    descriptor.format = format;
+    descriptor.usage = GRALLOC_USAGE_SW_WRITE_OFTEN | GRALLOC_USAGE_HW_TEXTURE;
+
+    int stride = 0;
+    void* handle = m_allocator.allocate(descriptor, stride);
+    QVERIFY(handle);
+    QVERIFY(stride >= descriptor.width);
+
+    uint8_t* pixels = static_cast<uint8_t*>(m_allocator.lock(handle, GRALLOC_USAGE_SW_WRITE_OFTEN));
+    QVERIFY(pixels);
+    for (int y = 0; y < descriptor.height; y++) {
+        uint8_t* line = pixels + y * stride * 4;
+        for (int x = 0; x < descriptor.width * 4; x++)
+            line[x] = patternByte(x / 4, y, x % 4);
+    }
+    m_allocator.unlock(handle);
+
+    const EGLImageKHR image = m_allocator.createImage(handle);
+    QVERIFY(image != EGL_NO_IMAGE_KHR);
+
+    // Read back through a framebuffer with the imported texture attached
+    EglImageFunctions eglImageFunctions;
+    GLuint texture = 0;
+    GLuint fbo = 0;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    eglImageFunctions.glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, image);
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+    const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+
+    std::vector<uint8_t> readBack(descriptor.width * descriptor.height * 4);
+    if (status == GL_FRAMEBUFFER_COMPLETE)
+        glReadPixels(0, 0, descriptor.width, descriptor.height, GL_RGBA, GL_UNSIGNED_BYTE, readBack.data());
+    const GLenum error = glGetError();
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteTextures(1, &texture);
+    m_allocator.destroyImage(image);
+    m_allocator.free(handle);
+
+    QCOMPARE(status, GLenum(GL_FRAMEBUFFER_COMPLETE));
+    QCOMPARE(error, GLenum(GL_NO_ERROR));
+
+    for (int y = 0; y < descriptor.height; y++) {
+        for (int x = 0; x < descriptor.width; x++) {
+            for (int channel = 0; channel < 4; channel++) {
+                const int expected = channels[channel] < 0 ? 0xff : patternByte(x, y, channels[channel]);
+                const int actual = readBack[(y * descriptor.width + x) * 4 + channel];
+                if (actual != expected) {
+                    QFAIL(qPrintable(QStringLiteral("Pixel %1,%2 channel %3 reads %4 instead of %5")
+                                     .arg(x).arg(y).arg(channel).arg(actual).arg(expected)));
+                }
+            }
+        }
+    }
+}
+
+QTEST_MAIN(TestDmaBufAllocator)
+
+#include "tst_dmabufallocator.moc"
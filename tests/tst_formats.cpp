@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gralloctexture.h"
+#include "pixelconversion.h"
+
+#include <QtTest>
+
+#include <vector>
+
+Q_DECLARE_METATYPE(QImage::Format)
+
+// Qt's own converters don't all round premultiplication the same way, one step of difference is fine
+static const int channelTolerance = 1;
+
+// Gradients across every channel with some noise, odd-sized to get the kernels into their tails.
+// Alpha runs through all its values unless the image is meant to be opaque.
+static QImage testImage(const QImage::Format format, const bool alpha)
+{
+    QImage image(67, 33, QImage::Format_ARGB32);
+    quint32 seed = 1;
+    for (int y = 0; y < image.height(); y++) {
+        QRgb* line = reinterpret_cast<QRgb*>(image.scanLine(y));
+        for (int x = 0; x < image.width(); x++) {
+            seed = seed * 1103515245 + 12345;
+            line[x] = qRgba(x * 255 / (image.width() - 1), y * 255 / (image.height() - 1), (seed >> 16) & 0xff,
+                            alpha ? (x + y * image.width()) & 0xff : 0xff);
+        }
+    }
+    return image.convertToFormat(format);
+}
+
+// Runs an image through its format's descriptor the way the uploader threads do, then reads the buffer
+// the way sampling the texture sees it: premultiplied RGBA, or RGBX without alpha
+static QImage uploadedPixels(const QImage& image, const bool alpha)
+{
+    const FormatDescriptor& descriptor = GrallocTextureCreator::formatDescriptor(image.format());
+    const QImage toUpload = image.convertToFormat(descriptor.uploadFormat);
+    const FormatDescriptor& upload = GrallocTextureCreator::formatDescriptor(toUpload.format());
+    QImage result(image.size(), alpha ? QImage::Format_RGBA8888_Premultiplied : QImage::Format_RGBX8888);
+
+    if (upload.strategy == FormatStrategy_Lookup) {
+        const std::vector<uint32_t> table = GrallocTextureCreator::pixelLookupTable(toUpload, alpha);
+        for (int y = 0; y < image.height(); y++)
+            lookupPixels(result.scanLine(y), toUpload.constScanLine(y), image.width(), table.data());
+        return result;
+    }
+
+    // RGB_565 is sampled as it is, the kernels don't write it
+    const unsigned int conversion = GrallocTextureCreator::rgbaConversion(toUpload.format(), alpha);
+    if (conversion == PixelConversion_Invalid)
+        return toUpload.convertToFormat(result.format());
+
+    for (int y = 0; y < image.height(); y++)
+        convertPixels(result.scanLine(y), toUpload.constScanLine(y), image.width(), conversion);
+    return result;
+}
+
+class TestFormats : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void descriptors_data();
+    void descriptors();
+    void conversion_data();
+    void conversion();
+};
+
+void TestFormats::descriptors_data()
+{
+    QTest::addColumn<QImage::Format>("format");
+
+    for (int format = QImage::Format_Mono; format < QImage::NImageFormats; format++)
+        QTest::newRow(GrallocTextureCreator::formatDescriptor((QImage::Format)format).name) << (QImage::Format)format;
+}
+
+void TestFormats::descriptors()
+{
+    QFETCH(QImage::Format, format);
+
+    const FormatDescriptor& descriptor = GrallocTextureCreator::formatDescriptor(format);
+    QCOMPARE(descriptor.format, format);
+
+    // Every format takes the gralloc path, converted ones in a single step
+    const FormatDescriptor& upload = GrallocTextureCreator::formatDescriptor(descriptor.uploadFormat);
+    QVERIFY(upload.strategy == FormatStrategy_Native || upload.strategy == FormatStrategy_Lookup);
+    QVERIFY(descriptor.strategy == FormatStrategy_Convert || descriptor.uploadFormat == format);
+
+    for (const bool alpha : { false, true }) {
+        int numChannels = 0;
+        ColorShader shader = ColorShader_None;
+        QVERIFY(GrallocTextureCreator::convertFormat(upload.format, numChannels, shader, alpha) >= 0);
+        if (upload.strategy == FormatStrategy_Native)
+            QCOMPARE(numChannels, QImage(1, 1, upload.format).depth() / 8);
+        else
+            QCOMPARE(numChannels, 4);
+    }
+}
+
+void TestFormats::conversion_data()
+{
+    QTest::addColumn<QImage::Format>("format");
+    QTest::addColumn<bool>("alpha");
+
+    for (int format = QImage::Format_Mono; format < QImage::NImageFormats; format++) {
+        const QByteArray name = GrallocTextureCreator::formatDescriptor((QImage::Format)format).name;
+        QTest::newRow(QByteArray(name + "/opaque").constData()) << (QImage::Format)format << false;
+        if (QImage(1, 1, (QImage::Format)format).hasAlphaChannel())
+            QTest::newRow(QByteArray(name + "/alpha").constData()) << (QImage::Format)format << true;
+    }
+}
+
+void TestFormats::conversion()
+{
+    QFETCH(QImage::Format, format);
+    QFETCH(bool, alpha);
+
+    const QImage source = testImage(format, alpha);
+    const QImage actual = uploadedPixels(source, alpha);
+    const QImage expected = source.convertToFormat(actual.format());
+
+    for (int y = 0; y < expected.height(); y++) {
+        const uchar* actualLine = actual.constScanLine(y);
+        const uchar* expectedLine = expected.constScanLine(y);
+        for (int i = 0; i < expected.width() * 4; i++) {
+            if (qAbs(actualLine[i] - expectedLine[i]) > channelTolerance) {
+                QFAIL(qPrintable(QStringLiteral("Pixel %1,%2 channel %3 is %4, Qt converts it to %5")
+                                 .arg(i / 4).arg(y).arg(i % 4).arg(actualLine[i]).arg(expectedLine[i])));
+            }
+        }
+    }
+}
+
+QTEST_MAIN(TestFormats)
+
+#include "tst_formats.moc"
@@ -0,0 +1,299 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "glstatetracker.h"
+
+#include <QOffscreenSurface>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLShaderProgram>
+#include <QtTest>
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+
+static const int checkedTextureUnits = 4;
+
+// Everything the tracker shadows, queried directly
+struct GLState {
+    GLint framebuffer;
+    GLint viewport[4];
+    GLint scissor[4];
+    GLfloat clearColor[4];
+    GLint activeTexture;
+    GLint textures[checkedTextureUnits];
+    GLint program;
+    GLint arrayBuffer;
+};
+
+static GLState currentState(QOpenGLFunctions* gl)
+{
+    GLState state;
+    gl->glGetIntegerv(GL_FRAMEBUFFER_BINDING, &state.framebuffer);
+    gl->glGetIntegerv(GL_VIEWPORT, state.viewport);
+    gl->glGetIntegerv(GL_SCISSOR_BOX, state.scissor);
+    gl->glGetFloatv(GL_COLOR_CLEAR_VALUE, state.clearColor);
+    gl->glGetIntegerv(GL_ACTIVE_TEXTURE, &state.activeTexture);
+    for (int unit = 0; unit < checkedTextureUnits; unit++) {
+        gl->glActiveTexture(GL_TEXTURE0 + unit);
+        gl->glGetIntegerv(GL_TEXTURE_BINDING_2D, &state.textures[unit]);
+    }
+    gl->glActiveTexture(state.activeTexture);
+    gl->glGetIntegerv(GL_CURRENT_PROGRAM, &state.program);
+    gl->glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &state.arrayBuffer);
+    return state;
+}
+
+// Describes the first difference, empty if there's none
+static QString stateDifference(const GLState& actual, const GLState& expected)
+{
+    const auto differs = [](const auto& a, const auto& b) {
+        return !std::equal(std::begin(a), std::end(a), std::begin(b));
+    };
+
+    if (actual.framebuffer != expected.framebuffer)
+        return QStringLiteral("framebuffer %1 instead of %2").arg(actual.framebuffer).arg(expected.framebuffer);
+    if (differs(actual.viewport, expected.viewport))
+        return QStringLiteral("viewport differs");
+    if (differs(actual.scissor, expected.scissor))
+        return QStringLiteral("scissor box differs");
+    if (differs(actual.clearColor, expected.clearColor))
+        return QStringLiteral("clear color differs");
+    if (actual.activeTexture != expected.activeTexture)
+        return QStringLiteral("active texture %1 instead of %2").arg(actual.activeTexture).arg(expected.activeTexture);
+    for (int unit = 0; unit < checkedTextureUnits; unit++) {
+        if (actual.textures[unit] != expected.textures[unit]) {
+            return QStringLiteral("texture %1 bound to unit %2 instead of %3")
+                .arg(actual.textures[unit]).arg(unit).arg(expected.textures[unit]);
+        }
+    }
+    if (actual.program != expected.program)
+        return QStringLiteral("program %1 instead of %2").arg(actual.program).arg(expected.program);
+    if (actual.arrayBuffer != expected.arrayBuffer)
+        return QStringLiteral("array buffer %1 instead of %2").arg(actual.arrayBuffer).arg(expected.arrayBuffer);
+    return QString();
+}
+
+class TestGLStateTracker : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+    void init();
+    void cleanup();
+    void cleanupTestCase();
+
+    void restoresTouchedState();
+    void nestedScopes();
+    void keepsRequestedState();
+    void restoresInvalidatedState();
+    void leavesUntouchedState();
+
+private:
+    QOpenGLFunctions* gl() const { return m_context->functions(); }
+
+    QOffscreenSurface m_surface;
+    std::unique_ptr<QOpenGLContext> m_context;
+    std::unique_ptr<QOpenGLFramebufferObject> m_framebuffers[2];
+    std::unique_ptr<QOpenGLShaderProgram> m_programs[2];
+    GLuint m_textures[4];
+    GLuint m_buffers[2];
+    GLState m_initial;
+};
+
+void TestGLStateTracker::initTestCase()
+{
+    m_surface.create();
+    m_context.reset(new QOpenGLContext);
+    if (!m_context->create() || !m_context->makeCurrent(&m_surface))
+        QSKIP("No OpenGL context available, run under xvfb-run with Mesa's llvmpipe");
+
+    for (auto& framebuffer : m_framebuffers)
+        framebuffer.reset(new QOpenGLFramebufferObject(16, 16));
+
+    for (auto& program : m_programs) {
+        program.reset(new QOpenGLShaderProgram);
+        program->addShaderFromSourceCode(QOpenGLShader::Vertex,
+            "void main() { gl_Position = vec4(0.0); }");
+        program->addShaderFromSourceCode(QOpenGLShader::Fragment,
+            "#ifdef GL_ES\nprecision mediump float;\n#endif\nvoid main() { gl_FragColor = vec4(1.0); }");
+        QVERIFY(program->link());
+    }
+
+    gl()->glGenTextures(4, m_textures);
+    for (const GLuint texture : m_textures)
+        gl()->glBindTexture(GL_TEXTURE_2D, texture);
+    gl()->glGenBuffers(2, m_buffers);
+    for (const GLuint buffer : m_buffers)
+        gl()->glBindBuffer(GL_ARRAY_BUFFER, buffer);
+}
+
+void TestGLStateTracker::init()
+{
+    // Something other than the defaults everywhere, as Qt's renderer would leave it
+    QOpenGLFunctions* f = gl();
+    f->glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffers[0]->handle());
+    f->glViewport(1, 2, 13, 14);
+    f->glScissor(3, 4, 5, 6);
+    f->glClearColor(0.25f, 0.5f, 0.75f, 1.0f);
+    f->glActiveTexture(GL_TEXTURE0);
+    f->glBindTexture(GL_TEXTURE_2D, m_textures[0]);
+    f->glActiveTexture(GL_TEXTURE2);
+    f->glBindTexture(GL_TEXTURE_2D, m_textures[1]);
+    f->glActiveTexture(GL_TEXTURE1);
+    f->glBindTexture(GL_TEXTURE_2D, m_textures[2]);
+    f->glUseProgram(m_programs[0]->programId());
+    f->glBindBuffer(GL_ARRAY_BUFFER, m_buffers[0]);
+    QCOMPARE(f->glGetError(), GLenum(GL_NO_ERROR));
+
+    m_initial = currentState(f);
+}
+
+void TestGLStateTracker::cleanup()
+{
+    if (m_context)
+        QCOMPARE(gl()->glGetError(), GLenum(GL_NO_ERROR));
+}
+
+void TestGLStateTracker::cleanupTestCase()
+{
+    if (!m_context || QOpenGLContext::currentContext() != m_context.get())
+        return;
+
+    gl()->glDeleteTextures(4, m_textures);
+    gl()->glDeleteBuffers(2, m_buffers);
+    for (auto& framebuffer : m_framebuffers)
+        framebuffer.reset();
+    for (auto& program : m_programs)
+        program.reset();
+    m_context->doneCurrent();
+}
+
+void TestGLStateTracker::restoresTouchedState()
+{
+    GLStateTracker tracker;
+    tracker.begin(m_context.get());
+
+    // Binding before selecting a unit goes to the unit that was active
+    tracker.bindTexture(m_textures[3]);
+    tracker.setActiveTexture(GL_TEXTURE0);
+    tracker.bindTexture(m_textures[1]);
+    tracker.setActiveTexture(GL_TEXTURE3);
+    tracker.bindTexture(m_textures[0]);
+    tracker.bindFramebuffer(m_framebuffers[1]->handle());
+    tracker.setViewport(0, 0, 16, 16);
+    tracker.setScissor(0, 0, 8, 8);
+    tracker.setClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    tracker.useProgram(m_programs[1]->programId());
+    tracker.bindArrayBuffer(m_buffers[1]);
+
+    const GLState changed = currentState(gl());
+    QCOMPARE(changed.framebuffer, GLint(m_framebuffers[1]->handle()));
+    QCOMPARE(changed.activeTexture, GLint(GL_TEXTURE3));
+    QCOMPARE(changed.textures[0], GLint(m_textures[1]));
+    QCOMPARE(changed.textures[1], GLint(m_textures[3]));
+    QCOMPARE(changed.textures[3], GLint(m_textures[0]));
+
+    tracker.end();
+
+    const QString difference = stateDifference(currentState(gl()), m_initial);
+    QVERIFY2(difference.isEmpty(), qPrintable(difference));
+}
+
+void TestGLStateTracker::nestedScopes()
+{
+    GLStateTracker tracker;
+    tracker.begin(m_context.get());
+    tracker.setViewport(0, 0, 16, 16);
+
+    tracker.begin(m_context.get());
+    tracker.bindFramebuffer(m_framebuffers[1]->handle());
+    tracker.end();
+
+    // Only the outermost scope restores
+    const GLState inner = currentState(gl());
+    QCOMPARE(inner.framebuffer, GLint(m_framebuffers[1]->handle()));
+    QCOMPARE(inner.viewport[2], 16);
+
+    tracker.end();
+
+    const QString difference = stateDifference(currentState(gl()), m_initial);
+    QVERIFY2(difference.isEmpty(), qPrintable(difference));
+}
+
+void TestGLStateTracker::keepsRequestedState()
+{
+    GLStateTracker tracker;
+    tracker.begin(m_context.get());
+    tracker.bindFramebuffer(m_framebuffers[1]->handle());
+    tracker.setViewport(0, 0, 16, 16);
+    tracker.bindTexture(m_textures[3]);
+    tracker.setActiveTexture(GL_TEXTURE0);
+    tracker.bindTexture(m_textures[3]);
+    tracker.end(GLStateTracker::FramebufferBinding | GLStateTracker::TextureBinding);
+
+    // The binding kept is the one of the unit active at begin(), the other unit is restored
+    GLState expected = m_initial;
+    expected.framebuffer = m_framebuffers[1]->handle();
+    expected.textures[1] = m_textures[3];
+
+    const QString difference = stateDifference(currentState(gl()), expected);
+    QVERIFY2(difference.isEmpty(), qPrintable(difference));
+}
+
+void TestGLStateTracker::restoresInvalidatedState()
+{
+    GLStateTracker tracker;
+    tracker.begin(m_context.get());
+    tracker.invalidate(GLStateTracker::FramebufferBinding | GLStateTracker::Program);
+
+    // Changes made behind the tracker's back, like a QOpenGLFramebufferObject being created
+    gl()->glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffers[1]->handle());
+    gl()->glUseProgram(m_programs[1]->programId());
+
+    // Binding what the tracker saved has to reach GL, since it doesn't know the current value
+    tracker.useProgram(m_programs[0]->programId());
+    QCOMPARE(currentState(gl()).program, GLint(m_programs[0]->programId()));
+
+    tracker.end();
+
+    const QString difference = stateDifference(currentState(gl()), m_initial);
+    QVERIFY2(difference.isEmpty(), qPrintable(difference));
+}
+
+void TestGLStateTracker::leavesUntouchedState()
+{
+    GLStateTracker tracker;
+    tracker.begin(m_context.get());
+    tracker.setViewport(0, 0, 16, 16);
+
+    // The tracker never saw the clear color, so it must not reset it either
+    gl()->glClearColor(1.0f, 0.0f, 0.0f, 1.0f);
+
+    tracker.end();
+
+    GLState expected = m_initial;
+    std::fill(std::begin(expected.clearColor), std::end(expected.clearColor), 0.0f);
+    expected.clearColor[0] = expected.clearColor[3] = 1.0f;
+
+    const QString difference = stateDifference(currentState(gl()), expected);
+    QVERIFY2(difference.isEmpty(), qPrintable(difference));
+}
+
+QTEST_MAIN(TestGLStateTracker)
+
+#include "tst_glstatetracker.moc"
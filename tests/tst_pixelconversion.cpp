@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2022 UBports Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pixelconversion.h"
+
+#include <QtTest>
+
+#include <vector>
+
+// Guard bytes around each destination row catch kernels writing past their tail
+static const int guardSize = 64;
+static const uint8_t guardByte = 0xa5;
+
+// Random pixels, with transparent and opaque alpha values overrepresented since the kernels special-case them
+static std::vector<uint8_t> testPixels(const int count)
+{
+    std::vector<uint8_t> pixels(count * 4 + 1);
+    quint32 seed = count + 1;
+    for (size_t i = 0; i < pixels.size(); i++) {
+        seed = seed * 1103515245 + 12345;
+        pixels[i] = seed >> 16;
+        if (i % 4 == 3 && (seed & 0x300) == 0)
+            pixels[i] = (seed & 0x400) ? 0xff : 0x00;
+    }
+    return pixels;
+}
+
+static QString conversionName(const unsigned int conversion)
+{
+    QStringList flags;
+    if (conversion & PixelConversion_SwapRedBlue)
+        flags << QStringLiteral("swap");
+    if (conversion & PixelConversion_ForceOpaque)
+        flags << QStringLiteral("opaque");
+    if (conversion & PixelConversion_Premultiply)
+        flags << QStringLiteral("premultiply");
+    if (conversion & PixelConversion_ExpandRGB888)
+        flags << QStringLiteral("expand");
+    return flags.isEmpty() ? QStringLiteral("none") : flags.join(QLatin1Char('+'));
+}
+
+class TestPixelConversion : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void scalarPremultiply();
+    void kernels_data();
+    void kernels();
+    void inPlace_data();
+    void inPlace();
+};
+
+void TestPixelConversion::scalarPremultiply()
+{
+    // The reference the SIMD kernels are held to has to agree with Qt's own premultiplication
+    std::vector<uint8_t> src;
+    for (int alpha = 0; alpha < 256; alpha++) {
+        for (int channel = 0; channel < 256; channel++) {
+            const uint8_t pixel[] = { uint8_t(channel), uint8_t(255 - channel), uint8_t(channel ^ alpha), uint8_t(alpha) };
+            src.insert(src.end(), pixel, pixel + 4);
+        }
+    }
+
+    std::vector<uint8_t> dst(src.size());
+    convertPixelsScalar(dst.data(), src.data(), src.size() / 4, PixelConversion_Premultiply);
+
+    for (size_t i = 0; i < src.size(); i += 4) {
+        const QRgb expected = qPremultiply(qRgba(src[i], src[i + 1], src[i + 2], src[i + 3]));
+        const QRgb actual = qRgba(dst[i], dst[i + 1], dst[i + 2], dst[i + 3]);
+        if (actual != expected) {
+            QFAIL(qPrintable(QStringLiteral("Premultiplying %1 gives %2 instead of %3")
+                             .arg(qRgba(src[i], src[i + 1], src[i + 2], src[i + 3]), 8, 16, QLatin1Char('0'))
+                             .arg(actual, 8, 16, QLatin1Char('0')).arg(expected, 8, 16, QLatin1Char('0'))));
+        }
+    }
+}
+
+void TestPixelConversion::kernels_data()
+{
+    if (pixelConversionBackends().size() == 1)
+        QSKIP("No SIMD kernels for this CPU");
+
+    QTest::addColumn<QByteArray>("backend");
+    QTest::addColumn<unsigned int>("conversion");
+
+    for (const char* backend : pixelConversionBackends()) {
+        if (qstrcmp(backend, "scalar") == 0)
+            continue;
+        for (unsigned int conversion = 0; conversion < PixelConversion_Invalid; conversion++) {
+            QTest::newRow(qPrintable(QStringLiteral("%1/%2").arg(QLatin1String(backend), conversionName(conversion))))
+                << QByteArray(backend) << conversion;
+        }
+    }
+}
+
+void TestPixelConversion::kernels()
+{
+    QFETCH(QByteArray, backend);
+    QFETCH(unsigned int, conversion);
+
+    // Every length up to a few full AVX2 iterations hits each tail size, the large ones the unrolled loops.
+    // Sources and destinations are misaligned as rows of odd-width 3 byte images would be.
+    std::vector<int> counts;
+    for (int count = 0; count <= 80; count++)
+        counts.push_back(count);
+    counts.insert(counts.end(), { 127, 255, 1021, 4099 });
+
+    for (const int count : counts) {
+        for (const int offset : { 0, 1, 3 }) {
+            const std::vector<uint8_t> src = testPixels(count + 1);
+            std::vector<uint8_t> expected(count * 4 + guardSize * 2, guardByte);
+            std::vector<uint8_t> actual(count * 4 + guardSize * 2 + offset, guardByte);
+
+            convertPixelsScalar(expected.data() + guardSize, src.data() + offset, count, conversion);
+            QVERIFY(convertPixelsWithBackend(backend.constData(), actual.data() + guardSize + offset, src.data() + offset, count, conversion));
+
+            if (memcmp(expected.data(), actual.data() + offset, expected.size()) != 0) {
+                int i = 0;
+                while (expected[i] == actual[i + offset])
+                    i++;
+                QFAIL(qPrintable(QStringLiteral("%1 pixels at offset %2 differ from scalar at byte %3: %4 instead of %5")
+                                 .arg(count).arg(offset).arg(i - guardSize).arg(actual[i + offset]).arg(expected[i])));
+            }
+        }
+    }
+}
+
+void TestPixelConversion::inPlace_data()
+{
+    QTest::addColumn<QByteArray>("backend");
+    QTest::addColumn<unsigned int>("conversion");
+
+    for (const char* backend : pixelConversionBackends()) {
+        for (unsigned int conversion = 0; conversion < PixelConversion_Invalid; conversion++) {
+            // Expanding 3 byte pixels can't happen in place
+            if (conversion & PixelConversion_ExpandRGB888)
+                continue;
+            QTest::newRow(qPrintable(QStringLiteral("%1/%2").arg(QLatin1String(backend), conversionName(conversion))))
+                << QByteArray(backend) << conversion;
+        }
+    }
+}
+
+void TestPixelConversion::inPlace()
+{
+    QFETCH(QByteArray, backend);
+    QFETCH(unsigned int, conversion);
+
+    for (const int count : { 1, 7, 33, 257 }) {
+        const std::vector<uint8_t> src = testPixels(count);
+        std::vector<uint8_t> expected(count * 4);
+        std::vector<uint8_t> actual(src.begin(), src.begin() + count * 4);
+
+        convertPixelsScalar(expected.data(), src.data(), count, conversion);
+        QVERIFY(convertPixelsWithBackend(backend.constData(), actual.data(), actual.data(), count, conversion));
+        QVERIFY2(actual == expected, qPrintable(QStringLiteral("%1 pixels differ from an out of place conversion").arg(count)));
+    }
+}
+
+QTEST_MAIN(TestPixelConversion)
+
+#include "tst_pixelconversion.moc"